@@ -0,0 +1,862 @@
+/*
+ * i2s_bench.c - Throughput and latency benchmarks for libi2s, the driver
+ * and i2sd
+ *
+ * Every benchmark repeats its loop until it has run for the minimum
+ * time, the way Google Benchmark does, and the results can be written
+ * as JSON in Google Benchmark's format so they can be tracked across
+ * releases. Benchmarks that need the device, a loopback from playback
+ * to capture or a running daemon report an error when it is missing.
+ */
+
+#include "libi2s.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <regex.h>
+#include <stdarg.h>
+#include <math.h>
+
+#define BENCH_MAX_ITERATIONS 1000000000ULL
+#define BENCH_MAX_IO 16384
+#define BENCH_MAX_SAMPLES 1024
+
+/* Device setup: fast enough that the rings turn over quickly */
+#define BENCH_RATE 192000
+#define BENCH_FRAME_BYTES 8         /* S32_LE stereo */
+
+/* Round trip: the impulse, and how long to look for it */
+#define BENCH_IMPULSE (1 << 30)
+#define BENCH_IMPULSE_GAP 8         /* periods of silence between impulses */
+#define BENCH_LOOPBACK_TIMEOUT_NS 1000000000ULL
+
+/* The mixer benchmark does what one i2sd period does */
+#define BENCH_MIX_FRAMES 256
+#define BENCH_MIX_SAMPLES (BENCH_MIX_FRAMES * 2)
+#define BENCH_MIX_MAX_CLIENTS 16
+
+#define BENCH_CONVERT_SAMPLES 4096
+#define BENCH_RESAMPLE_FRAMES 1024
+
+/* Test signals for a 16-slot TDM board, one period at a time */
+#define BENCH_SIGNAL_FRAMES 256
+#define BENCH_SIGNAL_CHANNELS 16
+
+/* What one run of a benchmark sees, like benchmark::State */
+struct bench_state {
+    uint64_t iterations;
+    uint64_t done;
+    
+    /* Timing of the loop, paused around work that is not measured */
+    int timing;
+    uint64_t real_start;
+    uint64_t cpu_start;
+    uint64_t real_ns;
+    uint64_t cpu_ns;
+    
+    /* Work done, for the rates */
+    uint64_t bytes;
+    uint64_t items;
+    
+    /* Per-iteration latencies, for the distribution */
+    uint64_t samples[BENCH_MAX_SAMPLES];
+    size_t nsamples;
+    
+    char error[128];
+};
+
+struct bench {
+    const char *name;
+    void (*run)(struct bench_state *st, const struct bench *bm);
+    long arg;
+    uint64_t iterations;        /* fixed count, 0 = until the minimum time */
+};
+
+struct bench_result {
+    const struct bench *bm;
+    uint64_t iterations;
+    double real_ns;             /* per iteration */
+    double cpu_ns;
+    double bytes_per_second;
+    double items_per_second;
+    size_t nsamples;
+    uint64_t p50, p90, p99, max;
+    char error[128];
+};
+
+static const char *device;
+static double min_time = 0.5;
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void bench_resume(struct bench_state *st)
+{
+    st->timing = 1;
+    st->real_start = clock_ns(CLOCK_MONOTONIC);
+    st->cpu_start = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+static void bench_pause(struct bench_state *st)
+{
+    if (!st->timing)
+        return;
+    st->real_ns += clock_ns(CLOCK_MONOTONIC) - st->real_start;
+    st->cpu_ns += clock_ns(CLOCK_PROCESS_CPUTIME_ID) - st->cpu_start;
+    st->timing = 0;
+}
+
+/* The timed loop, for (auto _ : state): true once per iteration */
+static int bench_next(struct bench_state *st)
+{
+    if (!st->done && !st->timing)
+        bench_resume(st);
+    if (st->done < st->iterations && !st->error[0]) {
+        st->done++;
+        return 1;
+    }
+    bench_pause(st);
+    return 0;
+}
+
+static void bench_error(struct bench_state *st, const char *fmt, ...)
+{
+    va_list ap;
+    
+    bench_pause(st);
+    va_start(ap, fmt);
+    vsnprintf(st->error, sizeof(st->error), fmt, ap);
+    va_end(ap);
+}
+
+static void bench_sample(struct bench_state *st, uint64_t ns)
+{
+    if (st->nsamples < BENCH_MAX_SAMPLES)
+        st->samples[st->nsamples++] = ns;
+}
+
+/* One direction (or both, with stream -1) in the benchmark format */
+static i2s_handle_t bench_open(struct bench_state *st, int stream,
+                               int period_frames, int periods)
+{
+    i2s_params_t params = {
+        BENCH_RATE, I2S_FORMAT_S32_LE, 2, period_frames, periods, 0
+    };
+    i2s_handle_t handle;
+    
+    if (stream < 0)
+        handle = i2s_open(device);
+    else
+        handle = i2s_open_stream(device, (i2s_stream_t)stream);
+    if (!handle) {
+        bench_error(st, "cannot open %s: %s", device ? device : "the device",
+                    strerror(errno));
+        return NULL;
+    }
+    
+    if (i2s_set_params(handle, &params) < 0) {
+        bench_error(st, "%s", i2s_get_error(handle));
+        i2s_close(handle);
+        return NULL;
+    }
+    
+    return handle;
+}
+
+/* Wait, untimed, until the ring has room or data for one transfer */
+static int bench_wait(struct bench_state *st, i2s_handle_t handle, short events)
+{
+    struct pollfd pfd = { .fd = i2s_get_fd(handle), .events = events };
+    int ret;
+    
+    bench_pause(st);
+    for (;;) {
+        ret = poll(&pfd, 1, 1000);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            bench_error(st, "device does not move");
+            return -1;
+        }
+        if (!(pfd.revents & POLLERR))
+            break;
+        if (i2s_recover(handle) < 0) {
+            bench_error(st, "%s", i2s_get_error(handle));
+            return -1;
+        }
+    }
+    bench_resume(st);
+    return 0;
+}
+
+/*
+ * write() of arg bytes into a ring that always has room for them, so
+ * only the syscall and the copy are timed, not the hardware draining it
+ */
+static void bm_write(struct bench_state *st, const struct bench *bm)
+{
+    static char buf[BENCH_MAX_IO];
+    size_t size = (size_t)bm->arg;
+    i2s_handle_t handle;
+    ssize_t n;
+    
+    handle = bench_open(st, I2S_STREAM_PLAYBACK, 1024, 8);
+    if (!handle)
+        return;
+    
+    i2s_set_xrun_policy(handle, I2S_XRUN_SILENCE);
+    i2s_set_buffering(handle, 1024, 8, 1024, (int)(size / BENCH_FRAME_BYTES));
+    i2s_set_nonblock(handle, 1);
+    
+    while (bench_next(st)) {
+        if (bench_wait(st, handle, POLLOUT) < 0)
+            break;
+        n = i2s_write(handle, buf, size);
+        if (n < 0 && errno == EPIPE && i2s_recover(handle) == 0)
+            continue;
+        if (n != (ssize_t)size) {
+            bench_error(st, "write: %s", i2s_get_error(handle));
+            break;
+        }
+        st->bytes += size;
+    }
+    
+    i2s_close(handle);
+}
+
+static void bm_read(struct bench_state *st, const struct bench *bm)
+{
+    static char buf[BENCH_MAX_IO];
+    size_t size = (size_t)bm->arg;
+    i2s_handle_t handle;
+    ssize_t n;
+    
+    handle = bench_open(st, I2S_STREAM_CAPTURE, 1024, 8);
+    if (!handle)
+        return;
+    
+    i2s_set_buffering(handle, 1024, 8, 0, (int)(size / BENCH_FRAME_BYTES));
+    i2s_set_nonblock(handle, 1);
+    if (i2s_start(handle) < 0) {
+        bench_error(st, "%s", i2s_get_error(handle));
+        i2s_close(handle);
+        return;
+    }
+    
+    while (bench_next(st)) {
+        if (bench_wait(st, handle, POLLIN) < 0)
+            break;
+        n = i2s_read(handle, buf, size);
+        if (n < 0 && errno == EPIPE && i2s_recover(handle) == 0)
+            continue;
+        if (n != (ssize_t)size) {
+            bench_error(st, "read: %s", i2s_get_error(handle));
+            break;
+        }
+        st->bytes += size;
+    }
+    
+    i2s_close(handle);
+}
+
+/*
+ * Playback to capture: one impulse per iteration, timed from the write()
+ * that queued it to the read() that returned it, less the frames read
+ * after it. Needs the output wired back to the input, or a loopback.
+ */
+static void bm_roundtrip(struct bench_state *st, const struct bench *bm)
+{
+    const int period = (int)bm->arg;
+    const size_t period_bytes = (size_t)period * BENCH_FRAME_BYTES;
+    int32_t out[BENCH_MAX_IO / sizeof(int32_t)];
+    int32_t in[BENCH_MAX_IO / sizeof(int32_t)];
+    struct pollfd pfd;
+    i2s_handle_t handle;
+    uint64_t sent_ns = 0, now;
+    int pending = 0, gap = 0, found, frames, k;
+    ssize_t n;
+    
+    handle = bench_open(st, -1, period, 4);
+    if (!handle)
+        return;
+    
+    /* Queue a period first, so playback does not start empty */
+    memset(out, 0, sizeof(out));
+    i2s_set_xrun_policy(handle, I2S_XRUN_SILENCE);
+    i2s_set_buffering(handle, period, 4, 2 * period, period);
+    i2s_set_nonblock(handle, 1);
+    if (i2s_write(handle, out, period_bytes) < 0 || i2s_start(handle) < 0) {
+        bench_error(st, "%s", i2s_get_error(handle));
+        i2s_close(handle);
+        return;
+    }
+    
+    pfd.fd = i2s_get_fd(handle);
+    pfd.events = POLLIN | POLLOUT;
+    
+    while (bench_next(st)) {
+        for (found = 0; !found && !st->error[0]; ) {
+            if (poll(&pfd, 1, 1000) <= 0) {
+                bench_error(st, "device does not move");
+                break;
+            }
+            if ((pfd.revents & POLLERR) && i2s_recover(handle) < 0) {
+                bench_error(st, "%s", i2s_get_error(handle));
+                break;
+            }
+            
+            if (pfd.revents & POLLOUT) {
+                memset(out, 0, period_bytes);
+                if (!pending && ++gap >= BENCH_IMPULSE_GAP)
+                    out[0] = out[1] = BENCH_IMPULSE;
+                n = i2s_write(handle, out, period_bytes);
+                if (n > 0 && out[0]) {
+                    sent_ns = clock_ns(CLOCK_MONOTONIC);
+                    pending = 1;
+                    gap = 0;
+                }
+            }
+            
+            if (!(pfd.revents & POLLIN))
+                continue;
+            n = i2s_read(handle, in, period_bytes);
+            if (n <= 0)
+                continue;
+            now = clock_ns(CLOCK_MONOTONIC);
+            if (!pending)
+                continue;
+            
+            frames = (int)(n / BENCH_FRAME_BYTES);
+            for (k = 0; k < frames; k++) {
+                if (in[2 * k] > BENCH_IMPULSE / 2 || in[2 * k] < -BENCH_IMPULSE / 2)
+                    break;
+            }
+            if (k < frames) {
+                bench_sample(st, now - sent_ns -
+                             (uint64_t)(frames - 1 - k) * 1000000000ULL / BENCH_RATE);
+                pending = 0;
+                found = 1;
+            } else if (now - sent_ns > BENCH_LOOPBACK_TIMEOUT_NS) {
+                bench_error(st, "no impulse on capture; needs a loopback");
+            }
+        }
+    }
+    
+    i2s_close(handle);
+}
+
+/* ioctl and cache cost on an idle playback stream */
+static void bm_control(struct bench_state *st, const struct bench *bm)
+{
+    i2s_handle_t handle;
+    i2s_position_t pos;
+    i2s_params_t params;
+    i2s_tdm_t tdm;
+    int ret = 0;
+    
+    handle = bench_open(st, I2S_STREAM_PLAYBACK, 1024, 8);
+    if (!handle)
+        return;
+    
+    while (bench_next(st)) {
+        switch (bm->arg) {
+        case 0:
+            ret = i2s_get_position(handle, I2S_STREAM_PLAYBACK, &pos);
+            break;
+        case 1:
+            ret = i2s_get_tdm(handle, &tdm);
+            break;
+        case 2:
+            ret = i2s_get_params(handle, &params);
+            break;
+        default:
+            ret = i2s_get_status(handle) == I2S_STATUS_ERROR ? -1 : 0;
+            break;
+        }
+        if (ret < 0) {
+            bench_error(st, "%s", i2s_get_error(handle));
+            break;
+        }
+        st->items++;
+    }
+    
+    i2s_close(handle);
+}
+
+/* Requests per second to i2sd, arg to a batch */
+static void bm_daemon(struct bench_state *st, const struct bench *bm)
+{
+    i2s_daemon_request_t requests[16];
+    size_t count = (size_t)bm->arg, i;
+    int sock, ret;
+    
+    sock = i2s_daemon_connect();
+    if (sock < 0) {
+        bench_error(st, "cannot reach i2sd: %s", strerror(errno));
+        return;
+    }
+    
+    while (bench_next(st)) {
+        if (count <= 1) {
+            ret = i2s_daemon_send_command(sock, I2S_DAEMON_GET_STATUS, 0);
+        } else {
+            for (i = 0; i < count; i++) {
+                requests[i].cmd = I2S_DAEMON_GET_STATUS;
+                requests[i].param = 0;
+            }
+            ret = i2s_daemon_batch(sock, requests, count);
+        }
+        if (ret != 0) {
+            bench_error(st, "request failed: %d", ret);
+            break;
+        }
+        st->items += count;
+    }
+    
+    i2s_daemon_disconnect(sock);
+}
+
+static const struct {
+    i2s_sample_t src;
+    i2s_sample_t dst;
+    unsigned int flags;
+} bench_conversions[] = {
+    { I2S_SAMPLE_FLOAT32, I2S_SAMPLE_S16, 0 },
+    { I2S_SAMPLE_FLOAT32, I2S_SAMPLE_S16, I2S_CONVERT_DITHER },
+    { I2S_SAMPLE_S16, I2S_SAMPLE_FLOAT32, 0 },
+    { I2S_SAMPLE_FLOAT32, I2S_SAMPLE_S24_3LE, 0 },
+    { I2S_SAMPLE_S24_LE, I2S_SAMPLE_FLOAT32, 0 },
+    { I2S_SAMPLE_S32, I2S_SAMPLE_S16, I2S_CONVERT_DITHER },
+};
+
+static void bm_convert(struct bench_state *st, const struct bench *bm)
+{
+    static float src[BENCH_CONVERT_SAMPLES], dst[BENCH_CONVERT_SAMPLES];
+    size_t i;
+    
+    for (i = 0; i < BENCH_CONVERT_SAMPLES; i++)
+        src[i] = (float)((int)(i % 200) - 100) / 128.0f;
+    
+    /* Integer sources just see the float bit patterns; any value will do */
+    while (bench_next(st)) {
+        i2s_convert(dst, bench_conversions[bm->arg].dst,
+                    src, bench_conversions[bm->arg].src,
+                    BENCH_CONVERT_SAMPLES, bench_conversions[bm->arg].flags);
+        st->items += BENCH_CONVERT_SAMPLES;
+        st->bytes += BENCH_CONVERT_SAMPLES *
+                     i2s_sample_size(bench_conversions[bm->arg].src);
+    }
+}
+
+/*
+ * One i2sd period for arg clients: convert each client's S16 period,
+ * sum, apply the gain and convert back with saturation
+ */
+static void bm_mix(struct bench_state *st, const struct bench *bm)
+{
+    static int16_t pcm[BENCH_MIX_MAX_CLIENTS][BENCH_MIX_SAMPLES];
+    float in[BENCH_MIX_SAMPLES], mix[BENCH_MIX_SAMPLES];
+    int16_t out[BENCH_MIX_SAMPLES];
+    int clients = (int)bm->arg, c;
+    size_t i;
+    
+    for (c = 0; c < clients; c++)
+        for (i = 0; i < BENCH_MIX_SAMPLES; i++)
+            pcm[c][i] = (int16_t)((i * 97 + (size_t)c * 31) % 4096 - 2048);
+    
+    while (bench_next(st)) {
+        memset(mix, 0, sizeof(mix));
+        for (c = 0; c < clients; c++) {
+            i2s_convert(in, I2S_SAMPLE_FLOAT32, pcm[c], I2S_SAMPLE_S16,
+                        BENCH_MIX_SAMPLES, 0);
+            for (i = 0; i < BENCH_MIX_SAMPLES; i++)
+                mix[i] += in[i];
+        }
+        for (i = 0; i < BENCH_MIX_SAMPLES; i++)
+            mix[i] *= 0.8f;
+        i2s_convert(out, I2S_SAMPLE_S16, mix, I2S_SAMPLE_FLOAT32,
+                    BENCH_MIX_SAMPLES, I2S_CONVERT_SATURATE);
+        st->items += BENCH_MIX_FRAMES;
+    }
+}
+
+/* 44.1 kHz stereo to 48 kHz at quality arg, in output frames */
+static void bm_resample(struct bench_state *st, const struct bench *bm)
+{
+    static float in[BENCH_RESAMPLE_FRAMES * 2], out[BENCH_RESAMPLE_FRAMES * 4];
+    i2s_resampler_t rs;
+    size_t in_frames, out_frames, i;
+    
+    rs = i2s_resampler_create(44100, 48000, 2, (i2s_resample_quality_t)bm->arg);
+    if (!rs) {
+        bench_error(st, "cannot create resampler: %s", strerror(errno));
+        return;
+    }
+    
+    for (i = 0; i < BENCH_RESAMPLE_FRAMES * 2; i++)
+        in[i] = (float)((int)(i % 100) - 50) / 64.0f;
+    
+    while (bench_next(st)) {
+        in_frames = BENCH_RESAMPLE_FRAMES;
+        out_frames = BENCH_RESAMPLE_FRAMES * 2;
+        i2s_resample(rs, in, &in_frames, out, &out_frames);
+        st->items += out_frames;
+    }
+    
+    i2s_resampler_destroy(rs);
+}
+
+/*
+ * One S32 period of 16 channels: arg 0 is sin() per sample as
+ * i2s_example.c used to do it, then a shared sine, a different sine on
+ * every channel, a three-tone signal and pink noise
+ */
+static void bm_signal(struct bench_state *st, const struct bench *bm)
+{
+    static int32_t out[BENCH_SIGNAL_FRAMES * BENCH_SIGNAL_CHANNELS];
+    static float block[BENCH_SIGNAL_FRAMES * BENCH_SIGNAL_CHANNELS];
+    i2s_signal_config_t config;
+    i2s_signal_t sig;
+    uint64_t frame = 0;
+    size_t i;
+    int ch;
+    
+    sig = i2s_signal_create(48000, BENCH_SIGNAL_CHANNELS);
+    if (!sig) {
+        bench_error(st, "cannot create signal: %s", strerror(errno));
+        return;
+    }
+    
+    memset(&config, 0, sizeof(config));
+    config.amplitude = 0.5;
+    switch (bm->arg) {
+    case 1:
+        config.type = I2S_SIGNAL_SINE;
+        config.freq = 997.0;
+        i2s_signal_set(sig, -1, &config);
+        break;
+    case 2:
+        i2s_signal_set_ladder(sig, 1000.0, 100.0, 0.5);
+        break;
+    case 3:
+        config.type = I2S_SIGNAL_MULTITONE;
+        config.ntones = 3;
+        config.tones[0] = (i2s_tone_t){ 100.0, 0.5, 0.0 };
+        config.tones[1] = (i2s_tone_t){ 1000.0, 0.3, 0.0 };
+        config.tones[2] = (i2s_tone_t){ 10000.0, 0.2, 0.0 };
+        i2s_signal_set(sig, -1, &config);
+        break;
+    case 4:
+        config.type = I2S_SIGNAL_PINK_NOISE;
+        i2s_signal_set(sig, -1, &config);
+        break;
+    }
+    
+    while (bench_next(st)) {
+        if (bm->arg == 0) {
+            for (i = 0; i < BENCH_SIGNAL_FRAMES; i++, frame++)
+                for (ch = 0; ch < BENCH_SIGNAL_CHANNELS; ch++)
+                    block[i * BENCH_SIGNAL_CHANNELS + ch] = (float)(0.5 *
+                        sin(2.0 * M_PI * (1000.0 + 100.0 * ch) * frame / 48000.0));
+            i2s_convert(out, I2S_SAMPLE_S32, block, I2S_SAMPLE_FLOAT32,
+                        BENCH_SIGNAL_FRAMES * BENCH_SIGNAL_CHANNELS, 0);
+        } else {
+            i2s_signal_generate(sig, out, I2S_SAMPLE_S32, BENCH_SIGNAL_FRAMES, 0);
+        }
+        st->items += BENCH_SIGNAL_FRAMES * BENCH_SIGNAL_CHANNELS;
+    }
+    
+    i2s_signal_destroy(sig);
+}
+
+static const struct bench benches[] = {
+    { "BM_Write/256", bm_write, 256, 0 },
+    { "BM_Write/1024", bm_write, 1024, 0 },
+    { "BM_Write/4096", bm_write, 4096, 0 },
+    { "BM_Write/16384", bm_write, 16384, 0 },
+    { "BM_Read/256", bm_read, 256, 0 },
+    { "BM_Read/1024", bm_read, 1024, 0 },
+    { "BM_Read/4096", bm_read, 4096, 0 },
+    { "BM_Read/16384", bm_read, 16384, 0 },
+    { "BM_RoundTrip/64", bm_roundtrip, 64, 200 },
+    { "BM_RoundTrip/256", bm_roundtrip, 256, 200 },
+    { "BM_GetPosition", bm_control, 0, 0 },
+    { "BM_GetTdm", bm_control, 1, 0 },
+    { "BM_GetParamsCached", bm_control, 2, 0 },
+    { "BM_GetStatus", bm_control, 3, 0 },
+    { "BM_DaemonRequest", bm_daemon, 1, 0 },
+    { "BM_DaemonBatch/16", bm_daemon, 16, 0 },
+    { "BM_Convert/f32_s16", bm_convert, 0, 0 },
+    { "BM_Convert/f32_s16_dither", bm_convert, 1, 0 },
+    { "BM_Convert/s16_f32", bm_convert, 2, 0 },
+    { "BM_Convert/f32_s24_3le", bm_convert, 3, 0 },
+    { "BM_Convert/s24_f32", bm_convert, 4, 0 },
+    { "BM_Convert/s32_s16_dither", bm_convert, 5, 0 },
+    { "BM_Mix/1", bm_mix, 1, 0 },
+    { "BM_Mix/4", bm_mix, 4, 0 },
+    { "BM_Mix/16", bm_mix, 16, 0 },
+    { "BM_Resample/fast", bm_resample, I2S_RESAMPLE_FAST, 0 },
+    { "BM_Resample/medium", bm_resample, I2S_RESAMPLE_MEDIUM, 0 },
+    { "BM_Resample/best", bm_resample, I2S_RESAMPLE_BEST, 0 },
+    { "BM_Signal/libm_sin", bm_signal, 0, 0 },
+    { "BM_Signal/sine", bm_signal, 1, 0 },
+    { "BM_Signal/ladder", bm_signal, 2, 0 },
+    { "BM_Signal/multitone", bm_signal, 3, 0 },
+    { "BM_Signal/pink_noise", bm_signal, 4, 0 },
+};
+
+#define BENCH_COUNT (sizeof(benches) / sizeof(benches[0]))
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Run one benchmark, growing the iteration count until a run takes the
+ * minimum time: 40% past it from the last run's rate, at most 10x
+ */
+static void bench_run(const struct bench *bm, struct bench_result *res)
+{
+    static struct bench_state st;
+    const double target_ns = min_time * 1e9;
+    uint64_t iterations = bm->iterations ? bm->iterations : 1, next;
+    double multiplier, seconds;
+    
+    for (;;) {
+        memset(&st, 0, sizeof(st));
+        st.iterations = iterations;
+        bm->run(&st, bm);
+        
+        if (st.error[0] || bm->iterations || st.real_ns >= target_ns ||
+            iterations >= BENCH_MAX_ITERATIONS)
+            break;
+        
+        multiplier = 10.0;
+        if (st.real_ns > target_ns / 10.0)
+            multiplier = target_ns * 1.4 / (double)st.real_ns;
+        next = (uint64_t)((double)iterations * multiplier);
+        iterations = next > iterations ? next : iterations + 1;
+        if (iterations > BENCH_MAX_ITERATIONS)
+            iterations = BENCH_MAX_ITERATIONS;
+    }
+    
+    memset(res, 0, sizeof(*res));
+    res->bm = bm;
+    if (st.error[0]) {
+        snprintf(res->error, sizeof(res->error), "%s", st.error);
+        return;
+    }
+    
+    seconds = (double)st.real_ns / 1e9;
+    res->iterations = st.done;
+    res->real_ns = (double)st.real_ns / (double)st.done;
+    res->cpu_ns = (double)st.cpu_ns / (double)st.done;
+    if (seconds > 0.0) {
+        res->bytes_per_second = (double)st.bytes / seconds;
+        res->items_per_second = (double)st.items / seconds;
+    }
+    
+    if (st.nsamples) {
+        qsort(st.samples, st.nsamples, sizeof(st.samples[0]), cmp_u64);
+        res->nsamples = st.nsamples;
+        res->p50 = st.samples[st.nsamples / 2];
+        res->p90 = st.samples[st.nsamples * 9 / 10];
+        res->p99 = st.samples[st.nsamples * 99 / 100];
+        res->max = st.samples[st.nsamples - 1];
+    }
+}
+
+static void print_console_header(void)
+{
+    printf("%-30s %15s %15s %12s\n", "Benchmark", "Time", "CPU", "Iterations");
+    printf("--------------------------------------------------------------------------\n");
+}
+
+static void print_console(const struct bench_result *res)
+{
+    if (res->error[0]) {
+        printf("%-30s ERROR: %s\n", res->bm->name, res->error);
+        return;
+    }
+    
+    printf("%-30s %12.0f ns %12.0f ns %12llu", res->bm->name, res->real_ns,
+           res->cpu_ns, (unsigned long long)res->iterations);
+    if (res->bytes_per_second > 0.0)
+        printf(" bytes_per_second=%.4gM/s", res->bytes_per_second / 1e6);
+    if (res->items_per_second > 0.0)
+        printf(" items_per_second=%.4gM/s", res->items_per_second / 1e6);
+    if (res->nsamples)
+        printf(" p50=%lluus p99=%lluus max=%lluus",
+               (unsigned long long)(res->p50 / 1000),
+               (unsigned long long)(res->p99 / 1000),
+               (unsigned long long)(res->max / 1000));
+    printf("\n");
+}
+
+/* Google Benchmark's JSON output, with the latency distribution added */
+static void print_json(FILE *f, const char *executable,
+                       const struct bench_result *results, size_t count)
+{
+    char host[256] = "", date[64] = "";
+    time_t now = time(NULL);
+    struct tm tm;
+    size_t i;
+    
+    gethostname(host, sizeof(host) - 1);
+    localtime_r(&now, &tm);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", &tm);
+    
+    fprintf(f, "{\n  \"context\": {\n");
+    fprintf(f, "    \"date\": \"%s\",\n", date);
+    fprintf(f, "    \"host_name\": \"%s\",\n", host);
+    fprintf(f, "    \"executable\": \"%s\",\n", executable);
+    fprintf(f, "    \"num_cpus\": %ld,\n", sysconf(_SC_NPROCESSORS_ONLN));
+    fprintf(f, "    \"library_build_type\": \"release\",\n");
+    fprintf(f, "    \"convert_backend\": \"%s\"\n", i2s_convert_backend());
+    fprintf(f, "  },\n  \"benchmarks\": [");
+    
+    for (i = 0; i < count; i++) {
+        const struct bench_result *res = &results[i];
+        
+        fprintf(f, "%s\n    {\n", i ? "," : "");
+        fprintf(f, "      \"name\": \"%s\",\n", res->bm->name);
+        fprintf(f, "      \"run_name\": \"%s\",\n", res->bm->name);
+        fprintf(f, "      \"run_type\": \"iteration\",\n");
+        if (res->error[0]) {
+            fprintf(f, "      \"error_occurred\": true,\n");
+            fprintf(f, "      \"error_message\": \"%s\"\n    }", res->error);
+            continue;
+        }
+        fprintf(f, "      \"iterations\": %llu,\n",
+                (unsigned long long)res->iterations);
+        fprintf(f, "      \"real_time\": %.6e,\n", res->real_ns);
+        fprintf(f, "      \"cpu_time\": %.6e,\n", res->cpu_ns);
+        fprintf(f, "      \"time_unit\": \"ns\"");
+        if (res->bytes_per_second > 0.0)
+            fprintf(f, ",\n      \"bytes_per_second\": %.6e", res->bytes_per_second);
+        if (res->items_per_second > 0.0)
+            fprintf(f, ",\n      \"items_per_second\": %.6e", res->items_per_second);
+        if (res->nsamples)
+            fprintf(f, ",\n      \"latency_p50_ns\": %llu,\n"
+                    "      \"latency_p90_ns\": %llu,\n"
+                    "      \"latency_p99_ns\": %llu,\n"
+                    "      \"latency_max_ns\": %llu",
+                    (unsigned long long)res->p50, (unsigned long long)res->p90,
+                    (unsigned long long)res->p99, (unsigned long long)res->max);
+        fprintf(f, "\n    }");
+    }
+    
+    fprintf(f, "\n  ]\n}\n");
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-d device] [-f console|json] [-o file] "
+            "[-t min_time] [-F regex] [-l]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    static struct bench_result results[BENCH_COUNT];
+    const char *out_path = NULL, *filter = NULL;
+    size_t i, count = 0;
+    regex_t re;
+    int json = 0, list = 0, failed = 0;
+    int opt;
+    FILE *f;
+    
+    while ((opt = getopt(argc, argv, "d:f:o:t:F:l")) != -1) {
+        switch (opt) {
+        case 'd':
+            device = optarg;
+            break;
+        case 'f':
+            if (strcmp(optarg, "json") && strcmp(optarg, "console")) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            json = !strcmp(optarg, "json");
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 't':
+            min_time = atof(optarg);
+            if (min_time <= 0.0) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'F':
+            filter = optarg;
+            break;
+        case 'l':
+            list = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    
+    if (filter && regcomp(&re, filter, REG_EXTENDED | REG_NOSUB) != 0) {
+        fprintf(stderr, "Invalid filter: %s\n", filter);
+        return EXIT_FAILURE;
+    }
+    
+    if (!json && !list)
+        print_console_header();
+    
+    for (i = 0; i < BENCH_COUNT; i++) {
+        if (filter && regexec(&re, benches[i].name, 0, NULL, 0) != 0)
+            continue;
+        if (list) {
+            printf("%s\n", benches[i].name);
+            continue;
+        }
+        
+        bench_run(&benches[i], &results[count]);
+        if (results[count].error[0])
+            failed++;
+        if (!json) {
+            print_console(&results[count]);
+            fflush(stdout);
+        }
+        count++;
+    }
+    
+    if (filter)
+        regfree(&re);
+    if (list)
+        return EXIT_SUCCESS;
+    
+    if (json)
+        print_json(stdout, argv[0], results, count);
+    
+    if (out_path) {
+        f = fopen(out_path, "w");
+        if (!f) {
+            fprintf(stderr, "Cannot write %s: %s\n", out_path, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        print_json(f, argv[0], results, count);
+        fclose(f);
+    }
+    
+    /* Missing hardware or daemon is reported per benchmark, not fatal */
+    if (failed && !json)
+        printf("\n%d benchmark(s) could not run\n", failed);
+    return EXIT_SUCCESS;
+}
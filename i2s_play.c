@@ -0,0 +1,954 @@
+/*
+ * i2s_play.c - Stream WAV or raw files to and from an I2S device
+ *
+ * Installed as i2s_play and i2s_rec (a link to the same binary). The
+ * player maps the file and converts straight into the mapped playback
+ * ring, so the data is touched once between the page cache and the
+ * hardware and files of any size play in constant memory. The recorder
+ * converts from the mapped capture ring into one of two aligned buffers
+ * while a writer thread puts the other one to disk with O_DIRECT, so a
+ * slow disk never stalls the capture side until both are full.
+ */
+
+#define _GNU_SOURCE
+#include "libi2s.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define DEFAULT_DEVICE "/dev/i2s0"
+#define DEFAULT_PERIOD_FRAMES 1024
+#define DEFAULT_PERIODS 8
+
+/* Played file pages are dropped from the page cache every this many bytes */
+#define PLAY_DROP_BYTES (4 << 20)
+
+/* Recording: O_DIRECT alignment, the size of each of the two buffers,
+ * and the WAV header block in front of the data */
+#define REC_ALIGN 4096
+#define REC_BUFFER_BYTES (1 << 20)
+#define WAV_HEADER_BYTES REC_ALIGN
+
+/* WAV format tags */
+#define WAV_FORMAT_PCM 0x0001
+#define WAV_FORMAT_FLOAT 0x0003
+#define WAV_FORMAT_EXTENSIBLE 0xFFFE
+
+/* A RIFF size field this large means "see the ds64 chunk" (RF64) */
+#define WAV_SIZE_RF64 0xFFFFFFFFu
+
+/* Layout of the samples in a file */
+struct audio_format {
+    int rate;
+    int channels;
+    i2s_sample_t sample;
+};
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop_requested = 1;
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint16_t get_le16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+           (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get_le64(const uint8_t *p)
+{
+    return get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void put_le64(uint8_t *p, uint64_t v)
+{
+    put_le32(p, (uint32_t)v);
+    put_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+static const struct {
+    const char *name;
+    i2s_sample_t sample;
+} sample_names[] = {
+    { "s16", I2S_SAMPLE_S16 },
+    { "s24_3le", I2S_SAMPLE_S24_3LE },
+    { "s24", I2S_SAMPLE_S24_LE },
+    { "s32", I2S_SAMPLE_S32 },
+    { "f32", I2S_SAMPLE_FLOAT32 },
+};
+
+static int parse_sample(const char *name, i2s_sample_t *sample)
+{
+    size_t i;
+    
+    for (i = 0; i < sizeof(sample_names) / sizeof(sample_names[0]); i++) {
+        if (strcmp(name, sample_names[i].name) == 0) {
+            *sample = sample_names[i].sample;
+            return 0;
+        }
+    }
+    
+    return -1;
+}
+
+static const char *sample_name(i2s_sample_t sample)
+{
+    size_t i;
+    
+    for (i = 0; i < sizeof(sample_names) / sizeof(sample_names[0]); i++)
+        if (sample_names[i].sample == sample)
+            return sample_names[i].name;
+    return "?";
+}
+
+/* Significant bits of a sample format, to tell when conversion narrows */
+static int sample_bits(i2s_sample_t sample)
+{
+    switch (sample) {
+    case I2S_SAMPLE_S16:
+        return 16;
+    case I2S_SAMPLE_S24_3LE:
+    case I2S_SAMPLE_S24_LE:
+        return 24;
+    default:
+        return 32;
+    }
+}
+
+/* The device format that carries a file format without losing bits */
+static i2s_format_t device_format(i2s_sample_t sample, int bits)
+{
+    if (!bits)
+        bits = sample_bits(sample);
+    if (bits <= 16)
+        return I2S_FORMAT_S16_LE;
+    if (bits <= 24)
+        return I2S_FORMAT_S24_LE;
+    return I2S_FORMAT_S32_LE;
+}
+
+/*
+ * Find the format and the data chunk of a RIFF or RF64 WAV file. A data
+ * chunk that runs past the end of the file, as in a recording that was
+ * never finalized, is cut to what is there.
+ */
+static int wav_parse(const uint8_t *p, uint64_t len, struct audio_format *fmt,
+                     uint64_t *data_off, uint64_t *data_len)
+{
+    uint64_t off = 12, size, ds64_data = 0;
+    int rf64, have_fmt = 0;
+    uint16_t tag, bits, valid, align;
+    
+    if (len < 12 || memcmp(p + 8, "WAVE", 4) != 0)
+        return -1;
+    if (memcmp(p, "RIFF", 4) == 0)
+        rf64 = 0;
+    else if (memcmp(p, "RF64", 4) == 0)
+        rf64 = 1;
+    else
+        return -1;
+    
+    while (off + 8 <= len) {
+        size = get_le32(p + off + 4);
+        
+        if (memcmp(p + off, "ds64", 4) == 0 && size >= 16 && off + 24 <= len) {
+            ds64_data = get_le64(p + off + 16);
+        } else if (memcmp(p + off, "fmt ", 4) == 0 && size >= 16 &&
+                   off + 8 + size <= len) {
+            const uint8_t *f = p + off + 8;
+            
+            tag = get_le16(f);
+            fmt->channels = get_le16(f + 2);
+            fmt->rate = (int)get_le32(f + 4);
+            align = get_le16(f + 12);
+            bits = valid = get_le16(f + 14);
+            if (tag == WAV_FORMAT_EXTENSIBLE && size >= 40) {
+                valid = get_le16(f + 18);
+                tag = get_le16(f + 24);     /* the subformat GUID */
+            }
+            
+            if (fmt->channels <= 0 || align != fmt->channels * (bits / 8))
+                return -1;
+            if (tag == WAV_FORMAT_FLOAT && bits == 32)
+                fmt->sample = I2S_SAMPLE_FLOAT32;
+            else if (tag != WAV_FORMAT_PCM)
+                return -1;
+            else if (bits == 16)
+                fmt->sample = I2S_SAMPLE_S16;
+            else if (bits == 24)
+                fmt->sample = I2S_SAMPLE_S24_3LE;
+            else if (bits == 32 && valid == 24)
+                fmt->sample = I2S_SAMPLE_S24_LE;
+            else if (bits == 32)
+                fmt->sample = I2S_SAMPLE_S32;
+            else
+                return -1;
+            have_fmt = 1;
+        } else if (memcmp(p + off, "data", 4) == 0) {
+            if (!have_fmt)
+                return -1;
+            if (rf64 && size == WAV_SIZE_RF64)
+                size = ds64_data;
+            *data_off = off + 8;
+            *data_len = size < len - *data_off ? size : len - *data_off;
+            return 0;
+        }
+        
+        /* Chunks are padded to an even size */
+        off += 8 + size + (size & 1);
+    }
+    
+    return -1;
+}
+
+/*
+ * Build the header block of a recording. It always takes
+ * WAV_HEADER_BYTES so the data stays aligned for O_DIRECT; a JUNK
+ * chunk holds the place of the ds64 chunk that RF64 needs once the
+ * file outgrows 4 GiB, and another one pads the rest of the block.
+ */
+static void wav_header(uint8_t *h, const struct audio_format *fmt,
+                       uint64_t data_bytes)
+{
+    uint64_t riff_bytes = WAV_HEADER_BYTES - 8 + data_bytes;
+    int bytes = (int)i2s_sample_size(fmt->sample);
+    int extensible = fmt->sample == I2S_SAMPLE_S24_LE || fmt->channels > 2;
+    int rf64 = riff_bytes > 0xFFFFFFFFull;
+    uint8_t *c = h + 12;
+    
+    memset(h, 0, WAV_HEADER_BYTES);
+    memcpy(h, rf64 ? "RF64" : "RIFF", 4);
+    put_le32(h + 4, rf64 ? WAV_SIZE_RF64 : (uint32_t)riff_bytes);
+    memcpy(h + 8, "WAVE", 4);
+    
+    memcpy(c, rf64 ? "ds64" : "JUNK", 4);
+    put_le32(c + 4, 28);
+    if (rf64) {
+        put_le64(c + 8, riff_bytes);
+        put_le64(c + 16, data_bytes);
+        put_le64(c + 24, data_bytes / ((uint64_t)bytes * fmt->channels));
+    }
+    c += 8 + 28;
+    
+    memcpy(c, "fmt ", 4);
+    put_le32(c + 4, extensible ? 40 : 16);
+    put_le16(c + 8, extensible ? WAV_FORMAT_EXTENSIBLE :
+             fmt->sample == I2S_SAMPLE_FLOAT32 ? WAV_FORMAT_FLOAT : WAV_FORMAT_PCM);
+    put_le16(c + 10, (uint16_t)fmt->channels);
+    put_le32(c + 12, (uint32_t)fmt->rate);
+    put_le32(c + 16, (uint32_t)(fmt->rate * bytes * fmt->channels));
+    put_le16(c + 20, (uint16_t)(bytes * fmt->channels));
+    put_le16(c + 22, (uint16_t)(bytes * 8));
+    if (extensible) {
+        static const uint8_t guid_tail[14] = {
+            0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00,
+            0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71
+        };
+        
+        put_le16(c + 24, 22);
+        put_le16(c + 26, (uint16_t)sample_bits(fmt->sample));
+        put_le32(c + 28, fmt->channels == 2 ? 0x3 : 0);
+        put_le16(c + 32, fmt->sample == I2S_SAMPLE_FLOAT32 ?
+                 WAV_FORMAT_FLOAT : WAV_FORMAT_PCM);
+        memcpy(c + 34, guid_tail, sizeof(guid_tail));
+        c += 8 + 40;
+    } else {
+        c += 8 + 16;
+    }
+    
+    memcpy(c, "JUNK", 4);
+    put_le32(c + 4, (uint32_t)(h + WAV_HEADER_BYTES - 8 - (c + 8)));
+    
+    c = h + WAV_HEADER_BYTES - 8;
+    memcpy(c, "data", 4);
+    put_le32(c + 4, rf64 ? WAV_SIZE_RF64 : (uint32_t)data_bytes);
+}
+
+/* Command-line settings */
+struct options {
+    const char *device;
+    const char *path;
+    int raw;
+    struct audio_format fmt;
+    int device_bits;            /* 0 = as the file */
+    int period_frames;
+    int periods;
+    double duration;            /* recording only, 0 = until interrupted */
+    int dither;
+    int verbose;
+};
+
+/* Open the device for one direction and apply the stream setup */
+static i2s_handle_t open_device(const struct options *opt, i2s_stream_t stream,
+                                i2s_format_t format)
+{
+    i2s_handle_t h;
+    i2s_params_t params;
+    
+    h = i2s_open_stream(opt->device, stream);
+    if (!h) {
+        fprintf(stderr, "Error: cannot open %s: %s\n", opt->device,
+                strerror(errno));
+        return NULL;
+    }
+    
+    memset(&params, 0, sizeof(params));
+    params.sample_rate = opt->fmt.rate;
+    params.format = format;
+    params.channels = opt->fmt.channels;
+    params.period_frames = opt->period_frames;
+    params.periods = opt->periods;
+    
+    /* Playback starts once the ring is full, or by hand for a short file;
+     * wake once a period */
+    if (i2s_set_params(h, &params) < 0 ||
+        i2s_set_buffering(h, opt->period_frames, opt->periods,
+                          opt->period_frames * opt->periods,
+                          opt->period_frames) < 0 ||
+        i2s_set_xrun_policy(h, I2S_XRUN_SILENCE) < 0) {
+        fprintf(stderr, "Error: %s\n", i2s_get_error(h));
+        i2s_close(h);
+        return NULL;
+    }
+    
+    return h;
+}
+
+/* Flags for one conversion: dither when bits are dropped, always clamp
+ * float input */
+static unsigned int convert_flags(const struct options *opt,
+                                  i2s_sample_t dst, i2s_sample_t src)
+{
+    unsigned int flags = I2S_CONVERT_SATURATE;
+    
+    if (opt->dither && (sample_bits(dst) < sample_bits(src) ||
+                        src == I2S_SAMPLE_FLOAT32))
+        flags |= I2S_CONVERT_DITHER;
+    return flags;
+}
+
+/*
+ * Wait for room (playback) or data (capture) in the mapped ring. Returns
+ * 1 when the stream needs i2s_recover(), -1 if it stopped.
+ */
+static int wait_ring(i2s_handle_t h, short events)
+{
+    struct pollfd pfd;
+    
+    pfd.fd = i2s_get_fd(h);
+    pfd.events = events;
+    if (poll(&pfd, 1, 1000) < 0)
+        return errno == EINTR ? 0 : -1;
+    
+    if (pfd.revents & POLLERR)
+        return i2s_get_status(h) == I2S_STATUS_XRUN ? 1 : -1;
+    return 0;
+}
+
+/* Count an xrun reported by i2s_mmap_begin() and resume */
+static int handle_xrun(i2s_handle_t h, double start, unsigned int *xruns)
+{
+    (*xruns)++;
+    fprintf(stderr, "xrun at %.3f s\n", now_seconds() - start);
+    
+    if (i2s_recover(h) < 0) {
+        fprintf(stderr, "Error: %s\n", i2s_get_error(h));
+        return -1;
+    }
+    
+    return 0;
+}
+
+/* Let the hardware play what is queued, then stop */
+static void drain(i2s_handle_t h, const struct options *opt)
+{
+    i2s_position_t pos;
+    
+    while (!stop_requested && i2s_get_status(h) == I2S_STATUS_RUNNING &&
+           i2s_get_position(h, I2S_STREAM_PLAYBACK, &pos) == 0 &&
+           pos.fill_frames)
+        usleep((useconds_t)(1e6 * opt->period_frames / opt->fmt.rate));
+    
+    i2s_stop(h);
+}
+
+static int play(struct options *opt)
+{
+    struct audio_format *fmt = &opt->fmt;
+    struct stat st;
+    uint8_t *map;
+    uint64_t data_off = 0, data_len, done = 0, dropped;
+    size_t file_frame, dev_frame, avail, frames, pad;
+    i2s_sample_t dev_sample;
+    i2s_format_t format;
+    i2s_position_t pos;
+    i2s_handle_t h;
+    unsigned int flags, xruns = 0;
+    void *area;
+    double start;
+    int fd, started = 0, ret = EXIT_FAILURE, r;
+    
+    fd = open(opt->path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Error: cannot open %s: %s\n", opt->path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (st.st_size == 0) {
+        fprintf(stderr, "Error: %s is empty\n", opt->path);
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error: cannot map %s: %s\n", opt->path, strerror(errno));
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+    
+    data_len = (uint64_t)st.st_size;
+    if (!opt->raw && wav_parse(map, data_len, fmt, &data_off, &data_len) < 0) {
+        fprintf(stderr, "Error: %s is not a supported WAV file (use -t raw)\n",
+                opt->path);
+        goto out_unmap;
+    }
+    
+    file_frame = i2s_sample_size(fmt->sample) * fmt->channels;
+    format = device_format(fmt->sample, opt->device_bits);
+    dev_sample = i2s_format_sample(format);
+    dev_frame = i2s_sample_size(dev_sample) * fmt->channels;
+    flags = convert_flags(opt, dev_sample, fmt->sample);
+    data_len -= data_len % file_frame;
+    
+    h = open_device(opt, I2S_STREAM_PLAYBACK, format);
+    if (!h)
+        goto out_unmap;
+    
+    if (opt->verbose)
+        fprintf(stderr, "Playing %s: %d Hz, %d channels, %s -> %s\n", opt->path,
+                fmt->rate, fmt->channels, sample_name(fmt->sample),
+                sample_name(dev_sample));
+    
+    start = now_seconds();
+    dropped = data_off & ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1);
+    
+    while (done < data_len && !stop_requested) {
+        if (i2s_mmap_begin(h, I2S_STREAM_PLAYBACK, &area, &avail) < 0) {
+            if (errno != EPIPE) {
+                fprintf(stderr, "Error: %s\n", i2s_get_error(h));
+                goto out_close;
+            }
+            if (handle_xrun(h, start, &xruns) < 0)
+                goto out_close;
+            continue;
+        }
+        
+        frames = avail / dev_frame;
+        if (frames > (data_len - done) / file_frame)
+            frames = (data_len - done) / file_frame;
+        
+        if (frames) {
+            i2s_convert(area, dev_sample, map + data_off + done, fmt->sample,
+                        frames * fmt->channels, flags);
+            i2s_mmap_commit(h, I2S_STREAM_PLAYBACK, frames * dev_frame);
+            done += frames * file_frame;
+            
+            /* Played pages are not needed again */
+            if (data_off + done - dropped >= PLAY_DROP_BYTES) {
+                madvise(map + dropped, PLAY_DROP_BYTES, MADV_DONTNEED);
+                posix_fadvise(fd, (off_t)dropped, PLAY_DROP_BYTES,
+                              POSIX_FADV_DONTNEED);
+                dropped += PLAY_DROP_BYTES;
+            }
+            continue;
+        }
+        
+        /* The ring is full: the first time round, start the hardware */
+        if (!started) {
+            if (i2s_start(h) < 0) {
+                fprintf(stderr, "Error: %s\n", i2s_get_error(h));
+                goto out_close;
+            }
+            started = 1;
+            start = now_seconds();
+        }
+        
+        r = wait_ring(h, POLLOUT);
+        if (r < 0) {
+            fprintf(stderr, "Error: stream not running\n");
+            goto out_close;
+        }
+        if (r > 0 && handle_xrun(h, start, &xruns) < 0)
+            goto out_close;
+    }
+    
+    /* Complete the last period with silence so all of it is played */
+    pad = (opt->period_frames - (done / file_frame) % opt->period_frames) %
+        opt->period_frames;
+    while (pad && !stop_requested &&
+           i2s_mmap_begin(h, I2S_STREAM_PLAYBACK, &area, &avail) == 0) {
+        frames = avail / dev_frame < pad ? avail / dev_frame : pad;
+        if (!frames) {
+            if (wait_ring(h, POLLOUT) != 0)
+                break;
+            continue;
+        }
+        memset(area, 0, frames * dev_frame);
+        i2s_mmap_commit(h, I2S_STREAM_PLAYBACK, frames * dev_frame);
+        pad -= frames;
+    }
+    
+    /* A file shorter than the ring never filled it */
+    if (!started && done) {
+        if (i2s_start(h) < 0) {
+            fprintf(stderr, "Error: %s\n", i2s_get_error(h));
+            goto out_close;
+        }
+        start = now_seconds();
+    }
+    
+    /* Running dry at the end of the drain is not an xrun to report */
+    if (i2s_get_position(h, I2S_STREAM_PLAYBACK, &pos) == 0 && pos.xruns > xruns)
+        xruns = pos.xruns;
+    drain(h, opt);
+    
+    fprintf(stderr, "Played %llu frames (%.2f s), %u xruns\n",
+            (unsigned long long)(done / file_frame),
+            (double)(done / file_frame) / fmt->rate, xruns);
+    ret = xruns ? 2 : EXIT_SUCCESS;
+    
+out_close:
+    i2s_close(h);
+out_unmap:
+    munmap(map, (size_t)st.st_size);
+    close(fd);
+    return ret;
+}
+
+/*
+ * The two recording buffers. The capture loop fills one while the writer
+ * thread writes the other; a buffer with len set is waiting for the
+ * writer. Writes are whole REC_ALIGN blocks except the last one.
+ */
+struct rec_writer {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    uint8_t *buf[2];
+    size_t len[2];
+    int next;                   /* the buffer the writer takes next */
+    int done;
+    int fd;
+    int seekable;               /* pwrite() at offset, else write() (pipes) */
+    off_t offset;
+    int error;
+};
+
+static void *rec_writer_thread(void *arg)
+{
+    struct rec_writer *w = arg;
+    size_t len, n;
+    ssize_t r;
+    int i;
+    
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        i = w->next;
+        while (!w->len[i] && !w->done)
+            pthread_cond_wait(&w->cond, &w->lock);
+        if (!w->len[i])
+            break;
+        len = w->len[i];
+        pthread_mutex_unlock(&w->lock);
+        
+        for (n = 0; n < len && !w->error; n += (size_t)r) {
+            if (w->seekable)
+                r = pwrite(w->fd, w->buf[i] + n, len - n, w->offset + (off_t)n);
+            else
+                r = write(w->fd, w->buf[i] + n, len - n);
+            if (r < 0 && errno == EINTR) {
+                r = 0;
+            } else if (r <= 0) {
+                w->error = r < 0 ? errno : EIO;
+            }
+        }
+        
+        pthread_mutex_lock(&w->lock);
+        w->offset += (off_t)len;
+        w->len[i] = 0;
+        w->next = !i;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+/* Hand buffer i to the writer and wait until the other one is free */
+static int rec_writer_submit(struct rec_writer *w, int i, size_t len)
+{
+    pthread_mutex_lock(&w->lock);
+    w->len[i] = len;
+    pthread_cond_broadcast(&w->cond);
+    while (w->len[!i])
+        pthread_cond_wait(&w->cond, &w->lock);
+    pthread_mutex_unlock(&w->lock);
+    return w->error ? -1 : 0;
+}
+
+/* Let the writer finish what it has, then stop it */
+static void rec_writer_finish(struct rec_writer *w)
+{
+    pthread_mutex_lock(&w->lock);
+    w->done = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+}
+
+static int record(struct options *opt)
+{
+    struct audio_format *fmt = &opt->fmt;
+    struct rec_writer w;
+    uint64_t frames_total = 0, frames_max, data_bytes;
+    size_t file_frame, dev_frame, avail, frames, fill, room, len;
+    i2s_sample_t dev_sample;
+    i2s_format_t format;
+    i2s_position_t pos;
+    i2s_handle_t h = NULL;
+    unsigned int flags, xruns = 0;
+    uint8_t *header = NULL;
+    void *area;
+    double start;
+    int fd, direct = 1, seekable, cur = 0, ret = EXIT_FAILURE, r;
+    
+    if (strcmp(opt->path, "-") == 0) {
+        fd = STDOUT_FILENO;
+        direct = 0;
+    } else {
+        fd = open(opt->path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+        if (fd < 0 && errno == EINVAL) {
+            /* The filesystem has no O_DIRECT */
+            fd = open(opt->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            direct = 0;
+        }
+        if (fd < 0) {
+            fprintf(stderr, "Error: cannot create %s: %s\n", opt->path,
+                    strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+    seekable = lseek(fd, 0, SEEK_CUR) >= 0;
+    
+    memset(&w, 0, sizeof(w));
+    if (posix_memalign((void **)&w.buf[0], REC_ALIGN, REC_BUFFER_BYTES) ||
+        posix_memalign((void **)&w.buf[1], REC_ALIGN, REC_BUFFER_BYTES) ||
+        posix_memalign((void **)&header, REC_ALIGN, WAV_HEADER_BYTES)) {
+        fprintf(stderr, "Error: out of memory\n");
+        goto out_free;
+    }
+    w.fd = fd;
+    w.seekable = seekable;
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.cond, NULL);
+    
+    file_frame = i2s_sample_size(fmt->sample) * fmt->channels;
+    format = device_format(fmt->sample, opt->device_bits);
+    dev_sample = i2s_format_sample(format);
+    dev_frame = i2s_sample_size(dev_sample) * fmt->channels;
+    flags = convert_flags(opt, fmt->sample, dev_sample);
+    frames_max = opt->duration > 0 ? (uint64_t)(opt->duration * fmt->rate) : 0;
+    
+    h = open_device(opt, I2S_STREAM_CAPTURE, format);
+    if (!h)
+        goto out_free;
+    
+    /* The header goes in front of the data now and is rewritten with
+     * the real sizes at the end; unknown sizes are left at the maximum */
+    fill = 0;
+    if (!opt->raw) {
+        wav_header(w.buf[0], fmt, seekable ? 0 : WAV_SIZE_RF64 - WAV_HEADER_BYTES);
+        fill = WAV_HEADER_BYTES;
+    }
+    
+    if (pthread_create(&w.thread, NULL, rec_writer_thread, &w) != 0) {
+        fprintf(stderr, "Error: cannot start writer thread\n");
+        goto out_close;
+    }
+    
+    if (opt->verbose)
+        fprintf(stderr, "Recording %s: %d Hz, %d channels, %s -> %s%s\n",
+                opt->path, fmt->rate, fmt->channels, sample_name(dev_sample),
+                sample_name(fmt->sample), direct ? ", O_DIRECT" : "");
+    
+    if (i2s_start(h) < 0) {
+        fprintf(stderr, "Error: %s\n", i2s_get_error(h));
+        goto out_writer;
+    }
+    start = now_seconds();
+    
+    while (!stop_requested && (!frames_max || frames_total < frames_max)) {
+        if (i2s_mmap_begin(h, I2S_STREAM_CAPTURE, &area, &avail) < 0) {
+            if (errno != EPIPE) {
+                fprintf(stderr, "Error: %s\n", i2s_get_error(h));
+                goto out_stop;
+            }
+            if (handle_xrun(h, start, &xruns) < 0)
+                goto out_stop;
+            continue;
+        }
+        
+        frames = avail / dev_frame;
+        if (!frames) {
+            r = wait_ring(h, POLLIN);
+            if (r < 0) {
+                fprintf(stderr, "Error: stream not running\n");
+                goto out_stop;
+            }
+            if (r > 0 && handle_xrun(h, start, &xruns) < 0)
+                goto out_stop;
+            continue;
+        }
+        
+        room = (REC_BUFFER_BYTES - fill) / file_frame;
+        if (frames > room)
+            frames = room;
+        if (frames_max && frames > frames_max - frames_total)
+            frames = (size_t)(frames_max - frames_total);
+        
+        i2s_convert(w.buf[cur] + fill, fmt->sample, area, dev_sample,
+                    frames * fmt->channels, flags);
+        i2s_mmap_commit(h, I2S_STREAM_CAPTURE, frames * dev_frame);
+        fill += frames * file_frame;
+        frames_total += frames;
+        
+        /* Frames can straddle REC_ALIGN blocks: hand over the whole
+         * blocks and carry the tail into the other buffer */
+        if (REC_BUFFER_BYTES - fill < file_frame) {
+            len = fill & ~(size_t)(REC_ALIGN - 1);
+            if (rec_writer_submit(&w, cur, len) < 0) {
+                fprintf(stderr, "Error: writing %s: %s\n", opt->path,
+                        strerror(w.error));
+                goto out_stop;
+            }
+            memcpy(w.buf[!cur], w.buf[cur] + len, fill - len);
+            fill -= len;
+            cur = !cur;
+        }
+    }
+    
+    i2s_stop(h);
+    
+    /* The tail: O_DIRECT only writes whole blocks, so pad it and cut the
+     * file back afterwards */
+    data_bytes = frames_total * file_frame;
+    if (fill) {
+        len = direct ? (fill + REC_ALIGN - 1) & ~(size_t)(REC_ALIGN - 1) : fill;
+        memset(w.buf[cur] + fill, 0, len - fill);
+        rec_writer_submit(&w, cur, len);
+    }
+    rec_writer_finish(&w);
+    
+    if (w.error) {
+        fprintf(stderr, "Error: writing %s: %s\n", opt->path, strerror(w.error));
+        goto out_close;
+    }
+    
+    if (seekable) {
+        if (direct && ftruncate(fd, (off_t)((opt->raw ? 0 : WAV_HEADER_BYTES) +
+                                            data_bytes)) < 0)
+            fprintf(stderr, "Warning: cannot trim %s: %s\n", opt->path,
+                    strerror(errno));
+        if (!opt->raw) {
+            wav_header(header, fmt, data_bytes);
+            if (pwrite(fd, header, WAV_HEADER_BYTES, 0) != WAV_HEADER_BYTES)
+                fprintf(stderr, "Warning: cannot finalize %s: %s\n", opt->path,
+                        strerror(errno));
+        }
+    }
+    
+    if (i2s_get_position(h, I2S_STREAM_CAPTURE, &pos) == 0 && pos.xruns > xruns)
+        xruns = pos.xruns;
+    fprintf(stderr, "Recorded %llu frames (%.2f s), %u xruns\n",
+            (unsigned long long)frames_total,
+            (double)frames_total / fmt->rate, xruns);
+    ret = xruns ? 2 : EXIT_SUCCESS;
+    goto out_close;
+    
+out_stop:
+    i2s_stop(h);
+out_writer:
+    rec_writer_finish(&w);
+out_close:
+    i2s_close(h);
+    pthread_cond_destroy(&w.cond);
+    pthread_mutex_destroy(&w.lock);
+out_free:
+    free(w.buf[0]);
+    free(w.buf[1]);
+    free(header);
+    if (fd != STDOUT_FILENO)
+        close(fd);
+    return ret;
+}
+
+static void usage(const char *prog, int rec)
+{
+    printf("Usage: %s [options] file\n", prog);
+    printf("%s a WAV (RIFF or RF64) or raw file%s\n",
+           rec ? "Record" : "Play", rec ? ", - for stdout" : "");
+    printf("Options:\n");
+    printf("  -D <device>   Device (default %s)\n", DEFAULT_DEVICE);
+    printf("  -t wav|raw    File type (default wav)\n");
+    printf("  -r <rate>     Sample rate (raw%s, default 48000)\n",
+           rec ? " and wav" : "");
+    printf("  -c <n>        Channels (raw%s, default 2)\n", rec ? " and wav" : "");
+    printf("  -f <format>   s16, s24_3le, s24, s32 or f32 (raw%s, default s16)\n",
+           rec ? " and wav" : "");
+    printf("  -b <bits>     Device sample size 16, 24 or 32 (default as the file)\n");
+    printf("  -p <frames>   Period size (default %d)\n", DEFAULT_PERIOD_FRAMES);
+    printf("  -n <periods>  Periods in the ring (default %d)\n", DEFAULT_PERIODS);
+    if (rec)
+        printf("  -d <seconds>  Duration (default until interrupted)\n");
+    printf("  -N            No dither when dropping precision\n");
+    printf("  -v            Verbose\n");
+    printf("  -h            Show this help\n");
+    printf("Exits with 2 if there were xruns.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct options opt;
+    struct sigaction sa;
+    const char *prog;
+    int rec, c;
+    
+    prog = strrchr(argv[0], '/');
+    prog = prog ? prog + 1 : argv[0];
+    rec = strcmp(prog, "i2s_rec") == 0;
+    
+    memset(&opt, 0, sizeof(opt));
+    opt.device = DEFAULT_DEVICE;
+    opt.fmt.rate = 48000;
+    opt.fmt.channels = 2;
+    opt.fmt.sample = I2S_SAMPLE_S16;
+    opt.period_frames = DEFAULT_PERIOD_FRAMES;
+    opt.periods = DEFAULT_PERIODS;
+    opt.dither = 1;
+    
+    while ((c = getopt(argc, argv, "D:t:r:c:f:b:p:n:d:Nvh")) != -1) {
+        switch (c) {
+        case 'D':
+            opt.device = optarg;
+            break;
+        case 't':
+            if (strcmp(optarg, "raw") != 0 && strcmp(optarg, "wav") != 0) {
+                fprintf(stderr, "Error: unknown file type %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            opt.raw = strcmp(optarg, "raw") == 0;
+            break;
+        case 'r':
+            opt.fmt.rate = atoi(optarg);
+            break;
+        case 'c':
+            opt.fmt.channels = atoi(optarg);
+            break;
+        case 'f':
+            if (parse_sample(optarg, &opt.fmt.sample) < 0) {
+                fprintf(stderr, "Error: unknown format %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'b':
+            opt.device_bits = atoi(optarg);
+            if (opt.device_bits != 16 && opt.device_bits != 24 &&
+                opt.device_bits != 32) {
+                fprintf(stderr, "Error: device sample size must be 16, 24 or 32\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'p':
+            opt.period_frames = atoi(optarg);
+            break;
+        case 'n':
+            opt.periods = atoi(optarg);
+            break;
+        case 'd':
+            opt.duration = atof(optarg);
+            break;
+        case 'N':
+            opt.dither = 0;
+            break;
+        case 'v':
+            opt.verbose = 1;
+            break;
+        case 'h':
+            usage(prog, rec);
+            return EXIT_SUCCESS;
+        default:
+            usage(prog, rec);
+            return EXIT_FAILURE;
+        }
+    }
+    
+    if (optind != argc - 1) {
+        usage(prog, rec);
+        return EXIT_FAILURE;
+    }
+    opt.path = argv[optind];
+    
+    if (opt.fmt.rate <= 0 || opt.fmt.channels <= 0 ||
+        opt.period_frames <= 0 || opt.periods < 2) {
+        fprintf(stderr, "Error: invalid rate, channels or buffering\n");
+        return EXIT_FAILURE;
+    }
+    
+    /* Interrupting stops cleanly: playback drains nothing more, a
+     * recording is finalized */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    
+    return rec ? record(&opt) : play(&opt);
+}
@@ -0,0 +1,331 @@
+/*
+ * i2s_test.c - Regression tests for libi2s against the device
+ *
+ * Each test opens the device on its own, so any backend works; the
+ * null backend (modprobe i2s_driver backend=1) needs no hardware. A
+ * test that hangs fails the run on an alarm instead of blocking it,
+ * and the whole run is skipped when there is no device to open.
+ */
+
+#include "libi2s.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+
+#define TEST_RATE 48000
+#define TEST_CHANNELS 2
+#define TEST_TIMEOUT 5              /* seconds per test */
+#define TEST_MAX_FRAMES 65536
+#define TEST_WIDE_CHANNELS 8        /* a ring of THROUGHPUT is past the default pool */
+
+static const char *device;
+static const char *current;
+static char timeout_msg[128];
+
+struct test {
+    const char *name;
+    int (*run)(const struct test *t);
+    i2s_buffering_t preset;
+};
+
+static void test_fail(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void test_fail(const char *fmt, ...)
+{
+    va_list ap;
+    
+    printf("FAIL  %s: ", current);
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf("\n");
+}
+
+/* A stream that never starts blocks in poll(); only a signal gets out */
+static void test_timeout(int sig)
+{
+    ssize_t ret;
+    
+    (void)sig;
+    ret = write(STDOUT_FILENO, timeout_msg, strlen(timeout_msg));
+    (void)ret;
+    _exit(EXIT_FAILURE);
+}
+
+/* The ring size in frames of a preset, to write past it */
+static size_t preset_frames(i2s_buffering_t preset)
+{
+    return preset == I2S_BUFFERING_LOW_LATENCY ? 64 * 2 : 4096 * 8;
+}
+
+/* Open one stream with the test format and a buffering preset applied */
+static i2s_handle_t test_open_channels(i2s_stream_t stream,
+                                       i2s_buffering_t preset, int channels)
+{
+    i2s_params_t params = {
+        TEST_RATE, I2S_FORMAT_S32_LE, channels, 64, 2, 0
+    };
+    i2s_handle_t handle;
+    
+    handle = i2s_open_stream(device, stream);
+    if (!handle) {
+        test_fail("cannot open %s: %s", device ? device : "the device",
+                  strerror(errno));
+        return NULL;
+    }
+    
+    if (i2s_set_params(handle, &params) < 0 ||
+        i2s_set_buffering_preset(handle, preset) < 0) {
+        test_fail("%s", i2s_get_error(handle));
+        i2s_close(handle);
+        return NULL;
+    }
+    
+    return handle;
+}
+
+static i2s_handle_t test_open(i2s_stream_t stream, i2s_buffering_t preset)
+{
+    return test_open_channels(stream, preset, TEST_CHANNELS);
+}
+
+static int expect_running(i2s_handle_t handle)
+{
+    i2s_status_t status = i2s_get_status(handle);
+    
+    if (status != I2S_STATUS_RUNNING) {
+        test_fail("stream state %d after the start threshold, want running",
+                  (int)status);
+        return -1;
+    }
+    
+    return 0;
+}
+
+/* More than a ring of frames through mmap only fits if the stream starts */
+static int test_write_noninterleaved(const struct test *t)
+{
+    static int32_t left[TEST_MAX_FRAMES], right[TEST_MAX_FRAMES];
+    const void *channels[TEST_CHANNELS] = { left, right };
+    size_t frames = preset_frames(t->preset) * 2;
+    i2s_handle_t handle;
+    ssize_t n;
+    int ret;
+    
+    handle = test_open(I2S_STREAM_PLAYBACK, t->preset);
+    if (!handle)
+        return -1;
+    
+    n = i2s_write_noninterleaved(handle, channels, frames);
+    if (n != (ssize_t)frames) {
+        test_fail("wrote %zd of %zu frames: %s", n, frames, i2s_get_error(handle));
+        i2s_close(handle);
+        return -1;
+    }
+    
+    ret = expect_running(handle);
+    i2s_close(handle);
+    return ret;
+}
+
+static int test_signal_write(const struct test *t)
+{
+    size_t frames = preset_frames(t->preset) * 2;
+    i2s_handle_t handle;
+    i2s_signal_t sig;
+    ssize_t n;
+    int ret;
+    
+    handle = test_open(I2S_STREAM_PLAYBACK, t->preset);
+    if (!handle)
+        return -1;
+    
+    sig = i2s_signal_create(TEST_RATE, TEST_CHANNELS);
+    if (!sig || i2s_signal_set_ladder(sig, 1000.0, 100.0, 0.5) < 0) {
+        test_fail("cannot set up the generator");
+        i2s_signal_destroy(sig);
+        i2s_close(handle);
+        return -1;
+    }
+    
+    n = i2s_signal_write(sig, handle, frames, 0);
+    i2s_signal_destroy(sig);
+    if (n != (ssize_t)frames) {
+        test_fail("wrote %zd of %zu frames: %s", n, frames, i2s_get_error(handle));
+        i2s_close(handle);
+        return -1;
+    }
+    
+    ret = expect_running(handle);
+    i2s_close(handle);
+    return ret;
+}
+
+/* A handle that wrote through mmap can still change its ring size */
+static int test_reconfigure(const struct test *t)
+{
+    static int32_t left[TEST_MAX_FRAMES], right[TEST_MAX_FRAMES];
+    const void *channels[TEST_CHANNELS] = { left, right };
+    i2s_buffering_t other = t->preset == I2S_BUFFERING_LOW_LATENCY ?
+        I2S_BUFFERING_THROUGHPUT : I2S_BUFFERING_LOW_LATENCY;
+    size_t frames = preset_frames(other) * 2;
+    i2s_handle_t handle;
+    ssize_t n;
+    int ret;
+    
+    handle = test_open(I2S_STREAM_PLAYBACK, t->preset);
+    if (!handle)
+        return -1;
+    
+    if (i2s_write_noninterleaved(handle, channels, 1) != 1 ||
+        i2s_stop(handle) < 0 || i2s_set_buffering_preset(handle, other) < 0) {
+        test_fail("%s", i2s_get_error(handle));
+        i2s_close(handle);
+        return -1;
+    }
+    
+    n = i2s_write_noninterleaved(handle, channels, frames);
+    if (n != (ssize_t)frames) {
+        test_fail("wrote %zd of %zu frames: %s", n, frames, i2s_get_error(handle));
+        i2s_close(handle);
+        return -1;
+    }
+    
+    ret = expect_running(handle);
+    i2s_close(handle);
+    return ret;
+}
+
+/* The preset still applies, with a smaller ring, when the frame is wide */
+static int test_preset_wide(const struct test *t)
+{
+    i2s_handle_t handle;
+    i2s_params_t params;
+    i2s_signal_t sig;
+    size_t frames;
+    ssize_t n;
+    int ret;
+    
+    handle = test_open_channels(I2S_STREAM_PLAYBACK, t->preset,
+                                TEST_WIDE_CHANNELS);
+    if (!handle)
+        return -1;
+    
+    if (i2s_get_params(handle, &params) < 0) {
+        test_fail("%s", i2s_get_error(handle));
+        i2s_close(handle);
+        return -1;
+    }
+    frames = (size_t)params.period_frames * params.periods * 2;
+    
+    sig = i2s_signal_create(TEST_RATE, TEST_WIDE_CHANNELS);
+    if (!sig || i2s_signal_set_ladder(sig, 1000.0, 100.0, 0.5) < 0) {
+        test_fail("cannot set up the generator");
+        i2s_signal_destroy(sig);
+        i2s_close(handle);
+        return -1;
+    }
+    
+    n = i2s_signal_write(sig, handle, frames, 0);
+    i2s_signal_destroy(sig);
+    if (n != (ssize_t)frames) {
+        test_fail("wrote %zd of %zu frames: %s", n, frames, i2s_get_error(handle));
+        i2s_close(handle);
+        return -1;
+    }
+    
+    ret = expect_running(handle);
+    i2s_close(handle);
+    return ret;
+}
+
+/* An armed capture stream starts on the first i2s_mmap_begin(), as on read() */
+static int test_mmap_capture(const struct test *t)
+{
+    i2s_handle_t handle;
+    size_t avail;
+    void *area;
+    int ret;
+    
+    handle = test_open(I2S_STREAM_CAPTURE, t->preset);
+    if (!handle)
+        return -1;
+    
+    if (i2s_mmap_begin(handle, I2S_STREAM_CAPTURE, &area, &avail) < 0) {
+        test_fail("%s", i2s_get_error(handle));
+        i2s_close(handle);
+        return -1;
+    }
+    
+    ret = expect_running(handle);
+    i2s_close(handle);
+    return ret;
+}
+
+static const struct test tests[] = {
+    { "write_noninterleaved/low_latency", test_write_noninterleaved,
+      I2S_BUFFERING_LOW_LATENCY },
+    { "write_noninterleaved/throughput", test_write_noninterleaved,
+      I2S_BUFFERING_THROUGHPUT },
+    { "signal_write/low_latency", test_signal_write, I2S_BUFFERING_LOW_LATENCY },
+    { "signal_write/throughput", test_signal_write, I2S_BUFFERING_THROUGHPUT },
+    { "reconfigure/low_latency", test_reconfigure, I2S_BUFFERING_LOW_LATENCY },
+    { "reconfigure/throughput", test_reconfigure, I2S_BUFFERING_THROUGHPUT },
+    { "preset_wide/throughput", test_preset_wide, I2S_BUFFERING_THROUGHPUT },
+    { "mmap_capture/low_latency", test_mmap_capture, I2S_BUFFERING_LOW_LATENCY },
+    { "mmap_capture/throughput", test_mmap_capture, I2S_BUFFERING_THROUGHPUT },
+};
+
+#define TEST_COUNT (sizeof(tests) / sizeof(tests[0]))
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-d device]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    i2s_handle_t probe;
+    size_t i, failed = 0;
+    int opt;
+    
+    while ((opt = getopt(argc, argv, "d:")) != -1) {
+        switch (opt) {
+        case 'd':
+            device = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    
+    probe = i2s_open(device);
+    if (!probe) {
+        printf("SKIP  all: cannot open %s: %s\n",
+               device ? device : "the device", strerror(errno));
+        return EXIT_SUCCESS;
+    }
+    i2s_close(probe);
+    
+    signal(SIGALRM, test_timeout);
+    for (i = 0; i < TEST_COUNT; i++) {
+        current = tests[i].name;
+        snprintf(timeout_msg, sizeof(timeout_msg), "FAIL  %s: timed out\n",
+                 current);
+        fflush(stdout);
+        alarm(TEST_TIMEOUT);
+        if (tests[i].run(&tests[i]) < 0)
+            failed++;
+        else
+            printf("PASS  %s\n", current);
+        alarm(0);
+    }
+    
+    printf("%zu/%zu passed\n", TEST_COUNT - failed, TEST_COUNT);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,106 @@
+/*
+ * i2s_trace.h - Tracepoints for the I2S character device driver
+ *
+ * Enable with: echo 1 > /sys/kernel/tracing/events/i2s/enable
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM i2s
+
+#if !defined(_I2S_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _I2S_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* read()/write() on a stream: requested bytes and result */
+DECLARE_EVENT_CLASS(i2s_io,
+    TP_PROTO(int id, const char *stream, size_t count, ssize_t ret),
+    TP_ARGS(id, stream, count, ret),
+
+    TP_STRUCT__entry(
+        __field(int, id)
+        __string(stream, stream)
+        __field(size_t, count)
+        __field(ssize_t, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->id = id;
+        __assign_str(stream, stream);
+        __entry->count = count;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("i2s%d %s count=%zu ret=%zd",
+              __entry->id, __get_str(stream), __entry->count, __entry->ret)
+);
+
+DEFINE_EVENT(i2s_io, i2s_read,
+    TP_PROTO(int id, const char *stream, size_t count, ssize_t ret),
+    TP_ARGS(id, stream, count, ret)
+);
+
+DEFINE_EVENT(i2s_io, i2s_write,
+    TP_PROTO(int id, const char *stream, size_t count, ssize_t ret),
+    TP_ARGS(id, stream, count, ret)
+);
+
+/* Period interrupt: new hardware pointer, ring fill and timing error */
+TRACE_EVENT(i2s_period,
+    TP_PROTO(int id, const char *stream, u32 hw_ptr, unsigned int fill,
+             s64 jitter_ns),
+    TP_ARGS(id, stream, hw_ptr, fill, jitter_ns),
+
+    TP_STRUCT__entry(
+        __field(int, id)
+        __string(stream, stream)
+        __field(u32, hw_ptr)
+        __field(unsigned int, fill)
+        __field(s64, jitter_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->id = id;
+        __assign_str(stream, stream);
+        __entry->hw_ptr = hw_ptr;
+        __entry->fill = fill;
+        __entry->jitter_ns = jitter_ns;
+    ),
+
+    TP_printk("i2s%d %s hw_ptr=%u fill=%u jitter=%lldns",
+              __entry->id, __get_str(stream), __entry->hw_ptr,
+              __entry->fill, __entry->jitter_ns)
+);
+
+/* The hardware ran past the application */
+TRACE_EVENT(i2s_xrun,
+    TP_PROTO(int id, const char *stream, u32 hw_ptr, u32 appl_ptr),
+    TP_ARGS(id, stream, hw_ptr, appl_ptr),
+
+    TP_STRUCT__entry(
+        __field(int, id)
+        __string(stream, stream)
+        __field(u32, hw_ptr)
+        __field(u32, appl_ptr)
+    ),
+
+    TP_fast_assign(
+        __entry->id = id;
+        __assign_str(stream, stream);
+        __entry->hw_ptr = hw_ptr;
+        __entry->appl_ptr = appl_ptr;
+    ),
+
+    TP_printk("i2s%d %s hw_ptr=%u appl_ptr=%u",
+              __entry->id, __get_str(stream), __entry->hw_ptr,
+              __entry->appl_ptr)
+);
+
+#endif /* _I2S_TRACE_H */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE i2s_trace
+#include <trace/define_trace.h>
@@ -4,6 +4,7 @@
  * Manages I2S device and provides additional services
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,31 +18,211 @@
 #include <sys/un.h>
 #include <errno.h>
 #include <pthread.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <ctype.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "libi2s.h"
 
 #define SOCKET_PATH "/var/run/i2sd.sock"
 #define PID_FILE "/var/run/i2sd.pid"
+#define CONFIG_FILE "/etc/i2sd.conf"
 #define I2S_DEVICE "/dev/i2s0"
 
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+
+/* Mixer thread stack: small, since mlockall() makes all of it resident */
+#define MIXER_STACK_SIZE (256 * 1024)
+#define MIXER_STACK_PREFAULT (64 * 1024)
+
+/* -o options collected until the config file has been read */
+#define MAX_OPTIONS 32
+
 /* Daemon control commands */
 #define CMD_GET_STATUS 1
 #define CMD_SET_VOLUME 2
 #define CMD_GET_STATS 3
 #define CMD_SHUTDOWN 4
+#define CMD_OPEN_STREAM 5       /* param = client rate, 0 = the mixer's; reply
+                                   carries the ring memfd and wake eventfd */
+#define CMD_CLOSE_STREAM 6      /* param = stream id */
+
+/*
+ * Wire protocol (must match libi2s): every request and reply is a header
+ * followed by length bytes of attributes. Each attribute is a type/length
+ * pair and an 8-byte value. Replies echo the request id, so a client can
+ * pipeline a batch of requests and match the answers.
+ */
+#define I2SD_MAGIC 0x5349
+#define I2SD_VERSION 1
+#define I2SD_FLAG_REPLY 0x01
+#define I2SD_MAX_PAYLOAD 512
+
+struct i2sd_hdr {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t flags;
+    uint16_t cmd;
+    uint16_t length;            /* attribute bytes after the header */
+    uint32_t id;                /* chosen by the client, echoed in the reply */
+    int32_t status;             /* replies: 0 or -errno */
+};
+
+struct i2sd_attr {
+    uint16_t type;
+    uint16_t length;            /* value bytes, always 8 for now */
+};
+
+#define I2SD_MAX_FRAME (sizeof(struct i2sd_hdr) + I2SD_MAX_PAYLOAD)
+#define I2SD_ATTR_SIZE (sizeof(struct i2sd_attr) + sizeof(uint64_t))
+
+/* Attribute types */
+#define ATTR_PARAM 1            /* request argument */
+#define ATTR_UPTIME 2           /* seconds */
+#define ATTR_CLIENTS 3
+#define ATTR_VOLUME 4           /* percent */
+#define ATTR_STREAM 5           /* stream id */
+#define ATTR_RATE 6
+#define ATTR_CHANNELS 7
+#define ATTR_FRAMES 8
+#define ATTR_XRUNS 9
+#define ATTR_UNDERRUNS 10
+#define ATTR_LOAD 11            /* permille */
+#define ATTR_LATENCY_P50 12     /* microseconds */
+#define ATTR_LATENCY_P99 13
+
+/* Mixer output format; clients write S16 interleaved, at this rate or
+ * resampled to it */
+#define MIX_RATE 48000
+#define MIX_CHANNELS 2
+#define MIX_PERIOD_FRAMES 256
+#define MIX_PERIODS 4
+#define MIX_PERIOD_SAMPLES (MIX_PERIOD_FRAMES * MIX_CHANNELS)
+#define MIX_FRAME_BYTES (MIX_CHANNELS * (int)sizeof(int16_t))
+
+/* Client frames one period can consume, at the highest client rate */
+#define MIX_MAX_IN_FRAMES (MIX_PERIOD_FRAMES * (I2S_RESAMPLE_MAX_RATE / MIX_RATE) + \
+                           I2S_RESAMPLE_MAX_TAPS)
+
+/* Concurrent playback clients and the size of each one's ring */
+#define MIX_MAX_CLIENTS 16
+#define MIX_RING_BYTES 16384
+
+/* Control connections kept open at once */
+#define MAX_CONNECTIONS 256
+
+/* Reply bytes queued per connection; it stops reading requests when full */
+#define CONN_OUT_BYTES (16 * I2SD_MAX_FRAME)
+
+/* Drop connections idle this long, unless they own a stream */
+#define CONN_IDLE_TIMEOUT_MS 30000
 
-typedef struct {
-    int cmd;
-    int param;
-    char data[256];
-} daemon_msg_t;
+/* Drop connections stuck this long on a partial request or unsent reply */
+#define CONN_IO_TIMEOUT_MS 5000
 
-typedef struct {
-    int status;
-    char message[256];
-} daemon_response_t;
+/* Client playback ring in shared memory (must match libi2s) */
+#define I2S_MIX_RING_MAGIC 0x69326d72
+
+struct i2s_mix_ring {
+    uint32_t magic;
+    uint32_t size;              /* data bytes, power of two */
+    uint32_t rate;
+    uint32_t channels;
+    uint32_t period_frames;
+    
+    /* Free-running byte counts, on their own cache lines */
+    uint32_t head __attribute__((aligned(64)));     /* written by the client */
+    uint32_t tail __attribute__((aligned(64)));     /* written by the mixer */
+    uint32_t wake __attribute__((aligned(64)));     /* client sleeps on wake_fd */
+    unsigned char data[] __attribute__((aligned(64)));
+};
+
+struct mix_client {
+    int active;
+    int wake_fd;                /* eventfd, signalled when space frees up */
+    struct i2s_mix_ring *ring;
+    size_t map_len;
+    uint32_t rate;
+    i2s_resampler_t resampler;  /* to MIX_RATE, NULL when rate matches */
+};
+
+/* Control connection; a stream lives as long as the connection that opened it */
+struct connection {
+    int fd;
+    int http;                   /* metrics scrape instead of control */
+    int closing;                /* close once the output is sent */
+    int stream;                 /* mixer stream id, -1 = none */
+    uint64_t deadline_ms;       /* dropped when reached, 0 = never */
+    uint32_t events;            /* epoll events currently registered */
+    
+    /* Received bytes not yet forming a complete request */
+    unsigned char in[I2SD_MAX_FRAME] __attribute__((aligned(8)));
+    size_t in_len;
+    
+    /* Replies; out_off of the out_len bytes are sent */
+    unsigned char out[CONN_OUT_BYTES];
+    size_t out_len;
+    size_t out_off;
+    
+    /* Stream fds to send with the reply starting at out_fds_pos */
+    int out_fds[2];
+    int out_fds_pending;
+    size_t out_fds_pos;
+};
 
 static volatile int running = 1;
-static int i2s_fd = -1;
+static i2s_handle_t i2s_dev;
 static int socket_fd = -1;
+static int epoll_fd = -1;
+static int metrics_fd = -1;
+
+/* Settings from CONFIG_FILE and the command line */
+struct daemon_config {
+    int foreground;
+    int metrics_port;           /* Prometheus endpoint on localhost, 0 = off */
+    int rt_policy;              /* mixer: SCHED_OTHER, SCHED_FIFO or SCHED_DEADLINE */
+    int rt_priority;            /* SCHED_FIFO priority */
+    int deadline_runtime_us;    /* SCHED_DEADLINE budget per period */
+    cpu_set_t cpus;             /* mixer CPUs; the control thread gets the rest */
+    int has_cpus;
+    int lock_memory;            /* mlockall() and prefault */
+    int control_nice;           /* nice value of the control thread */
+    i2s_resample_quality_t resample_quality;
+};
+
+static struct daemon_config config = {
+    .rt_policy = SCHED_FIFO,
+    .rt_priority = 70,
+    .deadline_runtime_us = 1000,
+    .lock_memory = 1,
+    .control_nice = 10,
+    .resample_quality = I2S_RESAMPLE_MEDIUM,
+};
+
+/* Statistics page; a private copy if it cannot be shared */
+static i2s_daemon_stats_t stats_private;
+static i2s_daemon_stats_t *stats = &stats_private;
+
+/* Mixer state; the client table is shared with the control socket.
+ * clients_lock is made priority-inheriting in start_mixer() */
+static pthread_t mixer_tid;
+static int mixer_started;
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t clients_cond = PTHREAD_COND_INITIALIZER;
+static struct mix_client clients[MIX_MAX_CLIENTS];
+static int nclients;
+static int volume = 100;        /* percent, read by the mixer every period */
+static time_t start_time;
+static struct connection conns[MAX_CONNECTIONS];
 
 /* Signal handler */
 static void signal_handler(int sig)
@@ -107,19 +288,466 @@ static int write_pid_file(void)
     return 0;
 }
 
+/* Monotonic clock for timeouts and mixer timing */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t now_ms(void)
+{
+    return now_ns() / 1000000;
+}
+
+/* Lock-free statistics updates; readers only ever load single fields */
+static void stats_add(uint64_t *counter, uint64_t value)
+{
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+static void stats_set(uint64_t *counter, uint64_t value)
+{
+    __atomic_store_n(counter, value, __ATOMIC_RELAXED);
+}
+
+static uint64_t stats_get(const uint64_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/* Count a value in microseconds into its power of two bucket */
+static void stats_histogram(uint64_t *buckets, uint64_t us)
+{
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+    
+    if (bucket >= I2S_STATS_BUCKETS)
+        bucket = I2S_STATS_BUCKETS - 1;
+    stats_add(&buckets[bucket], 1);
+}
+
+/* Publish the statistics page for monitoring tools */
+static void stats_open(void)
+{
+    i2s_daemon_stats_t *page;
+    int fd;
+    
+    fd = shm_open(I2S_DAEMON_STATS_PATH, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || fchmod(fd, 0644) < 0 ||
+        ftruncate(fd, sizeof(*page)) < 0) {
+        syslog(LOG_WARNING, "Statistics page unavailable: %s", strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        goto out;
+    }
+    
+    page = mmap(NULL, sizeof(*page), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        syslog(LOG_WARNING, "Statistics page unavailable: %s", strerror(errno));
+        goto out;
+    }
+    stats = page;
+    
+out:
+    stats->rate = MIX_RATE;
+    stats->period_frames = MIX_PERIOD_FRAMES;
+    stats->start_time = (uint64_t)start_time;
+    __atomic_store_n(&stats->version, I2S_DAEMON_STATS_VERSION, __ATOMIC_RELEASE);
+}
+
+static void stats_close(void)
+{
+    if (stats != &stats_private) {
+        munmap(stats, sizeof(*stats));
+        shm_unlink(I2S_DAEMON_STATS_PATH);
+        stats = &stats_private;
+    }
+}
+
 /* Initialize I2S device */
 static int init_i2s_device(void)
 {
-    i2s_fd = open(I2S_DEVICE, O_RDWR);
-    if (i2s_fd < 0) {
+    i2s_params_t params = {
+        .sample_rate = MIX_RATE,
+        .format = I2S_FORMAT_S16_LE,
+        .channels = MIX_CHANNELS,
+        .period_frames = MIX_PERIOD_FRAMES,
+        .periods = MIX_PERIODS,
+    };
+    
+    /* Playback only, so capture stays available to other processes */
+    i2s_dev = i2s_open_stream(I2S_DEVICE, I2S_STREAM_PLAYBACK);
+    if (!i2s_dev) {
         syslog(LOG_ERR, "Failed to open I2S device: %s", strerror(errno));
         return -1;
     }
     
+    /* Start on the second mixed period, keep running through client gaps */
+    if (i2s_set_params(i2s_dev, &params) < 0 ||
+        i2s_set_buffering(i2s_dev, MIX_PERIOD_FRAMES, MIX_PERIODS,
+                          2 * MIX_PERIOD_FRAMES, MIX_PERIOD_FRAMES) < 0 ||
+        i2s_set_xrun_policy(i2s_dev, I2S_XRUN_SILENCE) < 0) {
+        syslog(LOG_ERR, "Failed to configure I2S device: %s",
+               i2s_get_error(i2s_dev));
+        return -1;
+    }
+    
     syslog(LOG_INFO, "I2S device opened successfully");
     return 0;
 }
 
+/*
+ * Create a client's ring in a sealed memfd and publish it to the mixer.
+ * The syscalls and page faults happen before clients_lock is taken, so
+ * the mixer only waits for the slot to be claimed. The memfd and the
+ * wakeup eventfd are returned for passing to the client, the daemon
+ * keeps only its mapping.
+ */
+static int mix_client_open(int *memfd, int *wake_fd, uint32_t rate,
+                           i2s_resampler_t resampler)
+{
+    struct mix_client *client = NULL;
+    struct i2s_mix_ring *ring;
+    size_t len;
+    int id, fd, efd;
+    
+    len = sizeof(*ring) + MIX_RING_BYTES;
+    
+    fd = memfd_create("i2sd-stream", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    /* A client shrinking the file would SIGBUS the mixer */
+    if (ftruncate(fd, (off_t)len) < 0 ||
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+        close(fd);
+        return -1;
+    }
+    
+    /* Prefaulted, so the mixer never faults on a new client's ring */
+    ring = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                fd, 0);
+    if (ring == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    
+    efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (efd < 0) {
+        munmap(ring, len);
+        close(fd);
+        return -1;
+    }
+    
+    ring->size = MIX_RING_BYTES;
+    ring->rate = rate;
+    ring->channels = MIX_CHANNELS;
+    ring->period_frames = MIX_PERIOD_FRAMES;
+    __atomic_store_n(&ring->magic, I2S_MIX_RING_MAGIC, __ATOMIC_RELEASE);
+    
+    pthread_mutex_lock(&clients_lock);
+    for (id = 0; id < MIX_MAX_CLIENTS; id++) {
+        if (!clients[id].active) {
+            client = &clients[id];
+            break;
+        }
+    }
+    
+    if (client) {
+        client->wake_fd = efd;
+        client->ring = ring;
+        client->map_len = len;
+        client->rate = rate;
+        client->resampler = resampler;
+        client->active = 1;
+        nclients++;
+        stats_set(&stats->clients, (uint64_t)nclients);
+        pthread_cond_signal(&clients_cond);
+    }
+    pthread_mutex_unlock(&clients_lock);
+    
+    if (!client) {
+        close(efd);
+        munmap(ring, len);
+        close(fd);
+        errno = EBUSY;
+        return -1;
+    }
+    
+    *memfd = fd;
+    *wake_fd = efd;
+    return id;
+}
+
+/*
+ * Drop a client's ring. Only unpublishing it takes clients_lock; the
+ * mapping, the eventfd and the resampler are released after the mixer
+ * can no longer see them.
+ */
+static int mix_client_close(int id)
+{
+    struct mix_client client;
+    
+    if (id < 0 || id >= MIX_MAX_CLIENTS) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    pthread_mutex_lock(&clients_lock);
+    if (!clients[id].active) {
+        pthread_mutex_unlock(&clients_lock);
+        errno = EINVAL;
+        return -1;
+    }
+    
+    client = clients[id];
+    clients[id].resampler = NULL;
+    clients[id].active = 0;
+    nclients--;
+    stats_set(&stats->clients, (uint64_t)nclients);
+    pthread_mutex_unlock(&clients_lock);
+    
+    munmap(client.ring, client.map_len);
+    close(client.wake_fd);
+    i2s_resampler_destroy(client.resampler);
+    return 0;
+}
+
+/*
+ * Add up to one period of a client's queued audio to the mix, resampled
+ * to the mixer rate when the client plays at another one. Clients that
+ * fall behind simply contribute less; the others are not held up.
+ * Returns the frames that were queued, in mixer frames.
+ */
+static uint32_t mix_client_pull(struct mix_client *client, float *restrict mix)
+{
+    struct i2s_mix_ring *ring = client->ring;
+    int16_t pcm[MIX_MAX_IN_FRAMES * MIX_CHANNELS];
+    float in[MIX_MAX_IN_FRAMES * MIX_CHANNELS];
+    float resampled[MIX_PERIOD_SAMPLES];
+    const float *restrict src = in;
+    uint32_t head, tail, queued, want, bytes, off, chunk;
+    size_t frames, out_frames = MIX_PERIOD_FRAMES, samples, i;
+    
+    /* Client frames that make up one mixer period */
+    want = MIX_PERIOD_FRAMES;
+    if (client->resampler) {
+        want = (uint32_t)i2s_resampler_needed(client->resampler,
+                                              MIX_PERIOD_FRAMES);
+        if (want > MIX_MAX_IN_FRAMES)
+            want = MIX_MAX_IN_FRAMES;
+    }
+    
+    tail = ring->tail;
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    queued = (head - tail) / MIX_FRAME_BYTES;
+    if (queued < want)
+        stats_add(&stats->client_underruns, 1);
+    
+    frames = queued < want ? queued : want;
+    bytes = (uint32_t)frames * MIX_FRAME_BYTES;
+    if (bytes) {
+        off = tail & (ring->size - 1);
+        chunk = ring->size - off;
+        if (chunk > bytes)
+            chunk = bytes;
+        memcpy(pcm, ring->data + off, chunk);
+        memcpy((char *)pcm + chunk, ring->data, bytes - chunk);
+        i2s_convert(in, I2S_SAMPLE_FLOAT32, pcm, I2S_SAMPLE_S16,
+                    frames * MIX_CHANNELS, 0);
+    }
+    
+    /* The resampler keeps its history, so a short pull is not lost */
+    if (client->resampler) {
+        i2s_resample(client->resampler, in, &frames, resampled, &out_frames);
+        bytes = (uint32_t)frames * MIX_FRAME_BYTES;
+        src = resampled;
+    } else {
+        out_frames = frames;
+    }
+    
+    if (bytes) {
+        /* Pairs with the client setting wake before rechecking tail */
+        __atomic_store_n(&ring->tail, tail + bytes, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->wake, __ATOMIC_SEQ_CST) &&
+            __atomic_exchange_n(&ring->wake, 0, __ATOMIC_SEQ_CST)) {
+            uint64_t one = 1;
+            
+            if (write(client->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+                syslog(LOG_WARNING, "Failed to wake client: %s", strerror(errno));
+        }
+    }
+    
+    /* Plain loop over restrict pointers, so the compiler vectorizes it */
+    samples = out_frames * MIX_CHANNELS;
+    for (i = 0; i < samples; i++)
+        mix[i] += src[i];
+    
+    return (uint32_t)((uint64_t)queued * MIX_RATE / client->rate);
+}
+
+/* Queue one mixed period, riding out xruns */
+static int mix_write(const int16_t *out)
+{
+    const char *p = (const char *)out;
+    size_t left = MIX_PERIOD_FRAMES * MIX_FRAME_BYTES;
+    ssize_t n;
+    
+    while (left && running) {
+        n = i2s_write(i2s_dev, p, left);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EPIPE && i2s_recover(i2s_dev) == 0)
+                continue;
+            syslog(LOG_ERR, "Mixer write failed: %s", i2s_get_error(i2s_dev));
+            return -1;
+        }
+        p += n;
+        left -= (size_t)n;
+    }
+    
+    return 0;
+}
+
+/* sched_setattr() arguments, for SCHED_DEADLINE */
+struct mixer_sched_attr {
+    uint32_t size;
+    uint32_t sched_policy;
+    uint64_t sched_flags;
+    int32_t sched_nice;
+    uint32_t sched_priority;
+    uint64_t sched_runtime;
+    uint64_t sched_deadline;
+    uint64_t sched_period;
+};
+
+/*
+ * Reserve runtime in every mix period. This has to come from the thread
+ * itself through sched_setattr(), since pthread attributes cannot
+ * express SCHED_DEADLINE.
+ */
+static void mixer_set_deadline(void)
+{
+    struct mixer_sched_attr attr;
+    
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.sched_policy = SCHED_DEADLINE;
+    attr.sched_runtime = (uint64_t)config.deadline_runtime_us * 1000;
+    attr.sched_period = (uint64_t)MIX_PERIOD_FRAMES * 1000000000ULL / MIX_RATE;
+    attr.sched_deadline = attr.sched_period;
+    
+    if (syscall(SYS_sched_setattr, 0, &attr, 0) < 0)
+        syslog(LOG_WARNING, "SCHED_DEADLINE not available, mixer runs at "
+               "normal priority: %s", strerror(errno));
+}
+
+/* Touch the stack the mixer will use, so its first periods do not fault */
+static void __attribute__((noinline)) mixer_prefault_stack(void)
+{
+    volatile unsigned char stack[MIXER_STACK_PREFAULT];
+    size_t i;
+    
+    for (i = 0; i < sizeof(stack); i += 4096)
+        stack[i] = 0;
+}
+
+/*
+ * Mixer thread: sums one period from every client, applies the volume
+ * and writes the result. The blocking write paces the loop to the
+ * device clock. The device is stopped while nobody is connected.
+ */
+static void *mixer_thread(void *arg)
+{
+    const uint64_t period_ns = (uint64_t)MIX_PERIOD_FRAMES * 1000000000ULL /
+        MIX_RATE;
+    float mix[MIX_PERIOD_SAMPLES];
+    int16_t out[MIX_PERIOD_SAMPLES];
+    uint32_t queued[MIX_MAX_CLIENTS];
+    i2s_position_t pos;
+    uint64_t start_ns, mix_ns, load, latency_us;
+    int streaming = 0;
+    float gain;
+    size_t i;
+    int id;
+    
+    (void)arg;
+    
+    if (config.rt_policy == SCHED_DEADLINE)
+        mixer_set_deadline();
+    if (config.lock_memory)
+        mixer_prefault_stack();
+    
+    while (running) {
+        pthread_mutex_lock(&clients_lock);
+        while (running && !nclients) {
+            if (streaming) {
+                i2s_stop(i2s_dev);
+                streaming = 0;
+            }
+            pthread_cond_wait(&clients_cond, &clients_lock);
+        }
+        
+        start_ns = now_ns();
+        memset(mix, 0, sizeof(mix));
+        for (id = 0; id < MIX_MAX_CLIENTS; id++) {
+            queued[id] = UINT32_MAX;
+            if (clients[id].active)
+                queued[id] = mix_client_pull(&clients[id], mix);
+        }
+        pthread_mutex_unlock(&clients_lock);
+        
+        if (!running)
+            break;
+        
+        gain = __atomic_load_n(&volume, __ATOMIC_RELAXED) / 100.0f;
+        for (i = 0; i < MIX_PERIOD_SAMPLES; i++)
+            mix[i] *= gain;
+        
+        /* Several loud clients can sum past full scale */
+        i2s_convert(out, I2S_SAMPLE_S16, mix, I2S_SAMPLE_FLOAT32,
+                    MIX_PERIOD_SAMPLES, I2S_CONVERT_SATURATE);
+        
+        /* Mixing time, and its share of the period as a smoothed load */
+        mix_ns = now_ns() - start_ns;
+        stats_add(&stats->mix_ns_total, mix_ns);
+        stats_histogram(stats->mix_us, mix_ns / 1000);
+        load = stats_get(&stats->load_permille);
+        stats_set(&stats->load_permille,
+                  (load * 7 + mix_ns * 1000 / period_ns) / 8);
+        
+        if (mix_write(out) < 0) {
+            running = 0;
+            break;
+        }
+        streaming = 1;
+        stats_add(&stats->frames, MIX_PERIOD_FRAMES);
+        stats_add(&stats->periods, 1);
+        
+        /* A client's newest frame plays after its queue and the device's */
+        if (i2s_get_position(i2s_dev, I2S_STREAM_PLAYBACK, &pos) == 0) {
+            stats_set(&stats->xruns, pos.xruns);
+            for (id = 0; id < MIX_MAX_CLIENTS; id++) {
+                if (queued[id] == UINT32_MAX)
+                    continue;
+                latency_us = ((uint64_t)queued[id] + pos.fill_frames) *
+                    1000000 / MIX_RATE;
+                stats_add(&stats->latency_us_total, latency_us);
+                stats_histogram(stats->latency_us, latency_us);
+            }
+        }
+    }
+    
+    i2s_stop(i2s_dev);
+    return NULL;
+}
+
 /* Create Unix domain socket for IPC */
 static int create_socket(void)
 {
@@ -144,7 +772,7 @@ static int create_socket(void)
         return -1;
     }
     
-    if (listen(socket_fd, 5) < 0) {
+    if (listen(socket_fd, SOMAXCONN) < 0) {
         syslog(LOG_ERR, "Failed to listen on socket: %s", strerror(errno));
         close(socket_fd);
         return -1;
@@ -157,105 +785,1006 @@ static int create_socket(void)
     return 0;
 }
 
-/* Handle client request */
-static void handle_client(int client_fd)
+/* Re-arm the connection's timeout after progress */
+static void conn_touch(struct connection *conn)
 {
-    daemon_msg_t msg;
-    daemon_response_t resp;
-    ssize_t n;
+    if (conn->http || conn->in_len || conn->out_len)
+        conn->deadline_ms = now_ms() + CONN_IO_TIMEOUT_MS;
+    else if (conn->stream >= 0)
+        conn->deadline_ms = 0;
+    else
+        conn->deadline_ms = now_ms() + CONN_IDLE_TIMEOUT_MS;
+}
+
+/* Room for the largest reply, so a request is only read when it can be answered */
+static int conn_out_room(const struct connection *conn)
+{
+    return conn->out_len + I2SD_MAX_FRAME <= CONN_OUT_BYTES;
+}
+
+/*
+ * Wait for input only while there is room for the reply, and for output
+ * only while replies are queued.
+ */
+static void conn_update_events(struct connection *conn)
+{
+    struct epoll_event ev;
+    uint32_t events = 0;
     
-    n = read(client_fd, &msg, sizeof(msg));
-    if (n != sizeof(msg)) {
-        syslog(LOG_WARNING, "Invalid message size received");
-        close(client_fd);
+    if (!conn->closing && conn_out_room(conn))
+        events |= EPOLLIN;
+    if (conn->out_len)
+        events |= EPOLLOUT;
+    
+    if (events == conn->events)
         return;
+    
+    ev.events = events;
+    ev.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) == 0)
+        conn->events = events;
+}
+
+/* Drop a connection together with the stream it opened */
+static void close_connection(struct connection *conn)
+{
+    if (conn->stream >= 0) {
+        mix_client_close(conn->stream);
+        syslog(LOG_INFO, "Playback stream %d closed", conn->stream);
+        conn->stream = -1;
     }
     
-    memset(&resp, 0, sizeof(resp));
+    if (conn->out_fds_pending) {
+        close(conn->out_fds[0]);
+        conn->out_fds_pending = 0;
+    }
     
-    switch (msg.cmd) {
+    /* Closing the fd also removes it from the epoll set */
+    close(conn->fd);
+    conn->fd = -1;
+}
+
+/* Reply being built in a connection's output buffer */
+struct reply {
+    struct i2sd_hdr *hdr;
+    unsigned char *pos;
+};
+
+/* Append a numeric attribute to a reply */
+static void reply_put(struct reply *reply, uint16_t type, uint64_t value)
+{
+    struct i2sd_attr attr = { .type = type, .length = sizeof(value) };
+    
+    memcpy(reply->pos, &attr, sizeof(attr));
+    memcpy(reply->pos + sizeof(attr), &value, sizeof(value));
+    reply->pos += I2SD_ATTR_SIZE;
+    reply->hdr->length += I2SD_ATTR_SIZE;
+}
+
+/*
+ * Find a request's numeric argument. Unknown attributes are skipped, so
+ * newer clients can add them without breaking this daemon.
+ */
+static int request_param(const struct i2sd_hdr *hdr, int64_t *param)
+{
+    const unsigned char *p = (const unsigned char *)(hdr + 1);
+    const unsigned char *end = p + hdr->length;
+    struct i2sd_attr attr;
+    
+    while (end - p >= (ptrdiff_t)sizeof(attr)) {
+        memcpy(&attr, p, sizeof(attr));
+        p += sizeof(attr);
+        if (attr.length > end - p)
+            break;
+        if (attr.type == ATTR_PARAM && attr.length == sizeof(*param)) {
+            memcpy(param, p, sizeof(*param));
+            return 0;
+        }
+        p += (attr.length + 3) & ~3u;
+    }
+    
+    return -1;
+}
+
+/*
+ * Execute one request and put its reply at the end of the output buffer.
+ * A reply that opens a stream carries the stream's fds along with it.
+ */
+static void handle_request(struct connection *conn, const struct i2sd_hdr *hdr)
+{
+    union {
+        struct i2sd_hdr hdr;
+        unsigned char bytes[I2SD_MAX_FRAME];
+    } frame;
+    struct reply reply;
+    i2s_resampler_t resampler;
+    int64_t param = 0, rate;
+    int fds[2], id, has_param;
+    
+    /* Built aside, as the output buffer can be at any alignment */
+    reply.hdr = &frame.hdr;
+    reply.pos = (unsigned char *)(reply.hdr + 1);
+    memset(reply.hdr, 0, sizeof(*reply.hdr));
+    reply.hdr->magic = I2SD_MAGIC;
+    reply.hdr->version = I2SD_VERSION;
+    reply.hdr->flags = I2SD_FLAG_REPLY;
+    reply.hdr->cmd = hdr->cmd;
+    reply.hdr->id = hdr->id;
+    
+    if (hdr->version != I2SD_VERSION) {
+        reply.hdr->status = -EPROTONOSUPPORT;
+        goto out;
+    }
+    
+    has_param = request_param(hdr, &param) == 0;
+    
+    switch (hdr->cmd) {
     case CMD_GET_STATUS:
-        resp.status = 0;
-        snprintf(resp.message, sizeof(resp.message), 
-                 "I2S daemon running, device: %s", I2S_DEVICE);
+        /* From the stats page, so status polls never contend with the mixer */
+        reply_put(&reply, ATTR_CLIENTS, stats_get(&stats->clients));
+        reply_put(&reply, ATTR_VOLUME,
+                  (uint64_t)__atomic_load_n(&volume, __ATOMIC_RELAXED));
+        reply_put(&reply, ATTR_RATE, MIX_RATE);
+        reply_put(&reply, ATTR_CHANNELS, MIX_CHANNELS);
         syslog(LOG_DEBUG, "Status request received");
         break;
         
     case CMD_SET_VOLUME:
-        resp.status = 0;
-        snprintf(resp.message, sizeof(resp.message), 
-                 "Volume set to %d", msg.param);
-        syslog(LOG_INFO, "Volume set to %d", msg.param);
+        if (!has_param || param < 0 || param > 100) {
+            reply.hdr->status = -EINVAL;
+            break;
+        }
+        __atomic_store_n(&volume, (int)param, __ATOMIC_RELAXED);
+        reply_put(&reply, ATTR_VOLUME, (uint64_t)param);
+        syslog(LOG_INFO, "Volume set to %d", (int)param);
         break;
         
     case CMD_GET_STATS:
-        resp.status = 0;
-        snprintf(resp.message, sizeof(resp.message), 
-                 "Uptime: %ld seconds", time(NULL));
+        reply_put(&reply, ATTR_UPTIME, (uint64_t)(time(NULL) - start_time));
+        reply_put(&reply, ATTR_FRAMES, stats_get(&stats->frames));
+        reply_put(&reply, ATTR_XRUNS, stats_get(&stats->xruns));
+        reply_put(&reply, ATTR_UNDERRUNS, stats_get(&stats->client_underruns));
+        reply_put(&reply, ATTR_CLIENTS, stats_get(&stats->clients));
+        reply_put(&reply, ATTR_LOAD, stats_get(&stats->load_permille));
+        reply_put(&reply, ATTR_LATENCY_P50,
+                  i2s_daemon_stats_percentile(stats->latency_us, 0.50));
+        reply_put(&reply, ATTR_LATENCY_P99,
+                  i2s_daemon_stats_percentile(stats->latency_us, 0.99));
+        break;
+        
+    case CMD_OPEN_STREAM:
+        /* Also refused while an earlier stream's fds are still queued */
+        if (conn->stream >= 0 || conn->out_fds_pending) {
+            reply.hdr->status = -EBUSY;
+            break;
+        }
+        
+        rate = has_param && param ? param : MIX_RATE;
+        if (rate < I2S_RESAMPLE_MIN_RATE || rate > I2S_RESAMPLE_MAX_RATE) {
+            reply.hdr->status = -EINVAL;
+            break;
+        }
+        
+        /* Filter tables, like the ring, are built outside the mixer's lock */
+        resampler = NULL;
+        if (rate != MIX_RATE) {
+            resampler = i2s_resampler_create((int)rate, MIX_RATE, MIX_CHANNELS,
+                                             config.resample_quality);
+            if (!resampler) {
+                reply.hdr->status = -errno;
+                break;
+            }
+        }
+        
+        id = mix_client_open(&fds[0], &fds[1], (uint32_t)rate, resampler);
+        
+        if (id < 0) {
+            reply.hdr->status = -errno;
+            i2s_resampler_destroy(resampler);
+            break;
+        }
+        
+        conn->stream = id;
+        conn->out_fds[0] = fds[0];
+        conn->out_fds[1] = fds[1];
+        conn->out_fds_pending = 1;
+        conn->out_fds_pos = conn->out_len;
+        reply_put(&reply, ATTR_STREAM, (uint64_t)id);
+        reply_put(&reply, ATTR_RATE, (uint64_t)rate);
+        reply_put(&reply, ATTR_CHANNELS, MIX_CHANNELS);
+        syslog(LOG_INFO, "Playback stream %d opened at %d Hz", id, (int)rate);
+        break;
+        
+    case CMD_CLOSE_STREAM:
+        if (conn->stream < 0 || !has_param || param != conn->stream) {
+            reply.hdr->status = -EINVAL;
+            break;
+        }
+        
+        mix_client_close(conn->stream);
+        syslog(LOG_INFO, "Playback stream %d closed", conn->stream);
+        conn->stream = -1;
         break;
         
     case CMD_SHUTDOWN:
-        resp.status = 0;
-        snprintf(resp.message, sizeof(resp.message), "Shutting down daemon");
         syslog(LOG_INFO, "Shutdown command received");
         running = 0;
         break;
         
     default:
-        resp.status = -1;
-        snprintf(resp.message, sizeof(resp.message), "Unknown command");
-        syslog(LOG_WARNING, "Unknown command received: %d", msg.cmd);
+        reply.hdr->status = -EOPNOTSUPP;
+        syslog(LOG_WARNING, "Unknown command received: %d", hdr->cmd);
     }
     
-    write(client_fd, &resp, sizeof(resp));
-    close(client_fd);
+out:
+    memcpy(conn->out + conn->out_len, frame.bytes,
+           sizeof(frame.hdr) + frame.hdr.length);
+    conn->out_len += sizeof(frame.hdr) + frame.hdr.length;
 }
 
-/* Main event loop */
-static void event_loop(void)
+/*
+ * Send queued replies until the socket fills up. Stream fds go out with
+ * the first byte of their reply. Returns -1 once the connection is dead.
+ */
+static int conn_flush(struct connection *conn)
 {
-    fd_set readfds;
-    struct timeval tv;
-    int max_fd;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct iovec iov;
+    struct msghdr mh;
+    struct cmsghdr *cmsg;
+    int with_fds;
+    ssize_t n;
     
-    while (running) {
-        FD_ZERO(&readfds);
-        FD_SET(socket_fd, &readfds);
-        max_fd = socket_fd;
+    while (conn->out_off < conn->out_len) {
+        iov.iov_base = conn->out + conn->out_off;
+        iov.iov_len = conn->out_len - conn->out_off;
+        
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        
+        /* Stop short of the reply with fds, then send it with them */
+        with_fds = conn->out_fds_pending && conn->out_fds_pos == conn->out_off;
+        if (conn->out_fds_pending && conn->out_fds_pos > conn->out_off)
+            iov.iov_len = conn->out_fds_pos - conn->out_off;
+        
+        if (with_fds) {
+            memset(&control, 0, sizeof(control));
+            mh.msg_control = control.buf;
+            mh.msg_controllen = sizeof(control.buf);
+            cmsg = CMSG_FIRSTHDR(&mh);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+            memcpy(CMSG_DATA(cmsg), conn->out_fds, 2 * sizeof(int));
+        }
+        
+        /* A client that went away must not kill the daemon with SIGPIPE */
+        n = sendmsg(conn->fd, &mh, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                break;
+            return -1;
+        }
+        
+        /* The client has its own copy of the memfd now; the mapping stays */
+        if (with_fds) {
+            close(conn->out_fds[0]);
+            conn->out_fds_pending = 0;
+        }
+        
+        conn->out_off += (size_t)n;
+    }
+    
+    /* Compact, so the buffer keeps room for new replies */
+    if (conn->out_off) {
+        memmove(conn->out, conn->out + conn->out_off,
+                conn->out_len - conn->out_off);
+        if (conn->out_fds_pending)
+            conn->out_fds_pos -= conn->out_off;
+        conn->out_len -= conn->out_off;
+        conn->out_off = 0;
+    }
+    
+    return 0;
+}
+
+/*
+ * Read whatever the client sent and answer every complete request in it,
+ * so pipelined requests are served in one pass. Stops early while the
+ * reply buffer is full; the rest waits in the socket. Returns -1 once
+ * the connection should be dropped.
+ */
+static int conn_read(struct connection *conn)
+{
+    struct i2sd_hdr hdr;
+    size_t frame;
+    ssize_t n;
+    
+    while (conn_out_room(conn)) {
+        /* Requests already buffered first */
+        if (conn->in_len >= sizeof(hdr)) {
+            memcpy(&hdr, conn->in, sizeof(hdr));
+            if (hdr.magic != I2SD_MAGIC || hdr.length > I2SD_MAX_PAYLOAD) {
+                syslog(LOG_WARNING, "Malformed request, dropping client");
+                return -1;
+            }
+            
+            frame = sizeof(hdr) + hdr.length;
+            if (conn->in_len >= frame) {
+                handle_request(conn, (const struct i2sd_hdr *)conn->in);
+                conn->in_len -= frame;
+                memmove(conn->in, conn->in + frame, conn->in_len);
+                continue;
+            }
+        }
+        
+        n = read(conn->fd, conn->in + conn->in_len,
+                 sizeof(conn->in) - conn->in_len);
+        if (n == 0) {
+            return -1;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                break;
+            return -1;
+        }
+        
+        conn->in_len += (size_t)n;
+    }
+    
+    return 0;
+}
+
+/* Append formatted text, truncating at the end of the buffer */
+static void text_append(char *buf, size_t size, size_t *len,
+                        const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+    
+    if (*len >= size)
+        return;
+    
+    va_start(ap, fmt);
+    n = vsnprintf(buf + *len, size - *len, fmt, ap);
+    va_end(ap);
+    
+    if (n > 0)
+        *len = *len + (size_t)n < size ? *len + (size_t)n : size;
+}
+
+/* One histogram of microsecond buckets, exported in seconds */
+static void metrics_histogram(char *buf, size_t size, size_t *len,
+                              const char *name, const char *help,
+                              const uint64_t *buckets, double sum_seconds)
+{
+    uint64_t count = 0;
+    int i;
+    
+    text_append(buf, size, len, "# HELP %s %s\n# TYPE %s histogram\n",
+                name, help, name);
+    for (i = 0; i < I2S_STATS_BUCKETS - 1; i++) {
+        count += stats_get(&buckets[i]);
+        text_append(buf, size, len, "%s_bucket{le=\"%g\"} %llu\n", name,
+                    (double)((uint64_t)1 << i) / 1e6, (unsigned long long)count);
+    }
+    count += stats_get(&buckets[i]);
+    text_append(buf, size, len, "%s_bucket{le=\"+Inf\"} %llu\n", name,
+                (unsigned long long)count);
+    text_append(buf, size, len, "%s_sum %g\n%s_count %llu\n", name,
+                sum_seconds, name, (unsigned long long)count);
+}
+
+/* Queue the Prometheus text exposition of the statistics page */
+static void metrics_reply(struct connection *conn)
+{
+    char body[CONN_OUT_BYTES - 256];
+    size_t len = 0, room;
+    int n;
+    
+    text_append(body, sizeof(body), &len,
+                "# HELP i2sd_uptime_seconds Time since the daemon started.\n"
+                "# TYPE i2sd_uptime_seconds gauge\n"
+                "i2sd_uptime_seconds %ld\n"
+                "# HELP i2sd_frames_total Frames written to the device.\n"
+                "# TYPE i2sd_frames_total counter\n"
+                "i2sd_frames_total %llu\n"
+                "# HELP i2sd_xruns_total Device underruns.\n"
+                "# TYPE i2sd_xruns_total counter\n"
+                "i2sd_xruns_total %llu\n"
+                "# HELP i2sd_client_underruns_total Client periods with less than a period queued.\n"
+                "# TYPE i2sd_client_underruns_total counter\n"
+                "i2sd_client_underruns_total %llu\n"
+                "# HELP i2sd_clients Attached playback clients.\n"
+                "# TYPE i2sd_clients gauge\n"
+                "i2sd_clients %llu\n"
+                "# HELP i2sd_mixer_load_ratio Mixing time per period time.\n"
+                "# TYPE i2sd_mixer_load_ratio gauge\n"
+                "i2sd_mixer_load_ratio %.3f\n",
+                (long)(time(NULL) - start_time),
+                (unsigned long long)stats_get(&stats->frames),
+                (unsigned long long)stats_get(&stats->xruns),
+                (unsigned long long)stats_get(&stats->client_underruns),
+                (unsigned long long)stats_get(&stats->clients),
+                stats_get(&stats->load_permille) / 1000.0);
+    metrics_histogram(body, sizeof(body), &len, "i2sd_mix_duration_seconds",
+                      "Mixing time per period.", stats->mix_us,
+                      stats_get(&stats->mix_ns_total) / 1e9);
+    metrics_histogram(body, sizeof(body), &len, "i2sd_latency_seconds",
+                      "Client ring to DAC latency, sampled every period.",
+                      stats->latency_us,
+                      stats_get(&stats->latency_us_total) / 1e6);
+    
+    room = CONN_OUT_BYTES - conn->out_len;
+    n = snprintf((char *)conn->out + conn->out_len, room,
+                 "HTTP/1.0 200 OK\r\n"
+                 "Content-Type: text/plain; version=0.0.4\r\n"
+                 "Content-Length: %zu\r\n"
+                 "Connection: close\r\n\r\n", len);
+    if (n < 0 || (size_t)n + len > room)
+        return;
+    
+    memcpy(conn->out + conn->out_len + n, body, len);
+    conn->out_len += (size_t)n + len;
+}
+
+/*
+ * Read a scrape request. Its contents do not matter, any request gets
+ * the metrics once its headers are complete, then the connection closes.
+ */
+static int http_read(struct connection *conn)
+{
+    unsigned char discard[256];
+    ssize_t n;
+    
+    for (;;) {
+        if (conn->closing) {
+            n = read(conn->fd, discard, sizeof(discard));
+        } else {
+            n = read(conn->fd, conn->in + conn->in_len,
+                     sizeof(conn->in) - conn->in_len);
+        }
+        
+        if (n == 0) {
+            /* A client may half-close after its request */
+            return conn->closing ? 0 : -1;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                return 0;
+            return -1;
+        }
+        if (conn->closing)
+            continue;
+        
+        conn->in_len += (size_t)n;
+        if (memmem(conn->in, conn->in_len, "\r\n\r\n", 4) ||
+            conn->in_len == sizeof(conn->in)) {
+            metrics_reply(conn);
+            conn->in_len = 0;
+            conn->closing = 1;
+        }
+    }
+}
+
+/* Read and answer requests of either kind of connection */
+static int conn_input(struct connection *conn)
+{
+    return conn->http ? http_read(conn) : conn_read(conn);
+}
+
+/* Serve readiness on one connection */
+static void handle_client(struct connection *conn, uint32_t events)
+{
+    if ((events & (EPOLLHUP | EPOLLERR)) && !(events & EPOLLIN)) {
+        close_connection(conn);
+        return;
+    }
+    
+    if ((events & EPOLLIN) && conn_input(conn) < 0) {
+        close_connection(conn);
+        return;
+    }
+    
+    if (conn_flush(conn) < 0) {
+        close_connection(conn);
+        return;
+    }
+    
+    /* Sent replies may have made room for requests already buffered */
+    if (!conn->http && conn_out_room(conn) && conn_read(conn) < 0) {
+        close_connection(conn);
+        return;
+    }
+    if (conn_flush(conn) < 0) {
+        close_connection(conn);
+        return;
+    }
+    
+    if (conn->closing && !conn->out_len) {
+        close_connection(conn);
+        return;
+    }
+    
+    conn_touch(conn);
+    conn_update_events(conn);
+}
+
+/* Take every pending connection, turning away those over the limit */
+static void accept_connections(int listen_fd, int http)
+{
+    struct epoll_event ev;
+    struct connection *conn;
+    int client_fd, i;
+    
+    for (;;) {
+        client_fd = accept4(listen_fd, NULL, NULL,
+                            SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            return;
+        }
+        
+        conn = NULL;
+        for (i = 0; i < MAX_CONNECTIONS; i++) {
+            if (conns[i].fd < 0) {
+                conn = &conns[i];
+                break;
+            }
+        }
+        
+        if (!conn) {
+            syslog(LOG_WARNING, "Too many connections, rejecting client");
+            close(client_fd);
+            continue;
+        }
+        
+        memset(conn, 0, sizeof(*conn));
+        conn->fd = client_fd;
+        conn->http = http;
+        conn->stream = -1;
+        conn->events = EPOLLIN;
         
-        tv.tv_sec = 1;
-        tv.tv_usec = 0;
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+            syslog(LOG_ERR, "epoll_ctl() error: %s", strerror(errno));
+            close(client_fd);
+            conn->fd = -1;
+            continue;
+        }
         
-        int ret = select(max_fd + 1, &readfds, NULL, NULL, &tv);
+        conn_touch(conn);
+    }
+}
+
+/* Drop timed out connections; returns ms until the next deadline */
+static int expire_connections(void)
+{
+    uint64_t now = now_ms();
+    int timeout = 1000;
+    int i;
+    
+    for (i = 0; i < MAX_CONNECTIONS; i++) {
+        if (conns[i].fd < 0 || !conns[i].deadline_ms)
+            continue;
         
-        if (ret < 0) {
+        if (conns[i].deadline_ms <= now) {
+            syslog(LOG_DEBUG, "Connection timed out");
+            close_connection(&conns[i]);
+        } else if (conns[i].deadline_ms - now < (uint64_t)timeout) {
+            timeout = (int)(conns[i].deadline_ms - now);
+        }
+    }
+    
+    return timeout;
+}
+
+/* Set up the epoll set with the listening socket */
+static int create_reactor(void)
+{
+    struct epoll_event ev;
+    
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        syslog(LOG_ERR, "Failed to create epoll set: %s", strerror(errno));
+        return -1;
+    }
+    
+    /* Listening sockets are told apart from connections by address */
+    ev.events = EPOLLIN;
+    ev.data.ptr = &socket_fd;
+    if (fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL) | O_NONBLOCK) < 0 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket_fd, &ev) < 0) {
+        syslog(LOG_ERR, "Failed to watch control socket: %s", strerror(errno));
+        return -1;
+    }
+    
+    return 0;
+}
+
+/* Serve Prometheus scrapes on localhost, if a port was given */
+static int create_metrics_socket(void)
+{
+    struct sockaddr_in addr;
+    struct epoll_event ev;
+    int one = 1;
+    
+    if (!config.metrics_port)
+        return 0;
+    
+    metrics_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (metrics_fd < 0) {
+        syslog(LOG_ERR, "Failed to create metrics socket: %s", strerror(errno));
+        return -1;
+    }
+    
+    setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)config.metrics_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    
+    ev.events = EPOLLIN;
+    ev.data.ptr = &metrics_fd;
+    if (bind(metrics_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(metrics_fd, SOMAXCONN) < 0 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, metrics_fd, &ev) < 0) {
+        syslog(LOG_ERR, "Failed to serve metrics on port %d: %s",
+               config.metrics_port, strerror(errno));
+        return -1;
+    }
+    
+    syslog(LOG_INFO, "Metrics served at http://127.0.0.1:%d/metrics",
+           config.metrics_port);
+    return 0;
+}
+
+/*
+ * Main event loop: every connection is non-blocking and served as it
+ * becomes ready, so a slow client only delays itself.
+ */
+static void event_loop(void)
+{
+    struct epoll_event events[64];
+    int timeout, listening, scraping, n, i;
+    
+    while (running) {
+        timeout = expire_connections();
+        
+        n = epoll_wait(epoll_fd, events, 64, timeout);
+        if (n < 0) {
             if (errno == EINTR)
                 continue;
-            syslog(LOG_ERR, "select() error: %s", strerror(errno));
+            syslog(LOG_ERR, "epoll_wait() error: %s", strerror(errno));
             break;
         }
         
-        if (ret == 0)
+        listening = scraping = 0;
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == &socket_fd)
+                listening = 1;
+            else if (events[i].data.ptr == &metrics_fd)
+                scraping = 1;
+            else if (((struct connection *)events[i].data.ptr)->fd >= 0)
+                handle_client(events[i].data.ptr, events[i].events);
+        }
+        
+        /* Accept last, so no slot is reused while events for it are pending */
+        if (listening)
+            accept_connections(socket_fd, 0);
+        if (scraping)
+            accept_connections(metrics_fd, 1);
+    }
+}
+
+/*
+ * Start the mixer thread with its real-time policy and CPUs. Without the
+ * privilege for SCHED_FIFO it still starts, at normal priority.
+ */
+static int start_mixer(void)
+{
+    pthread_mutexattr_t mattr;
+    struct sched_param sp;
+    pthread_attr_t attr;
+    int ret;
+    
+    /* The control thread runs demoted; while it holds clients_lock a
+     * waiting mixer lends it its priority instead of being held up */
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setprotocol(&mattr, PTHREAD_PRIO_INHERIT);
+    pthread_mutex_init(&clients_lock, &mattr);
+    pthread_mutexattr_destroy(&mattr);
+    
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, MIXER_STACK_SIZE);
+    
+    if (config.rt_policy == SCHED_FIFO) {
+        sp.sched_priority = config.rt_priority;
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &sp);
+    }
+    
+    /* SCHED_DEADLINE refuses threads confined to part of the system */
+    if (config.has_cpus && config.rt_policy != SCHED_DEADLINE)
+        pthread_attr_setaffinity_np(&attr, sizeof(config.cpus), &config.cpus);
+    else if (config.has_cpus)
+        syslog(LOG_WARNING, "cpus is ignored with SCHED_DEADLINE");
+    
+    ret = pthread_create(&mixer_tid, &attr, mixer_thread, NULL);
+    if (ret == EPERM && config.rt_policy == SCHED_FIFO) {
+        syslog(LOG_WARNING, "SCHED_FIFO not permitted, mixer runs at "
+               "normal priority");
+        pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+        ret = pthread_create(&mixer_tid, &attr, mixer_thread, NULL);
+    }
+    pthread_attr_destroy(&attr);
+    
+    if (ret) {
+        syslog(LOG_ERR, "Failed to start mixer: %s", strerror(ret));
+        return -1;
+    }
+    
+    mixer_started = 1;
+    return 0;
+}
+
+/*
+ * The calling thread goes on serving the sockets: lower its priority and
+ * keep it off the mixer's CPUs, so a burst of requests never competes
+ * with audio.
+ */
+static void demote_control_thread(void)
+{
+    cpu_set_t rest;
+    int cpu;
+    
+    if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid),
+                    config.control_nice) < 0)
+        syslog(LOG_WARNING, "Failed to renice control thread: %s",
+               strerror(errno));
+    
+    if (!config.has_cpus || sched_getaffinity(0, sizeof(rest), &rest) < 0)
+        return;
+    
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &config.cpus))
+            CPU_CLR(cpu, &rest);
+    }
+    
+    /* Share the mixer's CPUs rather than have none */
+    if (CPU_COUNT(&rest) && sched_setaffinity(0, sizeof(rest), &rest) < 0)
+        syslog(LOG_WARNING, "Failed to move control thread: %s",
+               strerror(errno));
+}
+
+/* Lock all current and future memory, so the audio path never pages */
+static void lock_memory(void)
+{
+    if (!config.lock_memory)
+        return;
+    
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+        syslog(LOG_WARNING, "Failed to lock memory: %s", strerror(errno));
+}
+
+/* Parse a CPU list such as "2,4-5" */
+static int parse_cpus(const char *list, cpu_set_t *set)
+{
+    char *end;
+    long first, last;
+    
+    CPU_ZERO(set);
+    while (*list) {
+        first = strtol(list, &end, 10);
+        if (end == list || first < 0 || first >= CPU_SETSIZE)
+            return -1;
+        last = first;
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list || last < first || last >= CPU_SETSIZE)
+                return -1;
+        }
+        for (; first <= last; first++)
+            CPU_SET((int)first, set);
+        
+        if (*end == ',')
+            end++;
+        else if (*end)
+            return -1;
+        list = end;
+    }
+    
+    return CPU_COUNT(set) ? 0 : -1;
+}
+
+static int parse_bool(const char *value, int *out)
+{
+    if (!strcmp(value, "yes") || !strcmp(value, "1"))
+        *out = 1;
+    else if (!strcmp(value, "no") || !strcmp(value, "0"))
+        *out = 0;
+    else
+        return -1;
+    return 0;
+}
+
+static int parse_int(const char *value, int min, int max, int *out)
+{
+    char *end;
+    long n;
+    
+    n = strtol(value, &end, 10);
+    if (end == value || *end || n < min || n > max)
+        return -1;
+    *out = (int)n;
+    return 0;
+}
+
+/* Apply one setting */
+static int config_set(const char *key, const char *value)
+{
+    if (!strcmp(key, "rt_policy")) {
+        if (!strcmp(value, "other"))
+            config.rt_policy = SCHED_OTHER;
+        else if (!strcmp(value, "fifo"))
+            config.rt_policy = SCHED_FIFO;
+        else if (!strcmp(value, "deadline"))
+            config.rt_policy = SCHED_DEADLINE;
+        else
+            return -1;
+        return 0;
+    }
+    if (!strcmp(key, "rt_priority"))
+        return parse_int(value, 1, 99, &config.rt_priority);
+    if (!strcmp(key, "deadline_runtime_us"))
+        return parse_int(value, 10, 5000, &config.deadline_runtime_us);
+    if (!strcmp(key, "cpus")) {
+        if (parse_cpus(value, &config.cpus) < 0)
+            return -1;
+        config.has_cpus = 1;
+        return 0;
+    }
+    if (!strcmp(key, "lock_memory"))
+        return parse_bool(value, &config.lock_memory);
+    if (!strcmp(key, "control_nice"))
+        return parse_int(value, -20, 19, &config.control_nice);
+    if (!strcmp(key, "metrics_port"))
+        return parse_int(value, 0, 65535, &config.metrics_port);
+    if (!strcmp(key, "resample_quality")) {
+        if (!strcmp(value, "fast"))
+            config.resample_quality = I2S_RESAMPLE_FAST;
+        else if (!strcmp(value, "medium"))
+            config.resample_quality = I2S_RESAMPLE_MEDIUM;
+        else if (!strcmp(value, "best"))
+            config.resample_quality = I2S_RESAMPLE_BEST;
+        else
+            return -1;
+        return 0;
+    }
+    
+    return -1;
+}
+
+/* Apply a "key=value" option from the command line */
+static int config_option(const char *option)
+{
+    char buf[256];
+    char *value;
+    
+    snprintf(buf, sizeof(buf), "%s", option);
+    value = strchr(buf, '=');
+    if (!value)
+        return -1;
+    *value++ = '\0';
+    return config_set(buf, value);
+}
+
+/* Strip leading and trailing blanks in place */
+static char *trim(char *str)
+{
+    char *end;
+    
+    while (isspace((unsigned char)*str))
+        str++;
+    end = str + strlen(str);
+    while (end > str && isspace((unsigned char)end[-1]))
+        *--end = '\0';
+    return str;
+}
+
+/*
+ * Read "key = value" lines, '#' starting a comment. A missing file is
+ * only an error when it was named on the command line.
+ */
+static int config_load(const char *path, int required)
+{
+    char line[256];
+    char *key, *value;
+    int lineno = 0;
+    FILE *fp;
+    
+    fp = fopen(path, "r");
+    if (!fp) {
+        if (!required && errno == ENOENT)
+            return 0;
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+        value = strchr(line, '#');
+        if (value)
+            *value = '\0';
+        
+        key = trim(line);
+        if (!*key)
             continue;
         
-        if (FD_ISSET(socket_fd, &readfds)) {
-            int client_fd = accept(socket_fd, NULL, NULL);
-            if (client_fd >= 0) {
-                handle_client(client_fd);
-            }
+        value = strchr(key, '=');
+        if (!value) {
+            fprintf(stderr, "%s:%d: expected key = value\n", path, lineno);
+            fclose(fp);
+            return -1;
+        }
+        *value++ = '\0';
+        key = trim(key);
+        
+        if (config_set(key, trim(value)) < 0) {
+            fprintf(stderr, "%s:%d: invalid %s\n", path, lineno, key);
+            fclose(fp);
+            return -1;
         }
     }
+    
+    fclose(fp);
+    return 0;
 }
 
 /* Cleanup resources */
 static void cleanup(void)
 {
-    if (i2s_fd >= 0)
-        close(i2s_fd);
+    int id, i;
+    
+    if (mixer_started) {
+        pthread_mutex_lock(&clients_lock);
+        running = 0;
+        pthread_cond_broadcast(&clients_cond);
+        pthread_mutex_unlock(&clients_lock);
+        pthread_join(mixer_tid, NULL);
+    }
+    
+    for (i = 0; i < MAX_CONNECTIONS; i++) {
+        if (conns[i].fd >= 0)
+            close_connection(&conns[i]);
+    }
+    
+    for (id = 0; id < MIX_MAX_CLIENTS; id++) {
+        if (clients[id].active)
+            mix_client_close(id);
+    }
+    
+    if (i2s_dev)
+        i2s_close(i2s_dev);
     
     if (socket_fd >= 0)
         close(socket_fd);
     
+    if (metrics_fd >= 0)
+        close(metrics_fd);
+    
+    if (epoll_fd >= 0)
+        close(epoll_fd);
+    
+    stats_close();
+    
     unlink(SOCKET_PATH);
     unlink(PID_FILE);
     
@@ -265,18 +1794,61 @@ static void cleanup(void)
 
 int main(int argc, char *argv[])
 {
-    int foreground = 0;
+    static char port_option[32];
+    const char *options[MAX_OPTIONS];
+    const char *config_path = CONFIG_FILE;
+    int config_required = 0;
+    int noptions = 0;
+    int i, opt;
     
-    /* Parse command line arguments */
-    if (argc > 1 && strcmp(argv[1], "-f") == 0) {
-        foreground = 1;
+    for (i = 0; i < MAX_CONNECTIONS; i++)
+        conns[i].fd = -1;
+    
+    /* Parse command line arguments; they override the config file */
+    while ((opt = getopt(argc, argv, "fc:m:o:")) != -1) {
+        switch (opt) {
+        case 'f':
+            config.foreground = 1;
+            break;
+        case 'c':
+            config_path = optarg;
+            config_required = 1;
+            break;
+        case 'm':
+            snprintf(port_option, sizeof(port_option), "metrics_port=%s",
+                     optarg);
+            optarg = port_option;
+            /* fall through */
+        case 'o':
+            if (noptions == MAX_OPTIONS) {
+                fprintf(stderr, "Too many options\n");
+                return EXIT_FAILURE;
+            }
+            options[noptions++] = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-f] [-c config] [-m metrics_port] "
+                    "[-o key=value]...\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    
+    if (config_load(config_path, config_required) < 0) {
+        return EXIT_FAILURE;
+    }
+    
+    for (i = 0; i < noptions; i++) {
+        if (config_option(options[i]) < 0) {
+            fprintf(stderr, "Invalid option: %s\n", options[i]);
+            return EXIT_FAILURE;
+        }
     }
     
     /* Open syslog */
-    openlog("i2sd", LOG_PID | (foreground ? LOG_PERROR : 0), LOG_DAEMON);
+    openlog("i2sd", LOG_PID | (config.foreground ? LOG_PERROR : 0), LOG_DAEMON);
     
     /* Daemonize unless running in foreground */
-    if (!foreground) {
+    if (!config.foreground) {
         if (daemonize() < 0) {
             syslog(LOG_ERR, "Failed to daemonize");
             return EXIT_FAILURE;
@@ -284,6 +1856,8 @@ int main(int argc, char *argv[])
     }
     
     syslog(LOG_INFO, "I2S daemon starting");
+    start_time = time(NULL);
+    stats_open();
     
     /* Write PID file */
     if (write_pid_file() < 0) {
@@ -307,6 +1881,22 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
     
+    /* Serve connections from an epoll set */
+    if (create_reactor() < 0 || create_metrics_socket() < 0) {
+        cleanup();
+        return EXIT_FAILURE;
+    }
+    
+    /* Keep the audio path resident before it starts */
+    lock_memory();
+    
+    /* Start mixing client streams into the device */
+    if (start_mixer() < 0) {
+        cleanup();
+        return EXIT_FAILURE;
+    }
+    demote_control_thread();
+    
     syslog(LOG_INFO, "I2S daemon ready");
     
     /* Main event loop */
@@ -1,7 +1,8 @@
 /*
  * i2s_driver.c - I2S Character Device Driver
  * 
- * This driver creates /dev/i2s0 device node for I2S communication
+ * This driver creates one /dev/i2sN device node per I2S controller
+ * described in the device tree
  */
 
 #include <linux/module.h>
@@ -13,9 +14,81 @@
 #include <linux/ioctl.h>
 #include <linux/slab.h>
 #include <linux/mutex.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/dmaengine.h>
+#include <linux/dma-mapping.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/platform_device.h>
+#include <linux/of.h>
+#include <linux/idr.h>
+#include <linux/property.h>
+#include <linux/seqlock.h>
+#include <linux/timekeeping.h>
+#include <linux/math64.h>
+#include <linux/bitops.h>
+#include <linux/sizes.h>
+#include <linux/uio.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/hrtimer.h>
+#include <linux/spinlock.h>
+
+#define CREATE_TRACE_POINTS
+#include "i2s_trace.h"
 
 #define DEVICE_NAME "i2s"
 #define CLASS_NAME "i2s_class"
+#define I2S_MAX_DEVICES 16
+
+/*
+ * Ring geometry. The ring is period_size * period_count bytes; both must be
+ * powers of two so the free-running indices can be masked.
+ */
+static unsigned int period_size = 4096;
+module_param(period_size, uint, 0444);
+MODULE_PARM_DESC(period_size, "Period size in bytes (power of two)");
+
+static unsigned int period_count = 4;
+module_param(period_count, uint, 0444);
+MODULE_PARM_DESC(period_count, "Number of periods per ring (power of two)");
+
+/* Smallest period the DMA is asked to interrupt on */
+#define I2S_MIN_PERIOD_BYTES 64
+
+/*
+ * Every stream preallocates its sample memory once at probe time (DMA
+ * coherent, so CMA-backed where the platform has it); configuring a
+ * stream only picks a part of it and the streaming path never allocates.
+ */
+static unsigned int pool_size = SZ_256K;
+module_param(pool_size, uint, 0444);
+MODULE_PARM_DESC(pool_size, "Preallocated buffer bytes per stream");
+
+/* What the hardware side does when the application misses a period */
+static unsigned int xrun_policy = 1;
+module_param(xrun_policy, uint, 0444);
+MODULE_PARM_DESC(xrun_policy, "Default xrun policy (0 = stop, 1 = silence, 2 = repeat last period)");
+
+static unsigned int dma_maxburst = 4;
+module_param(dma_maxburst, uint, 0444);
+MODULE_PARM_DESC(dma_maxburst, "DMA burst length in FIFO words");
+
+/*
+ * Virtual backends replace the DMA of every controller with a timer that
+ * moves one period at a time at exactly the configured rate, so the ring,
+ * the wakeups and everything above them can be tested without hardware.
+ * Selecting one also registers a controller of its own.
+ */
+#define I2S_BACKEND_DMA 0
+#define I2S_BACKEND_NULL 1      /* playback is discarded, capture is silence */
+#define I2S_BACKEND_LOOPBACK 2  /* playback comes back as capture */
+
+static unsigned int backend = I2S_BACKEND_DMA;
+module_param(backend, uint, 0444);
+MODULE_PARM_DESC(backend, "Backend (0 = DMA, 1 = timer-driven null, 2 = timer-driven loopback)");
 
 /* IOCTL commands */
 #define I2S_IOC_MAGIC 'i'
@@ -26,172 +99,1684 @@
 #define I2S_START _IO(I2S_IOC_MAGIC, 5)
 #define I2S_STOP _IO(I2S_IOC_MAGIC, 6)
 #define I2S_GET_STATUS _IOR(I2S_IOC_MAGIC, 7, int)
+#define I2S_GET_BUFFER_SIZE _IOR(I2S_IOC_MAGIC, 8, int)
+#define I2S_SET_AVAIL_MIN _IOW(I2S_IOC_MAGIC, 9, int)
+#define I2S_GET_HW_PTR _IOWR(I2S_IOC_MAGIC, 10, struct i2s_hw_ptr)
+
+#define I2S_SET_PARAMS _IOW(I2S_IOC_MAGIC, 11, struct i2s_params)
+#define I2S_GET_PARAMS _IOR(I2S_IOC_MAGIC, 12, struct i2s_params)
+#define I2S_SET_XRUN_POLICY _IOW(I2S_IOC_MAGIC, 13, int)
+#define I2S_RECOVER _IO(I2S_IOC_MAGIC, 14)
+#define I2S_SET_START_THRESHOLD _IOW(I2S_IOC_MAGIC, 15, int)
+#define I2S_SET_TDM _IOW(I2S_IOC_MAGIC, 16, struct i2s_tdm)
+#define I2S_GET_TDM _IOR(I2S_IOC_MAGIC, 17, struct i2s_tdm)
+
+/*
+ * Hardware sample formats. Packed 24-bit samples are not a DMA format;
+ * libi2s converts them in user space.
+ */
+#define I2S_FORMAT_S16_LE 0
+#define I2S_FORMAT_S24_LE 1     /* 24 bits in a 32-bit container */
+#define I2S_FORMAT_S32_LE 2
+
+/*
+ * Xrun policies. Every policy reports the xrun (-EPIPE until I2S_RECOVER);
+ * they differ in what the hardware side does meanwhile. Silence and repeat
+ * only change what is played; a capture stream keeps running under both.
+ */
+#define I2S_XRUN_STOP 0         /* halt the DMA */
+#define I2S_XRUN_SILENCE 1      /* keep running, play silence */
+#define I2S_XRUN_REPEAT 2       /* keep running, repeat the last period */
+
+/* Complete stream configuration, applied as one unit */
+struct i2s_params {
+    __u32 rate;
+    __u32 format;
+    __u32 channels;
+    __u32 period_frames;
+    __u32 periods;
+    __u32 slot_mask;    /* TDM slots in use, 0 = the first channels slots */
+};
+
+/*
+ * Bus frame layout, shared by playback and capture. slots 0 is plain I2S
+ * with its two slots, 4 to 16 is TDM. A zero mask puts a stream in the
+ * first channels slots; a stream's mask is also its params' slot_mask.
+ */
+struct i2s_tdm {
+    __u32 slots;
+    __u32 slot_width;   /* bits per slot: 16, 24 or 32, 0 = the sample container */
+    __u32 tx_mask;
+    __u32 rx_mask;
+};
+
+#define I2S_TDM_MIN_SLOTS 4
+#define I2S_TDM_MAX_SLOTS 16
+
+/* Position snapshot taken at the last period interrupt */
+struct i2s_hw_ptr {
+    __u32 stream;       /* in: 0 = playback, 1 = capture */
+    __u32 fill_frames;  /* frames queued in the ring */
+    __u64 hw_frames;    /* frames moved by the hardware since start */
+    __u64 tstamp_ns;    /* CLOCK_MONOTONIC_RAW */
+    __u32 xruns;        /* xruns since the stream was probed */
+    __u32 reserved;
+};
+
+/* mmap offsets */
+#define I2S_MMAP_OFFSET_TX_DATA 0x00000000
+#define I2S_MMAP_OFFSET_RX_DATA 0x10000000
+#define I2S_MMAP_OFFSET_TX_STATUS 0x80000000
+#define I2S_MMAP_OFFSET_TX_CONTROL 0x81000000
+#define I2S_MMAP_OFFSET_RX_STATUS 0x82000000
+#define I2S_MMAP_OFFSET_RX_CONTROL 0x83000000
+
+/* Stream states, as seen in the status page */
+#define I2S_STATE_STOPPED 0
+#define I2S_STATE_RUNNING 1
+#define I2S_STATE_XRUN 2
+
+/*
+ * Status page, written by the driver and mapped read-only. generation
+ * moves on every configuration change, so a mapper can cache the
+ * parameters and only ask again once it has moved.
+ */
+struct i2s_mmap_status {
+    __u32 state;
+    __u32 hw_ptr;
+    __u32 xruns;
+    __u32 generation;
+};
+
+/* Control page, written by the application */
+struct i2s_mmap_control {
+    __u32 appl_ptr;
+    __u32 avail_min;
+};
+
+/* Per-stream statistics, exported through debugfs */
+#define I2S_JITTER_BUCKETS 6
+
+static const unsigned int i2s_jitter_limits_us[I2S_JITTER_BUCKETS - 1] = {
+    10, 50, 100, 500, 1000
+};
+
+struct i2s_stats {
+    /* Written by the syscall side under io_lock */
+    u64 bytes;
+    u64 max_lock_ns;
+    u64 max_copy_ns;
+    u64 total_copy_ns;
+    
+    /* Written by the interrupt side */
+    u64 periods;
+    u32 xruns;
+    u64 jitter[I2S_JITTER_BUCKETS];
+};
+
+/*
+ * Single-producer/single-consumer ring buffer.
+ *
+ * head is only advanced by the producer and tail only by the consumer, so
+ * the two sides never need a common lock. Both indices are free running and
+ * are masked with (size - 1) on access; the acquire/release pairs order the
+ * sample data accesses against the index updates.
+ *
+ * The indices live in the status/control pages so that an application can
+ * map them and move appl_ptr itself: for playback the application produces
+ * (head = appl_ptr) and the hardware consumes (tail = hw_ptr), for capture
+ * it is the other way round.
+ */
+struct i2s_ring {
+    char *data;
+    unsigned int size;
+    unsigned int period_size;
+    struct i2s_mmap_status *status;
+    struct i2s_mmap_control *control;
+    __u32 *head;
+    __u32 *tail;
+    int playback;
+    
+    /* Woken when avail_min bytes of space (playback) or data (capture)
+     * become available, and on start/stop */
+    wait_queue_head_t wait;
+    
+    /* Cyclic DMA transfer feeding or draining the ring, if any */
+    struct dma_chan *chan;
+    dma_addr_t addr;
+    
+    /* What stands in for the DMA with a virtual backend: period n of a
+     * run expires n periods' worth of frames after timer_start */
+    struct hrtimer timer;
+    ktime_t timer_start;
+    u64 timer_periods;
+    
+    /* I2S_XRUN_*; halted is set once the stop policy has killed the DMA
+     * and is only cleared again with the DMA synchronized */
+    int xrun_policy;
+    bool halted;
+    
+    /* Bytes queued by write() that start a stopped stream, 0 = only
+     * I2S_START does; while it is non-zero, any read() also starts a
+     * stopped capture stream (see i2s_ring_armed()) */
+    unsigned int start_threshold;
+    
+    /* Preallocated memory behind data; size never exceeds it */
+    unsigned int pool_size;
+    
+    /* Mappings of the sample buffer; its layout is fixed while mapped */
+    atomic_t mmap_count;
+    
+    /* Position at the last period interrupt, updated as one unit under
+     * tstamp_seq by the interrupt side only */
+    seqcount_t tstamp_seq;
+    u64 hw_bytes;
+    unsigned int hw_fill;
+    u64 tstamp_ns;
+    
+    /* Nominal period length, for the jitter statistics */
+    u64 period_ns;
+    
+    struct i2s_stats stats;
+};
+
+/*
+ * One direction of the controller. A stream is owned by at most one open
+ * file at a time and carries its own configuration, cursor and locks, so
+ * playback and capture never serialize against each other.
+ */
+struct i2s_stream {
+    struct i2s_dev *dev;
+    const char *name;
+    struct file *owner;
+    
+    /* Protects configuration and running state */
+    struct mutex lock;
+    
+    /* Serializes concurrent read()/write() calls on the owning file so the
+     * ring keeps one producer and one consumer; never taken by the
+     * hardware side */
+    struct mutex io_lock;
+    
+    /* I2S configuration */
+    int sample_rate;
+    int format;
+    int channels;
+    
+    struct i2s_ring ring;
+};
+
+/* I2S device state, one per controller */
+struct i2s_dev {
+    dev_t dev_num;
+    int id;
+    struct cdev cdev;
+    struct device *device;
+    struct dentry *debugfs;
+    
+    /* Protects stream ownership */
+    struct mutex lock;
+    
+    /* Orders the loopback backend's two timers around the capture period
+     * they share */
+    spinlock_t loop_lock;
+    
+    /* Bus frame layout, see struct i2s_tdm. Written with both stream
+     * locks held, so either one is enough to read it */
+    u32 slots;
+    u32 slot_width;
+    u32 tx_mask;
+    u32 rx_mask;
+    
+    struct i2s_stream playback;
+    struct i2s_stream capture;
+};
+
+/* Per-open-file context: the streams this opener claimed */
+struct i2s_file {
+    struct i2s_dev *dev;
+    struct i2s_stream *playback;
+    struct i2s_stream *capture;
+};
+
+/* Shared by all controllers; only touched at module load/unload */
+static struct class *i2s_class;
+static dev_t i2s_devt;
+static DEFINE_IDA(i2s_ida);
+static struct dentry *i2s_debugfs_root;
+static struct platform_device *i2s_virtual_pdev;
+
+/* Ring buffer helpers */
+static int i2s_ring_init(struct i2s_ring *ring, struct dma_chan *chan,
+                         int playback)
+{
+    unsigned int bytes = PAGE_ALIGN(max(pool_size, period_size * period_count));
+    
+    /*
+     * The sample memory must be reachable by the DMA controller when there
+     * is one; otherwise vmalloc_user memory is zeroed and can be remapped
+     * to user space.
+     */
+    if (chan)
+        ring->data = dma_alloc_coherent(chan->device->dev, bytes,
+                                        &ring->addr, GFP_KERNEL);
+    else
+        ring->data = vmalloc_user(bytes);
+    ring->status = vmalloc_user(PAGE_SIZE);
+    ring->control = vmalloc_user(PAGE_SIZE);
+    if (!ring->data || !ring->status || !ring->control)
+        goto err;
+    
+    ring->chan = chan;
+    ring->pool_size = bytes;
+    ring->playback = playback;
+    ring->xrun_policy = xrun_policy <= I2S_XRUN_REPEAT ? xrun_policy :
+                        I2S_XRUN_SILENCE;
+    atomic_set(&ring->mmap_count, 0);
+    init_waitqueue_head(&ring->wait);
+    seqcount_init(&ring->tstamp_seq);
+    if (playback) {
+        ring->head = &ring->control->appl_ptr;
+        ring->tail = &ring->status->hw_ptr;
+    } else {
+        ring->head = &ring->status->hw_ptr;
+        ring->tail = &ring->control->appl_ptr;
+    }
+    return 0;
+    
+err:
+    if (chan && ring->data)
+        dma_free_coherent(chan->device->dev, bytes, ring->data, ring->addr);
+    else
+        vfree(ring->data);
+    vfree(ring->status);
+    vfree(ring->control);
+    ring->data = NULL;
+    return -ENOMEM;
+}
+
+/*
+ * Lay out the ring over the preallocated memory. Only called while the
+ * stream is stopped and unmapped, so nothing else looks at the buffer.
+ */
+static int i2s_ring_set_buffer(struct i2s_ring *ring,
+                               unsigned int period_bytes,
+                               unsigned int periods)
+{
+    unsigned int size = period_bytes * periods;
+    
+    if (!is_power_of_2(period_bytes) || !is_power_of_2(periods) ||
+        period_bytes < I2S_MIN_PERIOD_BYTES)
+        return -EINVAL;
+    if (size > ring->pool_size)
+        return -ENOMEM;
+    
+    /* Start from silence rather than the previous configuration's data */
+    memset(ring->data, 0, size);
+    
+    ring->size = size;
+    ring->period_size = period_bytes;
+    ring->control->avail_min = period_bytes;
+    ring->status->hw_ptr = 0;
+    ring->control->appl_ptr = 0;
+    return 0;
+}
+
+static void i2s_ring_free(struct i2s_ring *ring)
+{
+    if (ring->chan)
+        dma_free_coherent(ring->chan->device->dev, ring->pool_size,
+                          ring->data, ring->addr);
+    else
+        vfree(ring->data);
+    vfree(ring->status);
+    vfree(ring->control);
+    ring->data = NULL;
+    ring->size = 0;
+}
+
+/*
+ * Bytes queued between tail and head. appl_ptr is user writable through
+ * the control page and the hardware may run past the application, so
+ * clamp rather than trust either index.
+ */
+static unsigned int i2s_ring_used(struct i2s_ring *ring, __u32 head, __u32 tail)
+{
+    s32 used = head - tail;
+    
+    if (used < 0)
+        return 0;
+    return min_t(u32, used, ring->size);
+}
+
+/* Bytes the application side can move right now */
+static unsigned int i2s_ring_avail(struct i2s_ring *ring)
+{
+    unsigned int used = i2s_ring_used(ring, smp_load_acquire(ring->head),
+                                      smp_load_acquire(ring->tail));
+    
+    return ring->playback ? ring->size - used : used;
+}
+
+/*
+ * Whether a waiter wanting up to want bytes should wake up: avail_min
+ * bytes are available, or everything it asked for is.
+ */
+static bool i2s_ring_ready(struct i2s_ring *ring, size_t want)
+{
+    unsigned int avail_min = READ_ONCE(ring->control->avail_min);
+    
+    avail_min = clamp_t(unsigned int, avail_min, 1, ring->size);
+    return i2s_ring_avail(ring) >= min_t(size_t, avail_min, want);
+}
+
+/*
+ * Producer side: copy as much of the iterator as fits into the ring. A
+ * fault part way publishes what was copied; only a fault before the
+ * first byte is an error.
+ */
+static ssize_t i2s_ring_from_iter(struct i2s_ring *ring, struct iov_iter *from)
+{
+    __u32 head = READ_ONCE(*ring->head);
+    __u32 tail = smp_load_acquire(ring->tail);
+    unsigned int off = head & (ring->size - 1);
+    unsigned int len, first;
+    size_t copied;
+    
+    len = min_t(size_t, iov_iter_count(from),
+                ring->size - i2s_ring_used(ring, head, tail));
+    first = min(len, ring->size - off);
+    
+    copied = copy_from_iter(ring->data + off, first, from);
+    if (copied == first)
+        copied += copy_from_iter(ring->data, len - first, from);
+    if (!copied && len)
+        return -EFAULT;
+    
+    /* Publish the data before moving head */
+    smp_store_release(ring->head, head + copied);
+    return copied;
+}
+
+/* Consumer side: copy as much of the ring as the iterator takes */
+static ssize_t i2s_ring_to_iter(struct i2s_ring *ring, struct iov_iter *to)
+{
+    __u32 tail = READ_ONCE(*ring->tail);
+    __u32 head = smp_load_acquire(ring->head);
+    unsigned int off = tail & (ring->size - 1);
+    unsigned int len, first;
+    size_t copied;
+    
+    len = min_t(size_t, iov_iter_count(to), i2s_ring_used(ring, head, tail));
+    first = min(len, ring->size - off);
+    
+    copied = copy_to_iter(ring->data + off, first, to);
+    if (copied == first)
+        copied += copy_to_iter(ring->data, len - first, to);
+    if (!copied && len)
+        return -EFAULT;
+    
+    /* Finish reading the data before releasing the space */
+    smp_store_release(ring->tail, tail + copied);
+    return copied;
+}
+
+/*
+ * Whether the hardware, now at hw_ptr, has run past the application:
+ * playback has played everything queued, or capture has filled the whole
+ * ring and is overwriting data nobody read.
+ */
+static bool i2s_ring_xrun(struct i2s_ring *ring, __u32 hw_ptr)
+{
+    s32 used = READ_ONCE(ring->control->appl_ptr) - hw_ptr;
+    
+    if (ring->playback)
+        return used <= 0;
+    return -used >= (s32)ring->size;
+}
+
+/*
+ * Enter (or stay in) the xrun state at hw_ptr and apply the policy. The
+ * DMA is working on the period at hw_ptr, so substitute the one after it.
+ */
+static void i2s_ring_handle_xrun(struct i2s_stream *stream, __u32 hw_ptr)
+{
+    struct i2s_ring *ring = &stream->ring;
+    unsigned int mask = ring->size - 1;
+    unsigned int next = (hw_ptr + ring->period_size) & mask;
+    unsigned int last = (hw_ptr - ring->period_size) & mask;
+    
+    if (READ_ONCE(ring->status->state) == I2S_STATE_RUNNING) {
+        WRITE_ONCE(ring->stats.xruns, ring->stats.xruns + 1);
+        WRITE_ONCE(ring->status->xruns, ring->stats.xruns);
+        smp_store_release(&ring->status->state, I2S_STATE_XRUN);
+        trace_i2s_xrun(stream->dev->id, stream->name, hw_ptr,
+                       READ_ONCE(ring->control->appl_ptr));
+        wake_up_interruptible(&ring->wait);
+    }
+    
+    switch (READ_ONCE(ring->xrun_policy)) {
+    case I2S_XRUN_STOP:
+        /* No sync from the callback; late completions see halted, and
+         * the virtual backend's timer does not rearm */
+        ring->halted = true;
+        if (ring->chan)
+            dmaengine_terminate_async(ring->chan);
+        break;
+    case I2S_XRUN_REPEAT:
+        if (ring->playback && next != last)
+            memcpy(ring->data + next, ring->data + last, ring->period_size);
+        break;
+    default:
+        if (ring->playback)
+            memset(ring->data + next, 0, ring->period_size);
+        break;
+    }
+}
+
+/*
+ * DMA completion callback, called once per period from the DMA driver's
+ * tasklet. The hardware index is only ever moved here.
+ */
+static void i2s_dma_period_done(void *arg)
+{
+    struct i2s_ring *ring = arg;
+    struct i2s_stream *stream = container_of(ring, struct i2s_stream, ring);
+    __u32 hw_ptr = READ_ONCE(ring->status->hw_ptr);
+    u64 now = ktime_get_raw_ns();
+    s64 jitter = (s64)(now - ring->tstamp_ns) - (s64)ring->period_ns;
+    u64 abs_us = div_u64(abs(jitter), NSEC_PER_USEC);
+    int bucket = 0;
+    
+    if (ring->halted)
+        return;
+    
+    smp_store_release(&ring->status->hw_ptr, hw_ptr + ring->period_size);
+    
+    write_seqcount_begin(&ring->tstamp_seq);
+    ring->hw_bytes += ring->period_size;
+    ring->hw_fill = i2s_ring_used(ring, smp_load_acquire(ring->head),
+                                  READ_ONCE(*ring->tail));
+    ring->tstamp_ns = now;
+    write_seqcount_end(&ring->tstamp_seq);
+    
+    while (bucket < I2S_JITTER_BUCKETS - 1 &&
+           abs_us >= i2s_jitter_limits_us[bucket])
+        bucket++;
+    WRITE_ONCE(ring->stats.jitter[bucket], ring->stats.jitter[bucket] + 1);
+    WRITE_ONCE(ring->stats.periods, ring->stats.periods + 1);
+    trace_i2s_period(stream->dev->id, stream->name, hw_ptr + ring->period_size,
+                     ring->hw_fill, jitter);
+    
+    if (i2s_ring_xrun(ring, hw_ptr + ring->period_size))
+        i2s_ring_handle_xrun(stream, hw_ptr + ring->period_size);
+    
+    if (i2s_ring_ready(ring, ring->size))
+        wake_up_interruptible(&ring->wait);
+}
+
+/* A ring the virtual backend's timer moves instead of a DMA channel */
+static bool i2s_ring_virtual(struct i2s_ring *ring)
+{
+    return !ring->chan && backend != I2S_BACKEND_DMA;
+}
+
+/* The first period of a virtual run; see i2s_timer_period() */
+static void i2s_timer_start(struct i2s_ring *ring)
+{
+    if (!ring->playback)
+        memset(ring->data, 0, ring->period_size);
+    
+    ring->timer_start = ktime_get();
+    ring->timer_periods = 1;
+    hrtimer_start(&ring->timer, ktime_add_ns(ring->timer_start, ring->period_ns),
+                  HRTIMER_MODE_ABS_SOFT);
+}
+
+/*
+ * Request and configure the controller's "tx" or "rx" DMA channel from the
+ * device tree. A controller without DMA still probes; only deferral is
+ * passed up.
+ */
+static struct dma_chan *i2s_dma_request(struct device *dev, const char *name,
+                                        enum dma_transfer_direction dir,
+                                        dma_addr_t fifo_addr)
+{
+    struct dma_slave_config cfg = { };
+    struct dma_chan *chan;
+    int ret;
+    
+    chan = dma_request_chan(dev, name);
+    if (IS_ERR(chan)) {
+        if (PTR_ERR(chan) == -EPROBE_DEFER)
+            return chan;
+        dev_info(dev, "No %s DMA channel\n", name);
+        return NULL;
+    }
+    
+    cfg.direction = dir;
+    if (dir == DMA_MEM_TO_DEV) {
+        cfg.dst_addr = fifo_addr;
+        cfg.dst_addr_width = DMA_SLAVE_BUSWIDTH_4_BYTES;
+        cfg.dst_maxburst = dma_maxburst;
+    } else {
+        cfg.src_addr = fifo_addr;
+        cfg.src_addr_width = DMA_SLAVE_BUSWIDTH_4_BYTES;
+        cfg.src_maxburst = dma_maxburst;
+    }
+    
+    ret = dmaengine_slave_config(chan, &cfg);
+    if (ret < 0) {
+        dev_warn(dev, "%s DMA slave config failed (%d)\n", name, ret);
+        dma_release_channel(chan);
+        return NULL;
+    }
+    
+    return chan;
+}
+
+/* Start the cyclic transfer over the whole ring, one interrupt per period */
+static int i2s_dma_start(struct i2s_ring *ring)
+{
+    enum dma_transfer_direction dir =
+        ring->playback ? DMA_MEM_TO_DEV : DMA_DEV_TO_MEM;
+    struct dma_async_tx_descriptor *desc;
+    dma_cookie_t cookie;
+    
+    if (i2s_ring_virtual(ring)) {
+        i2s_timer_start(ring);
+        return 0;
+    }
+    if (!ring->chan)
+        return 0;
+    
+    desc = dmaengine_prep_dma_cyclic(ring->chan, ring->addr, ring->size,
+                                     ring->period_size, dir,
+                                     DMA_PREP_INTERRUPT);
+    if (!desc)
+        return -ENOMEM;
+    
+    desc->callback = i2s_dma_period_done;
+    desc->callback_param = ring;
+    
+    cookie = dmaengine_submit(desc);
+    if (dma_submit_error(cookie))
+        return -EIO;
+    
+    dma_async_issue_pending(ring->chan);
+    return 0;
+}
+
+static void i2s_dma_stop(struct i2s_ring *ring)
+{
+    if (ring->chan)
+        dmaengine_terminate_sync(ring->chan);
+    else if (i2s_ring_virtual(ring))
+        hrtimer_cancel(&ring->timer);
+}
+
+/* Sample container size and significant bits of a hardware format */
+static unsigned int i2s_format_bytes(int format)
+{
+    return format == I2S_FORMAT_S16_LE ? 2 : 4;
+}
+
+static int i2s_format_bits(int format)
+{
+    switch (format) {
+    case I2S_FORMAT_S16_LE:
+        return 16;
+    case I2S_FORMAT_S24_LE:
+        return 24;
+    default:
+        return 32;
+    }
+}
+
+/* Bytes per frame for the stream's current format */
+static unsigned int i2s_stream_frame_bytes(struct i2s_stream *stream)
+{
+    return i2s_format_bytes(stream->format) * stream->channels;
+}
+
+/*
+ * Loopback, from the playback timer: copy the period playback is about to
+ * consume into the one capture is filling. Both still belong to the
+ * hardware side, and loop_lock keeps capture from completing it meanwhile.
+ * Capture only takes the data in the same format and period size.
+ */
+static void i2s_loopback_period(struct i2s_dev *dev)
+{
+    struct i2s_ring *tx = &dev->playback.ring;
+    struct i2s_ring *rx = &dev->capture.ring;
+    unsigned int tx_off, rx_off;
+    
+    if (READ_ONCE(rx->status->state) == I2S_STATE_STOPPED ||
+        tx->period_size != rx->period_size ||
+        dev->playback.format != dev->capture.format ||
+        dev->playback.channels != dev->capture.channels)
+        return;
+    
+    tx_off = READ_ONCE(tx->status->hw_ptr) & (tx->size - 1);
+    rx_off = READ_ONCE(rx->status->hw_ptr) & (rx->size - 1);
+    memcpy(rx->data + rx_off, tx->data + tx_off, rx->period_size);
+}
+
+/*
+ * Virtual backend period, in softirq context like a DMA completion. The
+ * next expiry is computed from the frame count rather than added up from
+ * a rounded period length, so the rate does not drift.
+ */
+static enum hrtimer_restart i2s_timer_period(struct hrtimer *timer)
+{
+    struct i2s_ring *ring = container_of(timer, struct i2s_ring, timer);
+    struct i2s_stream *stream = container_of(ring, struct i2s_stream, ring);
+    struct i2s_dev *dev = stream->dev;
+    unsigned int frames = ring->period_size / i2s_stream_frame_bytes(stream);
+    unsigned int next;
+    
+    spin_lock(&dev->loop_lock);
+    if (backend == I2S_BACKEND_LOOPBACK && ring->playback)
+        i2s_loopback_period(dev);
+    i2s_dma_period_done(ring);
+    
+    /* Capture fills its next period with silence, or loopback data */
+    if (!ring->playback && !ring->halted) {
+        next = READ_ONCE(ring->status->hw_ptr) & (ring->size - 1);
+        memset(ring->data + next, 0, ring->period_size);
+    }
+    spin_unlock(&dev->loop_lock);
+    
+    if (ring->halted)
+        return HRTIMER_NORESTART;
+    
+    ring->timer_periods++;
+    hrtimer_set_expires(timer, ktime_add_ns(ring->timer_start,
+                        mul_u64_u32_div(ring->timer_periods * frames,
+                                        NSEC_PER_SEC, stream->sample_rate)));
+    return HRTIMER_RESTART;
+}
+
+/* Slots in a bus frame: plain I2S carries two */
+static unsigned int i2s_dev_slots(struct i2s_dev *dev)
+{
+    return dev->slots ? dev->slots : 2;
+}
+
+/* The stream's slots, kept in the device next to the frame layout */
+static u32 *i2s_stream_slot_mask(struct i2s_stream *stream)
+{
+    return stream->ring.playback ? &stream->dev->tx_mask :
+                                   &stream->dev->rx_mask;
+}
+
+/* A layout the bus can run at all, before looking at the streams */
+static bool i2s_tdm_valid(u32 slots, u32 slot_width)
+{
+    if (slots && (slots < I2S_TDM_MIN_SLOTS || slots > I2S_TDM_MAX_SLOTS))
+        return false;
+    return !slot_width || slot_width == 16 || slot_width == 24 ||
+           slot_width == 32;
+}
+
+/*
+ * Check that a stream configuration fits the slots of a frame layout.
+ * The ring sizes must be powers of two (see i2s_params_check()), so a
+ * stream carries 1, 2, 4, 8 or 16 channels and a 6- or 12-slot frame
+ * runs a power-of-two subset of its slots.
+ */
+static int i2s_tdm_check(unsigned int slots, u32 slot_width, int format,
+                         unsigned int channels, u32 mask)
+{
+    if (channels > slots || !is_power_of_2(channels))
+        return -EINVAL;
+    if (mask && (hweight32(mask) != channels || (mask & ~GENMASK(slots - 1, 0))))
+        return -EINVAL;
+    if (slot_width && i2s_format_bits(format) > slot_width)
+        return -EINVAL;
+    return 0;
+}
+
+/* Stream state helpers, called with stream->lock held */
+static int i2s_stream_running(struct i2s_stream *stream)
+{
+    return READ_ONCE(stream->ring.status->state);
+}
+
+/* Invalidate what mappers of the status page cached about the configuration */
+static void i2s_stream_changed(struct i2s_stream *stream)
+{
+    struct i2s_mmap_status *status = stream->ring.status;
+    
+    smp_store_release(&status->generation, status->generation + 1);
+}
+
+/* Why the application side cannot make progress, if it cannot */
+static int i2s_ring_error(struct i2s_ring *ring)
+{
+    switch (smp_load_acquire(&ring->status->state)) {
+    case I2S_STATE_RUNNING:
+        return 0;
+    case I2S_STATE_XRUN:
+        return -EPIPE;
+    default:
+        return -EINVAL;
+    }
+}
+
+static int i2s_stream_start(struct i2s_stream *stream)
+{
+    int ret;
+    
+    if (i2s_stream_running(stream))
+        return 0;
+    
+    stream->ring.halted = false;
+    /* Positions count from this start; the interrupt side is idle */
+    stream->ring.hw_bytes = 0;
+    stream->ring.hw_fill = 0;
+    stream->ring.tstamp_ns = ktime_get_raw_ns();
+    stream->ring.period_ns =
+        div_u64((u64)(stream->ring.period_size / i2s_stream_frame_bytes(stream)) *
+                NSEC_PER_SEC, stream->sample_rate);
+    
+    ret = i2s_dma_start(&stream->ring);
+    if (ret < 0)
+        return ret;
+    
+    WRITE_ONCE(stream->ring.status->state, I2S_STATE_RUNNING);
+    wake_up_interruptible(&stream->ring.wait);
+    dev_dbg(stream->dev->device, "%s started\n", stream->name);
+    return 0;
+}
+
+/*
+ * Stop the hardware and empty the ring, called with io_lock and then
+ * stream->lock held, as the pointers would otherwise be reset under a
+ * reader or writer. Teardown calls it with no users left.
+ */
+static void i2s_stream_stop(struct i2s_stream *stream)
+{
+    if (!i2s_stream_running(stream))
+        return;
+    
+    i2s_dma_stop(&stream->ring);
+    
+    /* The loopback backend only writes into capture while it runs */
+    spin_lock_bh(&stream->dev->loop_lock);
+    WRITE_ONCE(stream->ring.status->state, I2S_STATE_STOPPED);
+    spin_unlock_bh(&stream->dev->loop_lock);
+    
+    /* The DMA always restarts at the start of the ring; drop what is queued */
+    stream->ring.status->hw_ptr = 0;
+    stream->ring.control->appl_ptr = 0;
+    wake_up_interruptible(&stream->ring.wait);
+    dev_dbg(stream->dev->device, "%s stopped\n", stream->name);
+}
+
+/*
+ * Leave the xrun state, called with io_lock and then stream->lock held,
+ * so the application side is ours while appl_ptr moves. The ring is
+ * resynchronized to the hardware rather than resumed, so the latency
+ * built up before the xrun is dropped: playback restarts one period
+ * (the one in flight) ahead of the hardware, capture restarts empty.
+ */
+static int i2s_stream_recover(struct i2s_stream *stream)
+{
+    struct i2s_ring *ring = &stream->ring;
+    __u32 hw_ptr;
+    int ret;
+    
+    /* Nothing to do for a stream that is running or stopped */
+    if (i2s_ring_error(ring) != -EPIPE)
+        return 0;
+    
+    if (ring->halted) {
+        /* The DMA restarts at the start of the ring, from silence */
+        i2s_dma_stop(ring);
+        ring->halted = false;
+        memset(ring->data, 0, ring->size);
+        ring->status->hw_ptr = 0;
+        write_seqcount_begin(&ring->tstamp_seq);
+        ring->tstamp_ns = ktime_get_raw_ns();
+        write_seqcount_end(&ring->tstamp_seq);
+        
+        ret = i2s_dma_start(ring);
+        if (ret < 0) {
+            WRITE_ONCE(ring->status->state, I2S_STATE_STOPPED);
+            wake_up_interruptible(&ring->wait);
+            return ret;
+        }
+    }
+    
+    hw_ptr = smp_load_acquire(&ring->status->hw_ptr);
+    smp_store_release(&ring->control->appl_ptr,
+                      ring->playback ? hw_ptr + ring->period_size : hw_ptr);
+    smp_store_release(&ring->status->state, I2S_STATE_RUNNING);
+    
+    wake_up_interruptible(&ring->wait);
+    dev_dbg(stream->dev->device, "%s recovered from xrun\n", stream->name);
+    return 0;
+}
+
+/* A stopped stream with a start threshold is started by read()/write() */
+static bool i2s_ring_armed(struct i2s_ring *ring)
+{
+    return READ_ONCE(ring->status->state) == I2S_STATE_STOPPED &&
+           READ_ONCE(ring->start_threshold);
+}
+
+/* Start from the I/O path, which holds io_lock (taken before stream->lock) */
+static int i2s_stream_autostart(struct i2s_stream *stream)
+{
+    int ret;
+    
+    mutex_lock(&stream->lock);
+    ret = i2s_stream_start(stream);
+    mutex_unlock(&stream->lock);
+    return ret;
+}
+
+/* File operations */
+static int i2s_open(struct inode *inode, struct file *filp)
+{
+    struct i2s_dev *dev = container_of(inode->i_cdev, struct i2s_dev, cdev);
+    int playback = !!(filp->f_mode & FMODE_WRITE);
+    int capture = !!(filp->f_mode & FMODE_READ);
+    struct i2s_file *file;
+    
+    /* An O_ACCMODE == 3 open would own no stream for the ioctls to use */
+    if (!playback && !capture)
+        return -EINVAL;
+    
+    file = kzalloc(sizeof(*file), GFP_KERNEL);
+    if (!file)
+        return -ENOMEM;
+    
+    /* Writers claim playback, readers claim capture, O_RDWR claims both */
+    mutex_lock(&dev->lock);
+    if ((playback && dev->playback.owner) || (capture && dev->capture.owner)) {
+        mutex_unlock(&dev->lock);
+        kfree(file);
+        return -EBUSY;
+    }
+    if (playback) {
+        dev->playback.owner = filp;
+        file->playback = &dev->playback;
+    }
+    if (capture) {
+        dev->capture.owner = filp;
+        file->capture = &dev->capture;
+    }
+    mutex_unlock(&dev->lock);
+    
+    /* A new owner starts from an empty ring */
+    if (file->playback) {
+        dev->playback.ring.status->hw_ptr = 0;
+        dev->playback.ring.control->appl_ptr = 0;
+    }
+    if (file->capture) {
+        dev->capture.ring.status->hw_ptr = 0;
+        dev->capture.ring.control->appl_ptr = 0;
+    }
+    
+    file->dev = dev;
+    filp->private_data = file;
+    
+    /* read_iter/write_iter honour IOCB_NOWAIT, so io_uring can try them
+     * inline and fall back to poll instead of a blocking worker */
+    filp->f_mode |= FMODE_NOWAIT;
+    dev_info(dev->device, "Device opened (%s%s%s)\n",
+            playback ? "playback" : "", playback && capture ? "+" : "",
+            capture ? "capture" : "");
+    return 0;
+}
+
+static int i2s_release(struct inode *inode, struct file *filp)
+{
+    struct i2s_file *file = filp->private_data;
+    struct i2s_dev *dev = file->dev;
+    
+    if (file->playback) {
+        mutex_lock(&file->playback->io_lock);
+        mutex_lock(&file->playback->lock);
+        i2s_stream_stop(file->playback);
+        mutex_unlock(&file->playback->lock);
+        mutex_unlock(&file->playback->io_lock);
+    }
+    if (file->capture) {
+        mutex_lock(&file->capture->io_lock);
+        mutex_lock(&file->capture->lock);
+        i2s_stream_stop(file->capture);
+        mutex_unlock(&file->capture->lock);
+        mutex_unlock(&file->capture->io_lock);
+    }
+    
+    mutex_lock(&dev->lock);
+    if (file->playback)
+        file->playback->owner = NULL;
+    if (file->capture)
+        file->capture->owner = NULL;
+    mutex_unlock(&dev->lock);
+    
+    kfree(file);
+    dev_info(dev->device, "Device closed\n");
+    return 0;
+}
+
+/*
+ * Wait until the ring can make progress, the stream stops or xruns, or a
+ * signal arrives. Called with the stream's io_lock held, which only excludes
+ * other readers/writers, never the hardware side.
+ */
+static int i2s_ring_wait(struct kiocb *iocb, struct i2s_ring *ring, size_t want)
+{
+    int ret;
+    
+    if ((iocb->ki_filp->f_flags & O_NONBLOCK) ||
+        (iocb->ki_flags & IOCB_NOWAIT))
+        return -EAGAIN;
+    
+    ret = wait_event_interruptible(ring->wait,
+                                   i2s_ring_ready(ring, want) ||
+                                   i2s_ring_error(ring));
+    if (ret)
+        return ret;
+    
+    return i2s_ring_error(ring);
+}
+
+/* Account one read()/write() call; only the io_lock holder writes these */
+static void i2s_stats_io(struct i2s_stats *stats, size_t bytes,
+                         u64 copy_ns, u64 lock_ns)
+{
+    WRITE_ONCE(stats->bytes, stats->bytes + bytes);
+    WRITE_ONCE(stats->total_copy_ns, stats->total_copy_ns + copy_ns);
+    if (copy_ns > stats->max_copy_ns)
+        WRITE_ONCE(stats->max_copy_ns, copy_ns);
+    if (lock_ns > stats->max_lock_ns)
+        WRITE_ONCE(stats->max_lock_ns, lock_ns);
+}
+
+/*
+ * read()/readv() and write()/writev(). The ring is filled or drained
+ * straight from the caller's segments, so a vectored call costs one
+ * syscall and one copy however many buffers it carries.
+ */
+static ssize_t i2s_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct i2s_file *file = iocb->ki_filp->private_data;
+    struct i2s_stream *stream = file->capture;
+    struct i2s_ring *ring = &stream->ring;
+    size_t count = iov_iter_count(to);
+    size_t done = 0;
+    ssize_t ret = 0;
+    u64 locked, t0, copy_ns = 0;
+    
+    ret = i2s_ring_error(ring);
+    if (ret == -EINVAL && i2s_ring_armed(ring))
+        ret = 0;
+    if (ret < 0) {
+        trace_i2s_read(stream->dev->id, stream->name, count, ret);
+        return ret;
+    }
+    
+    if (mutex_lock_interruptible(&stream->io_lock))
+        return -ERESTARTSYS;
+    locked = ktime_get_ns();
+    
+    if (i2s_ring_armed(ring))
+        ret = i2s_stream_autostart(stream);
+    
+    /* Drain the ring, sleeping until the hardware has captured more */
+    while (ret >= 0 && done < count) {
+        t0 = ktime_get_ns();
+        ret = i2s_ring_to_iter(ring, to);
+        copy_ns += ktime_get_ns() - t0;
+        if (ret < 0)
+            break;
+        done += ret;
+        if (done == count)
+            break;
+        
+        ret = i2s_ring_wait(iocb, ring, count - done);
+        if (ret < 0)
+            break;
+    }
+    
+    i2s_stats_io(&ring->stats, done, copy_ns, ktime_get_ns() - locked);
+    mutex_unlock(&stream->io_lock);
+    
+    ret = done ? done : ret;
+    trace_i2s_read(stream->dev->id, stream->name, count, ret);
+    return ret;
+}
 
-/* I2S device state */
-struct i2s_dev {
-    dev_t dev_num;
-    struct cdev cdev;
-    struct class *class;
-    struct device *device;
-    struct mutex lock;
+static ssize_t i2s_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct i2s_file *file = iocb->ki_filp->private_data;
+    struct i2s_stream *stream = file->playback;
+    struct i2s_ring *ring = &stream->ring;
+    size_t count = iov_iter_count(from);
+    size_t done = 0;
+    ssize_t ret = 0;
+    u64 locked, t0, copy_ns = 0;
     
-    /* I2S configuration */
-    int sample_rate;
-    int bit_depth;
-    int is_running;
+    ret = i2s_ring_error(ring);
+    if (ret == -EINVAL && i2s_ring_armed(ring))
+        ret = 0;
+    if (ret < 0) {
+        trace_i2s_write(stream->dev->id, stream->name, count, ret);
+        return ret;
+    }
     
-    /* Buffer for audio data */
-    char *buffer;
-    size_t buffer_size;
-};
+    if (mutex_lock_interruptible(&stream->io_lock))
+        return -ERESTARTSYS;
+    locked = ktime_get_ns();
+    
+    /* Fill the ring, sleeping until the hardware has drained enough */
+    while (done < count) {
+        t0 = ktime_get_ns();
+        ret = i2s_ring_from_iter(ring, from);
+        copy_ns += ktime_get_ns() - t0;
+        if (ret < 0)
+            break;
+        done += ret;
+        
+        /* Start once enough is queued that the hardware won't starve */
+        if (i2s_ring_armed(ring) &&
+            i2s_ring_used(ring, READ_ONCE(*ring->head), READ_ONCE(*ring->tail)) >=
+            min(READ_ONCE(ring->start_threshold), ring->size)) {
+            ret = i2s_stream_autostart(stream);
+            if (ret < 0)
+                break;
+        }
+        if (done == count)
+            break;
+        
+        ret = i2s_ring_wait(iocb, ring, count - done);
+        if (ret < 0)
+            break;
+    }
+    
+    i2s_stats_io(&ring->stats, done, copy_ns, ktime_get_ns() - locked);
+    mutex_unlock(&stream->io_lock);
+    
+    ret = done ? done : ret;
+    trace_i2s_write(stream->dev->id, stream->name, count, ret);
+    return ret;
+}
 
-static struct i2s_dev *i2s_device;
+static __poll_t i2s_poll(struct file *filp, poll_table *wait)
+{
+    struct i2s_file *file = filp->private_data;
+    __poll_t mask = 0;
+    
+    if (file->playback) {
+        poll_wait(filp, &file->playback->ring.wait, wait);
+        /* Like ALSA, a stopped or xrun stream is an error for pollers */
+        if (i2s_ring_error(&file->playback->ring) &&
+            !i2s_ring_armed(&file->playback->ring))
+            mask |= EPOLLERR;
+        else if (i2s_ring_ready(&file->playback->ring, file->playback->ring.size))
+            mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+    
+    if (file->capture) {
+        poll_wait(filp, &file->capture->ring.wait, wait);
+        if (i2s_ring_error(&file->capture->ring) &&
+            !i2s_ring_armed(&file->capture->ring))
+            mask |= EPOLLERR;
+        else if (i2s_ring_ready(&file->capture->ring, file->capture->ring.size))
+            mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    
+    return mask;
+}
 
-/* File operations */
-static int i2s_open(struct inode *inode, struct file *filp)
+/*
+ * Check a configuration against a stream. The ring indices are masked,
+ * so the period and buffer sizes in bytes must come out as powers of two.
+ */
+static int i2s_params_check(struct i2s_stream *stream,
+                            const struct i2s_params *params)
 {
-    filp->private_data = i2s_device;
-    pr_info("I2S: Device opened\n");
+    unsigned int frame_bytes, period_bytes;
+    u64 buffer_bytes;
+    
+    if (params->rate < 8000 || params->rate > 768000)
+        return -EINVAL;
+    if (params->format > I2S_FORMAT_S32_LE)
+        return -EINVAL;
+    if (params->channels < 1 || params->channels > I2S_TDM_MAX_SLOTS)
+        return -EINVAL;
+    if (i2s_tdm_check(i2s_dev_slots(stream->dev), stream->dev->slot_width,
+                      params->format, params->channels, params->slot_mask))
+        return -EINVAL;
+    
+    frame_bytes = i2s_format_bytes(params->format) * params->channels;
+    if (!params->period_frames || params->period_frames > SZ_1M ||
+        !params->periods || params->periods > 1024)
+        return -EINVAL;
+    
+    period_bytes = params->period_frames * frame_bytes;
+    buffer_bytes = (u64)period_bytes * params->periods;
+    if (!is_power_of_2(period_bytes) || !is_power_of_2(params->periods) ||
+        period_bytes < I2S_MIN_PERIOD_BYTES)
+        return -EINVAL;
+    
+    /* Must fit the preallocated memory; see the pool_size parameter */
+    if (buffer_bytes > stream->ring.pool_size)
+        return -ENOMEM;
+    
+    /* Reconfiguring a live stream is exactly the glitch this avoids */
+    if (i2s_stream_running(stream))
+        return -EBUSY;
+    
     return 0;
 }
 
-static int i2s_release(struct inode *inode, struct file *filp)
+/* Apply a checked configuration, called with stream->lock held */
+static int i2s_params_apply(struct i2s_stream *stream,
+                            const struct i2s_params *params)
 {
-    pr_info("I2S: Device closed\n");
+    unsigned int period_bytes = params->period_frames *
+        i2s_format_bytes(params->format) * params->channels;
+    int ret;
+    
+    if (period_bytes != stream->ring.period_size ||
+        period_bytes * params->periods != stream->ring.size) {
+        if (atomic_read(&stream->ring.mmap_count))
+            return -EBUSY;
+        ret = i2s_ring_set_buffer(&stream->ring, period_bytes,
+                                  params->periods);
+        if (ret < 0)
+            return ret;
+    }
+    
+    stream->sample_rate = params->rate;
+    stream->format = params->format;
+    stream->channels = params->channels;
+    *i2s_stream_slot_mask(stream) = params->slot_mask;
+    i2s_stream_changed(stream);
+    
+    dev_dbg(stream->dev->device, "%s: %u Hz, %d bits, %u ch, %u x %u frames\n",
+            stream->name, params->rate, i2s_format_bits(params->format),
+            params->channels, params->period_frames, params->periods);
     return 0;
 }
 
-static ssize_t i2s_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+static void i2s_params_get(struct i2s_stream *stream, struct i2s_params *params)
 {
-    struct i2s_dev *dev = filp->private_data;
-    ssize_t ret = 0;
+    unsigned int frame_bytes = i2s_stream_frame_bytes(stream);
     
-    if (mutex_lock_interruptible(&dev->lock))
-        return -ERESTARTSYS;
+    params->rate = stream->sample_rate;
+    params->format = stream->format;
+    params->channels = stream->channels;
+    params->period_frames = stream->ring.period_size / frame_bytes;
+    params->periods = stream->ring.size / stream->ring.period_size;
+    params->slot_mask = *i2s_stream_slot_mask(stream);
+}
+
+/*
+ * Set the whole configuration of every stream the file owns at once:
+ * all streams are locked and checked before any of them changes.
+ */
+static int i2s_ioctl_set_params(struct i2s_file *file,
+                                struct i2s_params __user *arg)
+{
+    struct i2s_params params;
+    struct i2s_stream *streams[2];
+    int n = 0, i, ret = 0;
     
-    if (!dev->is_running) {
-        pr_warn("I2S: Device not running\n");
-        ret = -EINVAL;
-        goto out;
-    }
+    if (copy_from_user(&params, arg, sizeof(params)))
+        return -EFAULT;
     
-    /* Simulate reading audio data */
-    if (count > dev->buffer_size)
-        count = dev->buffer_size;
+    if (file->playback)
+        streams[n++] = file->playback;
+    if (file->capture)
+        streams[n++] = file->capture;
     
-    if (copy_to_user(buf, dev->buffer, count)) {
-        ret = -EFAULT;
-        goto out;
+    /* Always playback before capture, so the lock order is fixed */
+    for (i = 0; i < n; i++) {
+        if (mutex_lock_interruptible(&streams[i]->lock)) {
+            ret = -ERESTARTSYS;
+            break;
+        }
     }
+    n = i;
     
-    ret = count;
-    pr_debug("I2S: Read %zu bytes\n", count);
+    for (i = 0; i < n && !ret; i++)
+        ret = i2s_params_check(streams[i], &params);
+    for (i = 0; i < n && !ret; i++)
+        ret = i2s_params_apply(streams[i], &params);
+    
+    while (n-- > 0)
+        mutex_unlock(&streams[n]->lock);
     
-out:
-    mutex_unlock(&dev->lock);
     return ret;
 }
 
-static ssize_t i2s_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+static int i2s_ioctl_get_params(struct i2s_file *file,
+                                struct i2s_params __user *arg)
 {
-    struct i2s_dev *dev = filp->private_data;
-    ssize_t ret = 0;
+    struct i2s_stream *stream = file->playback ? file->playback : file->capture;
+    struct i2s_params params;
     
-    if (mutex_lock_interruptible(&dev->lock))
+    if (!stream)
+        return -EBADF;
+    
+    if (mutex_lock_interruptible(&stream->lock))
         return -ERESTARTSYS;
+    i2s_params_get(stream, &params);
+    mutex_unlock(&stream->lock);
     
-    if (!dev->is_running) {
-        pr_warn("I2S: Device not running\n");
-        ret = -EINVAL;
-        goto out;
-    }
+    if (copy_to_user(arg, &params, sizeof(params)))
+        return -EFAULT;
+    return 0;
+}
+
+/*
+ * Change the bus frame layout. It is shared by both directions, so both
+ * streams are locked whoever owns them, neither may be running and both
+ * configurations must fit the new layout. Only the masks of the streams
+ * the file owns change.
+ */
+static int i2s_ioctl_set_tdm(struct i2s_file *file, struct i2s_tdm __user *arg)
+{
+    struct i2s_dev *dev = file->dev;
+    struct i2s_stream *streams[2] = { &dev->playback, &dev->capture };
+    struct i2s_tdm tdm;
+    unsigned int slots;
+    int i, ret = 0;
     
-    /* Ensure buffer is large enough */
-    if (count > dev->buffer_size) {
-        kfree(dev->buffer);
-        dev->buffer = kmalloc(count, GFP_KERNEL);
-        if (!dev->buffer) {
-            ret = -ENOMEM;
-            goto out;
-        }
-        dev->buffer_size = count;
+    if (copy_from_user(&tdm, arg, sizeof(tdm)))
+        return -EFAULT;
+    if (!i2s_tdm_valid(tdm.slots, tdm.slot_width))
+        return -EINVAL;
+    slots = tdm.slots ? tdm.slots : 2;
+    
+    /* Always playback before capture, so the lock order is fixed */
+    if (mutex_lock_interruptible(&dev->playback.lock))
+        return -ERESTARTSYS;
+    if (mutex_lock_interruptible(&dev->capture.lock)) {
+        mutex_unlock(&dev->playback.lock);
+        return -ERESTARTSYS;
     }
     
-    if (copy_from_user(dev->buffer, buf, count)) {
-        ret = -EFAULT;
-        goto out;
+    if (!file->playback)
+        tdm.tx_mask = dev->tx_mask;
+    if (!file->capture)
+        tdm.rx_mask = dev->rx_mask;
+    
+    for (i = 0; i < 2 && !ret; i++) {
+        if (i2s_stream_running(streams[i]))
+            ret = -EBUSY;
+        else
+            ret = i2s_tdm_check(slots, tdm.slot_width, streams[i]->format,
+                                streams[i]->channels,
+                                i ? tdm.rx_mask : tdm.tx_mask);
     }
     
-    /* Here you would write to actual I2S hardware */
-    ret = count;
-    pr_debug("I2S: Wrote %zu bytes\n", count);
+    if (!ret) {
+        dev->slots = tdm.slots;
+        dev->slot_width = tdm.slot_width;
+        dev->tx_mask = tdm.tx_mask;
+        dev->rx_mask = tdm.rx_mask;
+        for (i = 0; i < 2; i++)
+            i2s_stream_changed(streams[i]);
+        dev_dbg(dev->device, "%s, %u slots of %u bits, tx %#x rx %#x\n",
+                tdm.slots ? "TDM" : "I2S", slots, tdm.slot_width,
+                tdm.tx_mask, tdm.rx_mask);
+    }
     
-out:
-    mutex_unlock(&dev->lock);
+    mutex_unlock(&dev->capture.lock);
+    mutex_unlock(&dev->playback.lock);
     return ret;
 }
 
-static long i2s_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+static int i2s_ioctl_get_tdm(struct i2s_file *file, struct i2s_tdm __user *arg)
 {
-    struct i2s_dev *dev = filp->private_data;
-    int ret = 0;
-    int value;
+    struct i2s_dev *dev = file->dev;
+    struct i2s_tdm tdm;
     
-    if (_IOC_TYPE(cmd) != I2S_IOC_MAGIC)
-        return -ENOTTY;
+    if (mutex_lock_interruptible(&dev->playback.lock))
+        return -ERESTARTSYS;
+    tdm.slots = dev->slots;
+    tdm.slot_width = dev->slot_width;
+    tdm.tx_mask = dev->tx_mask;
+    tdm.rx_mask = dev->rx_mask;
+    mutex_unlock(&dev->playback.lock);
+    
+    if (copy_to_user(arg, &tdm, sizeof(tdm)))
+        return -EFAULT;
+    return 0;
+}
+
+/* Report the position snapshot of the last period interrupt */
+static int i2s_ioctl_hw_ptr(struct i2s_file *file, struct i2s_hw_ptr __user *arg)
+{
+    struct i2s_hw_ptr pos;
+    struct i2s_stream *stream;
+    unsigned int frame_bytes, seq, fill;
+    u64 bytes, tstamp;
+    
+    if (copy_from_user(&pos, arg, sizeof(pos)))
+        return -EFAULT;
+    
+    stream = pos.stream ? file->capture : file->playback;
+    if (!stream)
+        return -EINVAL;
     
-    if (mutex_lock_interruptible(&dev->lock))
+    /* The format cannot change under us while we hold the lock */
+    if (mutex_lock_interruptible(&stream->lock))
         return -ERESTARTSYS;
+    frame_bytes = i2s_stream_frame_bytes(stream);
+    
+    do {
+        seq = read_seqcount_begin(&stream->ring.tstamp_seq);
+        bytes = stream->ring.hw_bytes;
+        fill = stream->ring.hw_fill;
+        tstamp = stream->ring.tstamp_ns;
+    } while (read_seqcount_retry(&stream->ring.tstamp_seq, seq));
+    
+    mutex_unlock(&stream->lock);
+    
+    pos.hw_frames = div_u64(bytes, frame_bytes);
+    pos.fill_frames = fill / frame_bytes;
+    pos.tstamp_ns = tstamp;
+    pos.xruns = READ_ONCE(stream->ring.stats.xruns);
+    
+    if (copy_to_user(arg, &pos, sizeof(pos)))
+        return -EFAULT;
+    return 0;
+}
+
+/* Recover every stream the file owns; see i2s_stream_recover() */
+static int i2s_ioctl_recover(struct i2s_file *file)
+{
+    struct i2s_stream *streams[2] = { file->playback, file->capture };
+    int i, ret = 0;
+    
+    for (i = 0; i < 2 && !ret; i++) {
+        if (!streams[i])
+            continue;
+        if (mutex_lock_interruptible(&streams[i]->io_lock))
+            return -ERESTARTSYS;
+        mutex_lock(&streams[i]->lock);
+        ret = i2s_stream_recover(streams[i]);
+        mutex_unlock(&streams[i]->lock);
+        mutex_unlock(&streams[i]->io_lock);
+    }
+    
+    return ret;
+}
+
+/* Apply one ioctl to a stream, called with stream->lock held (and io_lock
+ * before it for I2S_START and I2S_STOP) */
+static int i2s_stream_ioctl(struct i2s_stream *stream, unsigned int cmd, int *value)
+{
+    struct i2s_params params;
+    int ret;
     
     switch (cmd) {
     case I2S_SET_SAMPLE_RATE:
-        if (copy_from_user(&value, (int __user *)arg, sizeof(int))) {
-            ret = -EFAULT;
-            break;
-        }
-        dev->sample_rate = value;
-        pr_info("I2S: Sample rate set to %d Hz\n", value);
-        break;
+        i2s_params_get(stream, &params);
+        params.rate = *value;
+        ret = i2s_params_check(stream, &params);
+        if (ret < 0)
+            return ret;
+        stream->sample_rate = *value;
+        i2s_stream_changed(stream);
+        dev_dbg(stream->dev->device, "%s sample rate set to %d Hz\n",
+                 stream->name, *value);
+        return 0;
         
     case I2S_GET_SAMPLE_RATE:
-        if (copy_to_user((int __user *)arg, &dev->sample_rate, sizeof(int)))
-            ret = -EFAULT;
-        break;
+        *value = stream->sample_rate;
+        return 0;
         
     case I2S_SET_BIT_DEPTH:
-        if (copy_from_user(&value, (int __user *)arg, sizeof(int))) {
-            ret = -EFAULT;
-            break;
-        }
-        dev->bit_depth = value;
-        pr_info("I2S: Bit depth set to %d bits\n", value);
-        break;
+        /* Keep the period length in frames as the container size changes */
+        i2s_params_get(stream, &params);
+        if (*value == 16)
+            params.format = I2S_FORMAT_S16_LE;
+        else if (*value == 24)
+            params.format = I2S_FORMAT_S24_LE;
+        else if (*value == 32)
+            params.format = I2S_FORMAT_S32_LE;
+        else
+            return -EINVAL;
+        ret = i2s_params_check(stream, &params);
+        if (ret < 0)
+            return ret;
+        ret = i2s_params_apply(stream, &params);
+        if (ret < 0)
+            return ret;
+        dev_dbg(stream->dev->device, "%s bit depth set to %d bits\n",
+                 stream->name, *value);
+        return 0;
         
     case I2S_GET_BIT_DEPTH:
-        if (copy_to_user((int __user *)arg, &dev->bit_depth, sizeof(int)))
-            ret = -EFAULT;
-        break;
+        *value = i2s_format_bits(stream->format);
+        return 0;
         
     case I2S_START:
-        dev->is_running = 1;
-        pr_info("I2S: Started\n");
-        break;
+        return i2s_stream_start(stream);
         
     case I2S_STOP:
-        dev->is_running = 0;
-        pr_info("I2S: Stopped\n");
-        break;
+        i2s_stream_stop(stream);
+        return 0;
         
     case I2S_GET_STATUS:
-        if (copy_to_user((int __user *)arg, &dev->is_running, sizeof(int)))
+        *value = i2s_stream_running(stream);
+        return 0;
+        
+    case I2S_SET_AVAIL_MIN:
+        if (*value <= 0 || *value > stream->ring.size)
+            return -EINVAL;
+        WRITE_ONCE(stream->ring.control->avail_min, *value);
+        return 0;
+        
+    case I2S_GET_BUFFER_SIZE:
+        *value = stream->ring.size;
+        return 0;
+        
+    case I2S_SET_XRUN_POLICY:
+        if (*value < I2S_XRUN_STOP || *value > I2S_XRUN_REPEAT)
+            return -EINVAL;
+        /* Takes effect at the next period interrupt */
+        WRITE_ONCE(stream->ring.xrun_policy, *value);
+        return 0;
+        
+    case I2S_SET_START_THRESHOLD:
+        if (*value < 0)
+            return -EINVAL;
+        /* Capped to the ring size when used, so it survives a resize */
+        WRITE_ONCE(stream->ring.start_threshold, *value);
+        return 0;
+        
+    default:
+        return -ENOTTY;
+    }
+}
+
+/*
+ * Set and control commands apply to every stream the file owns; get
+ * commands report the first one (playback on a full-duplex opener).
+ */
+static long i2s_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct i2s_file *file = filp->private_data;
+    struct i2s_stream *streams[2];
+    int n = 0, i;
+    int ret = 0;
+    int value = 0;
+    bool io;
+    
+    if (_IOC_TYPE(cmd) != I2S_IOC_MAGIC)
+        return -ENOTTY;
+    
+    /* Commands with a structure argument pick their stream themselves */
+    if (cmd == I2S_GET_HW_PTR)
+        return i2s_ioctl_hw_ptr(file, (struct i2s_hw_ptr __user *)arg);
+    if (cmd == I2S_SET_PARAMS)
+        return i2s_ioctl_set_params(file, (struct i2s_params __user *)arg);
+    if (cmd == I2S_GET_PARAMS)
+        return i2s_ioctl_get_params(file, (struct i2s_params __user *)arg);
+    if (cmd == I2S_RECOVER)
+        return i2s_ioctl_recover(file);
+    if (cmd == I2S_SET_TDM)
+        return i2s_ioctl_set_tdm(file, (struct i2s_tdm __user *)arg);
+    if (cmd == I2S_GET_TDM)
+        return i2s_ioctl_get_tdm(file, (struct i2s_tdm __user *)arg);
+    
+    if (file->playback)
+        streams[n++] = file->playback;
+    if (file->capture)
+        streams[n++] = file->capture;
+    
+    if (_IOC_DIR(cmd) & _IOC_WRITE) {
+        if (copy_from_user(&value, (int __user *)arg, sizeof(int)))
+            return -EFAULT;
+    }
+    
+    /* A getter only needs to look at one stream */
+    if (_IOC_DIR(cmd) == _IOC_READ)
+        n = 1;
+    
+    /* Starting and stopping move the ring pointers, so readers and
+     * writers are kept out first, in the order i2s_ioctl_recover() uses */
+    io = cmd == I2S_START || cmd == I2S_STOP;
+    
+    for (i = 0; i < n; i++) {
+        if (io) {
+            if (mutex_lock_interruptible(&streams[i]->io_lock)) {
+                ret = -ERESTARTSYS;
+                break;
+            }
+            mutex_lock(&streams[i]->lock);
+        } else if (mutex_lock_interruptible(&streams[i]->lock)) {
+            ret = -ERESTARTSYS;
+            break;
+        }
+        ret = i2s_stream_ioctl(streams[i], cmd, &value);
+        mutex_unlock(&streams[i]->lock);
+        if (io)
+            mutex_unlock(&streams[i]->io_lock);
+        if (ret < 0)
+            break;
+    }
+    
+    /* Don't leave a full-duplex opener half started */
+    if (ret < 0 && cmd == I2S_START) {
+        while (i-- > 0) {
+            mutex_lock(&streams[i]->io_lock);
+            mutex_lock(&streams[i]->lock);
+            i2s_stream_stop(streams[i]);
+            mutex_unlock(&streams[i]->lock);
+            mutex_unlock(&streams[i]->io_lock);
+        }
+    }
+    
+    if (ret == 0 && (_IOC_DIR(cmd) & _IOC_READ)) {
+        if (copy_to_user((int __user *)arg, &value, sizeof(int)))
             ret = -EFAULT;
+    }
+    
+    return ret;
+}
+
+/* Track live mappings of a sample buffer so it is never freed under them */
+static void i2s_vm_open(struct vm_area_struct *vma)
+{
+    struct i2s_ring *ring = vma->vm_private_data;
+    
+    atomic_inc(&ring->mmap_count);
+}
+
+static void i2s_vm_close(struct vm_area_struct *vma)
+{
+    struct i2s_ring *ring = vma->vm_private_data;
+    
+    atomic_dec(&ring->mmap_count);
+}
+
+static const struct vm_operations_struct i2s_vm_ops = {
+    .open = i2s_vm_open,
+    .close = i2s_vm_close,
+};
+
+/*
+ * Map a ring's sample buffer or its status/control page. The status page
+ * is driver owned and may only be mapped read-only.
+ */
+static int i2s_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct i2s_file *file = filp->private_data;
+    unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
+    unsigned long len = vma->vm_end - vma->vm_start;
+    struct i2s_stream *stream;
+    struct i2s_ring *ring;
+    int ret;
+    
+    switch (offset) {
+    case I2S_MMAP_OFFSET_TX_DATA:
+    case I2S_MMAP_OFFSET_TX_STATUS:
+    case I2S_MMAP_OFFSET_TX_CONTROL:
+        stream = file->playback;
+        break;
+    case I2S_MMAP_OFFSET_RX_DATA:
+    case I2S_MMAP_OFFSET_RX_STATUS:
+    case I2S_MMAP_OFFSET_RX_CONTROL:
+        stream = file->capture;
         break;
-        
     default:
-        ret = -ENOTTY;
+        return -EINVAL;
     }
     
-    mutex_unlock(&dev->lock);
+    /* Only the owner of a stream may map it */
+    if (!stream)
+        return -EACCES;
+    ring = &stream->ring;
+    
+    switch (offset) {
+    case I2S_MMAP_OFFSET_TX_STATUS:
+    case I2S_MMAP_OFFSET_RX_STATUS:
+        if (vma->vm_flags & VM_WRITE)
+            return -EPERM;
+        vma->vm_flags &= ~VM_MAYWRITE;
+        if (len > PAGE_SIZE)
+            return -EINVAL;
+        return remap_vmalloc_range(vma, ring->status, 0);
+    case I2S_MMAP_OFFSET_TX_CONTROL:
+    case I2S_MMAP_OFFSET_RX_CONTROL:
+        if (len > PAGE_SIZE)
+            return -EINVAL;
+        return remap_vmalloc_range(vma, ring->control, 0);
+    }
+    
+    /* Hold off reconfiguration, which would change the buffer layout */
+    if (mutex_lock_interruptible(&stream->lock))
+        return -ERESTARTSYS;
+    
+    /* A ring smaller than a page maps the whole first page of the pool */
+    if (len > PAGE_ALIGN(ring->size))
+        ret = -EINVAL;
+    else if (ring->chan)
+        /* DMA buffers come from the coherent allocator, not vmalloc */
+        ret = dma_mmap_coherent(ring->chan->device->dev, vma,
+                                ring->data, ring->addr, len);
+    else
+        ret = remap_vmalloc_range(vma, ring->data, 0);
+    
+    if (ret == 0) {
+        vma->vm_private_data = ring;
+        vma->vm_ops = &i2s_vm_ops;
+        i2s_vm_open(vma);
+    }
+    
+    mutex_unlock(&stream->lock);
     return ret;
 }
 
@@ -199,92 +1784,305 @@ static struct file_operations i2s_fops = {
     .owner = THIS_MODULE,
     .open = i2s_open,
     .release = i2s_release,
-    .read = i2s_read,
-    .write = i2s_write,
+    .read_iter = i2s_read_iter,
+    .write_iter = i2s_write_iter,
     .unlocked_ioctl = i2s_ioctl,
+    .mmap = i2s_mmap,
+    .poll = i2s_poll,
 };
 
-static int __init i2s_driver_init(void)
+/* debugfs: <debugfs>/i2s/i2sN/{playback,capture}_stats */
+static int i2s_stats_show(struct seq_file *m, void *unused)
+{
+    struct i2s_stream *stream = m->private;
+    struct i2s_stats *stats = &stream->ring.stats;
+    int i;
+    
+    seq_printf(m, "bytes: %llu\n", READ_ONCE(stats->bytes));
+    seq_printf(m, "periods: %llu\n", READ_ONCE(stats->periods));
+    seq_printf(m, "xruns: %u\n", READ_ONCE(stats->xruns));
+    seq_printf(m, "max_lock_ns: %llu\n", READ_ONCE(stats->max_lock_ns));
+    seq_printf(m, "max_copy_ns: %llu\n", READ_ONCE(stats->max_copy_ns));
+    seq_printf(m, "total_copy_ns: %llu\n", READ_ONCE(stats->total_copy_ns));
+    
+    seq_puts(m, "jitter_us:");
+    for (i = 0; i < I2S_JITTER_BUCKETS - 1; i++)
+        seq_printf(m, " <%u:%llu", i2s_jitter_limits_us[i],
+                   READ_ONCE(stats->jitter[i]));
+    seq_printf(m, " >=%u:%llu\n", i2s_jitter_limits_us[i - 1],
+               READ_ONCE(stats->jitter[i]));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(i2s_stats);
+
+static void i2s_debugfs_init(struct i2s_dev *i2s)
+{
+    i2s->debugfs = debugfs_create_dir(dev_name(i2s->device), i2s_debugfs_root);
+    debugfs_create_file("playback_stats", 0444, i2s->debugfs,
+                        &i2s->playback, &i2s_stats_fops);
+    debugfs_create_file("capture_stats", 0444, i2s->debugfs,
+                        &i2s->capture, &i2s_stats_fops);
+}
+
+/* Set up one stream and its ring */
+static int i2s_stream_init(struct i2s_dev *dev, struct i2s_stream *stream,
+                           const char *name, struct dma_chan *chan,
+                           int playback)
+{
+    int ret;
+    
+    stream->dev = dev;
+    stream->name = name;
+    stream->owner = NULL;
+    mutex_init(&stream->lock);
+    mutex_init(&stream->io_lock);
+    stream->sample_rate = 44100;
+    stream->format = I2S_FORMAT_S16_LE;
+    stream->channels = 2;
+    
+    ret = i2s_ring_init(&stream->ring, chan, playback);
+    if (ret < 0)
+        return ret;
+    
+    hrtimer_init(&stream->ring.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+    stream->ring.timer.function = i2s_timer_period;
+    
+    ret = i2s_ring_set_buffer(&stream->ring, period_size, period_count);
+    if (ret < 0)
+        i2s_ring_free(&stream->ring);
+    return ret;
+}
+
+/* Tear down one stream, releasing its DMA channel */
+static void i2s_stream_free(struct i2s_stream *stream)
+{
+    struct dma_chan *chan = stream->ring.chan;
+    
+    i2s_stream_stop(stream);
+    i2s_ring_free(&stream->ring);
+    if (chan)
+        dma_release_channel(chan);
+}
+
+/* Resolve a FIFO register's bus address from "tx-fifo-offset" etc. */
+static dma_addr_t i2s_fifo_addr(struct platform_device *pdev, const char *prop)
+{
+    struct resource *res;
+    u32 offset = 0;
+    
+    res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
+    if (!res)
+        return 0;
+    
+    device_property_read_u32(&pdev->dev, prop, &offset);
+    return res->start + offset;
+}
+
+static int i2s_probe(struct platform_device *pdev)
 {
+    struct i2s_dev *i2s;
+    struct dma_chan *tx_chan, *rx_chan;
     int ret;
     
-    /* Allocate device structure */
-    i2s_device = kzalloc(sizeof(struct i2s_dev), GFP_KERNEL);
-    if (!i2s_device)
+    i2s = devm_kzalloc(&pdev->dev, sizeof(*i2s), GFP_KERNEL);
+    if (!i2s)
         return -ENOMEM;
     
-    /* Allocate device number */
-    ret = alloc_chrdev_region(&i2s_device->dev_num, 0, 1, DEVICE_NAME);
+    /* Honour "i2sN" aliases so device names are stable across boots */
+    ret = of_alias_get_id(pdev->dev.of_node, "i2s");
+    if (ret >= 0)
+        ret = ida_alloc_range(&i2s_ida, ret, ret, GFP_KERNEL);
+    else
+        ret = ida_alloc_max(&i2s_ida, I2S_MAX_DEVICES - 1, GFP_KERNEL);
     if (ret < 0) {
-        pr_err("I2S: Failed to allocate device number\n");
-        goto err_alloc;
+        dev_err(&pdev->dev, "Failed to allocate device number\n");
+        return ret;
+    }
+    i2s->id = ret;
+    i2s->dev_num = MKDEV(MAJOR(i2s_devt), i2s->id);
+    mutex_init(&i2s->lock);
+    spin_lock_init(&i2s->loop_lock);
+    
+    /* Frame layout from the firmware, plain I2S without one */
+    device_property_read_u32(&pdev->dev, "tdm-slots", &i2s->slots);
+    device_property_read_u32(&pdev->dev, "tdm-slot-width", &i2s->slot_width);
+    if (!i2s_tdm_valid(i2s->slots, i2s->slot_width)) {
+        dev_warn(&pdev->dev, "Ignoring invalid TDM layout: %u slots of %u bits\n",
+                 i2s->slots, i2s->slot_width);
+        i2s->slots = 0;
+        i2s->slot_width = 0;
+    }
+    
+    /* Set up DMA channels, if the controller has them and is not virtual */
+    tx_chan = NULL;
+    rx_chan = NULL;
+    if (backend == I2S_BACKEND_DMA) {
+        tx_chan = i2s_dma_request(&pdev->dev, "tx", DMA_MEM_TO_DEV,
+                                  i2s_fifo_addr(pdev, "tx-fifo-offset"));
+        if (IS_ERR(tx_chan)) {
+            ret = PTR_ERR(tx_chan);
+            goto err_ida;
+        }
+        
+        rx_chan = i2s_dma_request(&pdev->dev, "rx", DMA_DEV_TO_MEM,
+                                  i2s_fifo_addr(pdev, "rx-fifo-offset"));
+        if (IS_ERR(rx_chan)) {
+            ret = PTR_ERR(rx_chan);
+            goto err_tx_chan;
+        }
     }
     
+    /* Streams must exist before the node becomes visible */
+    ret = i2s_stream_init(i2s, &i2s->playback, "playback", tx_chan, 1);
+    if (ret < 0)
+        goto err_rx_chan;
+    tx_chan = NULL;
+    
+    ret = i2s_stream_init(i2s, &i2s->capture, "capture", rx_chan, 0);
+    if (ret < 0)
+        goto err_playback;
+    rx_chan = NULL;
+    
     /* Initialize cdev */
-    cdev_init(&i2s_device->cdev, &i2s_fops);
-    i2s_device->cdev.owner = THIS_MODULE;
+    cdev_init(&i2s->cdev, &i2s_fops);
+    i2s->cdev.owner = THIS_MODULE;
     
-    ret = cdev_add(&i2s_device->cdev, i2s_device->dev_num, 1);
+    ret = cdev_add(&i2s->cdev, i2s->dev_num, 1);
     if (ret < 0) {
-        pr_err("I2S: Failed to add cdev\n");
+        dev_err(&pdev->dev, "Failed to add cdev\n");
+        goto err_capture;
+    }
+    
+    /* Create device */
+    i2s->device = device_create(i2s_class, &pdev->dev, i2s->dev_num, i2s,
+                                DEVICE_NAME"%d", i2s->id);
+    if (IS_ERR(i2s->device)) {
+        ret = PTR_ERR(i2s->device);
+        dev_err(&pdev->dev, "Failed to create device\n");
         goto err_cdev;
     }
     
+    platform_set_drvdata(pdev, i2s);
+    i2s_debugfs_init(i2s);
+    if (backend != I2S_BACKEND_DMA)
+        dev_info(i2s->device, "Controller registered (%s backend)\n",
+                 backend == I2S_BACKEND_LOOPBACK ? "loopback" : "null");
+    else
+        dev_info(i2s->device, "Controller registered\n");
+    return 0;
+    
+err_cdev:
+    cdev_del(&i2s->cdev);
+err_capture:
+    i2s_stream_free(&i2s->capture);
+err_playback:
+    i2s_stream_free(&i2s->playback);
+err_rx_chan:
+    if (rx_chan)
+        dma_release_channel(rx_chan);
+err_tx_chan:
+    if (tx_chan)
+        dma_release_channel(tx_chan);
+err_ida:
+    ida_free(&i2s_ida, i2s->id);
+    return ret;
+}
+
+static int i2s_remove(struct platform_device *pdev)
+{
+    struct i2s_dev *i2s = platform_get_drvdata(pdev);
+    
+    debugfs_remove_recursive(i2s->debugfs);
+    device_destroy(i2s_class, i2s->dev_num);
+    cdev_del(&i2s->cdev);
+    i2s_stream_free(&i2s->capture);
+    i2s_stream_free(&i2s->playback);
+    ida_free(&i2s_ida, i2s->id);
+    return 0;
+}
+
+static const struct of_device_id i2s_of_match[] = {
+    { .compatible = "generic,i2s-chardev" },
+    { }
+};
+MODULE_DEVICE_TABLE(of, i2s_of_match);
+
+static struct platform_driver i2s_platform_driver = {
+    .probe = i2s_probe,
+    .remove = i2s_remove,
+    .driver = {
+        .name = "i2s-chardev",
+        .of_match_table = i2s_of_match,
+        /* Open files reference the i2s_dev, so no manual unbind */
+        .suppress_bind_attrs = true,
+    },
+};
+
+static int __init i2s_driver_init(void)
+{
+    int ret;
+    
+    /* Allocate device numbers for all controllers */
+    ret = alloc_chrdev_region(&i2s_devt, 0, I2S_MAX_DEVICES, DEVICE_NAME);
+    if (ret < 0) {
+        pr_err("I2S: Failed to allocate device numbers\n");
+        return ret;
+    }
+    
     /* Create device class */
-    i2s_device->class = class_create(THIS_MODULE, CLASS_NAME);
-    if (IS_ERR(i2s_device->class)) {
-        ret = PTR_ERR(i2s_device->class);
+    i2s_class = class_create(THIS_MODULE, CLASS_NAME);
+    if (IS_ERR(i2s_class)) {
+        ret = PTR_ERR(i2s_class);
         pr_err("I2S: Failed to create class\n");
         goto err_class;
     }
     
-    /* Create device */
-    i2s_device->device = device_create(i2s_device->class, NULL, 
-                                       i2s_device->dev_num, NULL, 
-                                       DEVICE_NAME"0");
-    if (IS_ERR(i2s_device->device)) {
-        ret = PTR_ERR(i2s_device->device);
-        pr_err("I2S: Failed to create device\n");
-        goto err_device;
+    i2s_debugfs_root = debugfs_create_dir(DEVICE_NAME, NULL);
+    
+    if (backend > I2S_BACKEND_LOOPBACK) {
+        pr_err("I2S: Unknown backend %u\n", backend);
+        ret = -EINVAL;
+        goto err_driver;
     }
     
-    /* Initialize mutex and default values */
-    mutex_init(&i2s_device->lock);
-    i2s_device->sample_rate = 44100;
-    i2s_device->bit_depth = 16;
-    i2s_device->is_running = 0;
-    i2s_device->buffer_size = 4096;
-    i2s_device->buffer = kmalloc(i2s_device->buffer_size, GFP_KERNEL);
+    ret = platform_driver_register(&i2s_platform_driver);
+    if (ret < 0) {
+        pr_err("I2S: Failed to register platform driver\n");
+        goto err_driver;
+    }
     
-    if (!i2s_device->buffer) {
-        ret = -ENOMEM;
-        goto err_buffer;
+    /* A virtual backend needs no device tree node to have a controller */
+    if (backend != I2S_BACKEND_DMA) {
+        i2s_virtual_pdev = platform_device_register_simple(
+            i2s_platform_driver.driver.name, PLATFORM_DEVID_AUTO, NULL, 0);
+        if (IS_ERR(i2s_virtual_pdev)) {
+            ret = PTR_ERR(i2s_virtual_pdev);
+            pr_err("I2S: Failed to register virtual controller\n");
+            goto err_pdev;
+        }
     }
     
     pr_info("I2S: Driver loaded successfully\n");
     return 0;
     
-err_buffer:
-    device_destroy(i2s_device->class, i2s_device->dev_num);
-err_device:
-    class_destroy(i2s_device->class);
+err_pdev:
+    platform_driver_unregister(&i2s_platform_driver);
+err_driver:
+    debugfs_remove_recursive(i2s_debugfs_root);
+    class_destroy(i2s_class);
 err_class:
-    cdev_del(&i2s_device->cdev);
-err_cdev:
-    unregister_chrdev_region(i2s_device->dev_num, 1);
-err_alloc:
-    kfree(i2s_device);
+    unregister_chrdev_region(i2s_devt, I2S_MAX_DEVICES);
     return ret;
 }
 
 static void __exit i2s_driver_exit(void)
 {
-    kfree(i2s_device->buffer);
-    device_destroy(i2s_device->class, i2s_device->dev_num);
-    class_destroy(i2s_device->class);
-    cdev_del(&i2s_device->cdev);
-    unregister_chrdev_region(i2s_device->dev_num, 1);
-    kfree(i2s_device);
+    if (i2s_virtual_pdev)
+        platform_device_unregister(i2s_virtual_pdev);
+    platform_driver_unregister(&i2s_platform_driver);
+    debugfs_remove_recursive(i2s_debugfs_root);
+    class_destroy(i2s_class);
+    unregister_chrdev_region(i2s_devt, I2S_MAX_DEVICES);
     
     pr_info("I2S: Driver unloaded\n");
 }
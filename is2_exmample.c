@@ -9,21 +9,30 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <math.h>
 
 #define SAMPLE_RATE 44100
 #define BIT_DEPTH 16
 #define DURATION 2  /* seconds */
 #define FREQUENCY 440.0  /* A4 note */
 
-/* Generate sine wave */
+/* Generate sine wave with the library's oscillator, converted with dither */
 void generate_sine_wave(int16_t *buffer, size_t samples, double frequency, int sample_rate)
 {
-    for (size_t i = 0; i < samples; i++) {
-        double t = (double)i / sample_rate;
-        double value = sin(2.0 * M_PI * frequency * t);
-        buffer[i] = (int16_t)(value * 32767.0);
+    i2s_signal_config_t sine = {
+        .type = I2S_SIGNAL_SINE,
+        .amplitude = 1.0,
+        .freq = frequency,
+    };
+    i2s_signal_t sig = i2s_signal_create(sample_rate, 1);
+    
+    if (!sig) {
+        memset(buffer, 0, samples * sizeof(int16_t));
+        return;
     }
+    
+    i2s_signal_set(sig, 0, &sine);
+    i2s_signal_generate(sig, buffer, I2S_SAMPLE_S16, samples, I2S_CONVERT_DITHER);
+    i2s_signal_destroy(sig);
 }
 
 int main(int argc, char *argv[])
@@ -125,9 +134,18 @@ int main(int argc, char *argv[])
     if (daemon_sock >= 0) {
         printf("Connected to I2S daemon\n");
         
-        /* Send status query command */
-        if (i2s_daemon_send_command(daemon_sock, 1, 0) == 0) {
-            printf("Daemon status query successful\n");
+        /* Query status and stats in one round trip */
+        i2s_daemon_request_t reqs[2] = {
+            { .cmd = I2S_DAEMON_GET_STATUS },
+            { .cmd = I2S_DAEMON_GET_STATS },
+        };
+        if (i2s_daemon_batch(daemon_sock, reqs, 2) == 0 &&
+            reqs[0].status == 0 && reqs[1].status == 0) {
+            printf("Daemon status query successful: %llu clients, "
+                   "volume %llu%%, up %llu s\n",
+                   (unsigned long long)reqs[0].values[I2S_DAEMON_ATTR_CLIENTS],
+                   (unsigned long long)reqs[0].values[I2S_DAEMON_ATTR_VOLUME],
+                   (unsigned long long)reqs[1].values[I2S_DAEMON_ATTR_UPTIME]);
         }
         
         i2s_daemon_disconnect(daemon_sock);
@@ -7,6 +7,8 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 /* I2S handle */
 typedef struct i2s_handle_s *i2s_handle_t;
@@ -18,34 +20,439 @@ typedef struct {
     int channels;
 } i2s_config_t;
 
+/* Hardware sample formats */
+typedef enum {
+    I2S_FORMAT_S16_LE = 0,
+    I2S_FORMAT_S24_LE = 1,      /* 24 bits in a 32-bit container */
+    I2S_FORMAT_S32_LE = 2
+} i2s_format_t;
+
+/* Sample formats understood by i2s_convert() */
+typedef enum {
+    I2S_SAMPLE_FLOAT32 = 0,     /* -1.0 .. 1.0 */
+    I2S_SAMPLE_S16 = 1,
+    I2S_SAMPLE_S24_3LE = 2,     /* packed in 3 bytes */
+    I2S_SAMPLE_S24_LE = 3,      /* 24 bits in a 32-bit container */
+    I2S_SAMPLE_S32 = 4
+} i2s_sample_t;
+
+/* i2s_convert() flags */
+#define I2S_CONVERT_DITHER 0x1      /* TPDF dither when dropping precision */
+#define I2S_CONVERT_SATURATE 0x2    /* clamp float input outside -1.0 .. 1.0 */
+
+/* Complete stream configuration, applied atomically by i2s_set_params() */
+typedef struct {
+    int sample_rate;
+    i2s_format_t format;
+    int channels;               /* 1, 2, 4, 8 or 16 */
+    int period_frames;          /* period_frames * frame size must be a power of two */
+    int periods;                /* power of two */
+    uint32_t slot_mask;         /* TDM slots in use, 0 = the first channels slots */
+} i2s_params_t;
+
+/* Bus frame layout, shared by playback and capture */
+typedef struct {
+    int slots;                  /* 0 = plain I2S (two slots), 4 .. 16 = TDM;
+                                 * streams use a power-of-two number of them */
+    int slot_width;             /* 16, 24 or 32 bits, 0 = the sample container */
+    uint32_t tx_mask;           /* playback slot_mask */
+    uint32_t rx_mask;           /* capture slot_mask */
+} i2s_tdm_t;
+
+/* One channel of an interleaved buffer, addressed in place */
+typedef struct {
+    void *addr;                 /* the channel's sample in the first frame */
+    size_t step;                /* bytes from one frame to the next */
+    i2s_sample_t format;
+} i2s_channel_area_t;
+
 /* I2S status */
 typedef enum {
     I2S_STATUS_STOPPED = 0,
     I2S_STATUS_RUNNING = 1,
+    I2S_STATUS_XRUN = 2,        /* I/O fails with EPIPE until i2s_recover() */
     I2S_STATUS_ERROR = -1
 } i2s_status_t;
 
+/* What the driver does after an underrun/overrun until i2s_recover() */
+typedef enum {
+    I2S_XRUN_STOP = 0,          /* halt the stream */
+    I2S_XRUN_SILENCE = 1,       /* keep running, play silence */
+    I2S_XRUN_REPEAT = 2         /* keep running, repeat the last period */
+} i2s_xrun_policy_t;
+
+/* Buffering presets for i2s_set_buffering_preset() */
+typedef enum {
+    I2S_BUFFERING_LOW_LATENCY = 0,  /* 64 frames x 2, start after one period */
+    I2S_BUFFERING_THROUGHPUT = 1    /* 4096 frames x 8, wake every half buffer */
+} i2s_buffering_t;
+
+/* Stream direction */
+typedef enum {
+    I2S_STREAM_PLAYBACK = 0,
+    I2S_STREAM_CAPTURE = 1
+} i2s_stream_t;
+
+/* Hardware position, sampled at the last period interrupt */
+typedef struct {
+    uint64_t hw_frames;     /* frames moved by the hardware since start */
+    uint32_t fill_frames;   /* frames queued in the driver ring */
+    uint64_t tstamp_ns;     /* CLOCK_MONOTONIC_RAW timestamp */
+    uint32_t xruns;         /* underruns/overruns so far */
+} i2s_position_t;
+
+/*
+ * Async streaming: called from the worker thread with a zero-copy period
+ * of the mapped ring, to fill (playback) or consume (capture). Return 0
+ * to keep streaming, anything else to stop the worker.
+ */
+typedef int (*i2s_callback_t)(i2s_stream_t stream, void *buffer,
+                              size_t frames, void *userdata);
+
+/* Worker thread setup for i2s_stream_start_async() */
+typedef struct {
+    int priority;           /* SCHED_FIFO priority, 0 = normal scheduling */
+    int cpu;                /* CPU to pin the worker to, -1 = any */
+    int lock_memory;        /* mlockall() the process before starting */
+} i2s_async_config_t;
+
 /* Library functions */
 i2s_handle_t i2s_open(const char *device);
+i2s_handle_t i2s_open_stream(const char *device, i2s_stream_t stream);
 void i2s_close(i2s_handle_t handle);
 
 int i2s_configure(i2s_handle_t handle, const i2s_config_t *config);
 int i2s_get_config(i2s_handle_t handle, i2s_config_t *config);
 
+int i2s_set_params(i2s_handle_t handle, const i2s_params_t *params);
+int i2s_get_params(i2s_handle_t handle, i2s_params_t *params);
+
+/* The frame layout may only change while neither direction runs, and
+ * before a stream's channels and slot_mask grow into the new slots. The
+ * masks only change for the streams the handle owns. A stream's channel
+ * count must be a power of two, so e.g. a 6-slot frame carries 4 of its
+ * slots (or fewer) per direction, picked by the mask. */
+int i2s_set_tdm(i2s_handle_t handle, const i2s_tdm_t *tdm);
+int i2s_get_tdm(i2s_handle_t handle, i2s_tdm_t *tdm);
+
+/* Channel mapping: the slot of each frame channel, returns channels */
+int i2s_channel_slots(const i2s_params_t *params, int *slots, int max);
+/* The frame channel carrying slot, -1 if the stream does not use it */
+int i2s_slot_channel(const i2s_params_t *params, int slot);
+/* Address the samples of one slot in an interleaved buffer of params */
+int i2s_channel_area(const i2s_params_t *params, void *buffer, int slot,
+                     i2s_channel_area_t *area);
+
 int i2s_start(i2s_handle_t handle);
 int i2s_stop(i2s_handle_t handle);
 
 i2s_status_t i2s_get_status(i2s_handle_t handle);
+int i2s_set_xrun_policy(i2s_handle_t handle, i2s_xrun_policy_t policy);
+int i2s_recover(i2s_handle_t handle);
+int i2s_get_position(i2s_handle_t handle, i2s_stream_t stream,
+                     i2s_position_t *pos);
 
 ssize_t i2s_read(i2s_handle_t handle, void *buffer, size_t size);
 ssize_t i2s_write(i2s_handle_t handle, const void *buffer, size_t size);
+ssize_t i2s_writev(i2s_handle_t handle, const struct iovec *iov, int iovcnt);
+
+/* Write frames from one buffer per channel, in the stream's sample format;
+ * returns frames written */
+ssize_t i2s_write_noninterleaved(i2s_handle_t handle,
+                                 const void *const *channels, size_t frames);
+
+/* Readiness: the fd can be polled (POLLOUT/POLLIN), I/O blocks unless
+ * non-blocking mode is set */
+int i2s_get_fd(i2s_handle_t handle);
+int i2s_set_nonblock(i2s_handle_t handle, int nonblock);
+int i2s_set_avail_min(i2s_handle_t handle, size_t bytes);
+
+/* Latency versus wakeups, all in frames. start_threshold: queued frames at
+ * which i2s_write() or i2s_mmap_commit() starts a stopped stream (a read or
+ * i2s_mmap_begin() starts capture), 0 = only i2s_start() does.
+ * avail_min: frames per wakeup, 0 = one period. */
+int i2s_set_buffering(i2s_handle_t handle, int period_frames, int periods,
+                      int start_threshold, int avail_min);
+/* THROUGHPUT is 1 MiB for 8 channels of S32, past the driver's default
+ * pool_size of 256 KiB per stream, so the ring is shrunk (periods first)
+ * until it fits; load the module with a larger pool_size to keep it. */
+int i2s_set_buffering_preset(i2s_handle_t handle, i2s_buffering_t preset);
+
+/* Zero-copy access to the driver ring buffers. An area stays valid until
+ * the next i2s_set_params() or i2s_set_buffering(), which unmap the ring
+ * so the driver can resize it; the next i2s_mmap_begin() maps it again. */
+int i2s_mmap_begin(i2s_handle_t handle, i2s_stream_t stream,
+                   void **area, size_t *size);
+int i2s_mmap_commit(i2s_handle_t handle, i2s_stream_t stream, size_t size);
+
+/* Callback-driven streaming from a real-time worker thread. While it
+ * runs, the handle belongs to the worker except for
+ * i2s_stream_stop_async(), i2s_get_position() and i2s_get_status(). */
+int i2s_set_async_config(i2s_handle_t handle, const i2s_async_config_t *config);
+int i2s_stream_start_async(i2s_handle_t handle, i2s_callback_t callback,
+                           void *userdata);
+int i2s_stream_stop_async(i2s_handle_t handle);
 
 const char *i2s_get_error(i2s_handle_t handle);
 
+/* Sample conversion (libi2s_convert.c). Without I2S_CONVERT_SATURATE,
+ * float input must lie in -1.0 .. 1.0. dst and src may only overlap
+ * when both formats have the same sample size. */
+int i2s_convert(void *dst, i2s_sample_t dst_format,
+                const void *src, i2s_sample_t src_format,
+                size_t samples, unsigned int flags);
+size_t i2s_sample_size(i2s_sample_t format);
+i2s_sample_t i2s_format_sample(i2s_format_t format);
+const char *i2s_convert_backend(void);
+/* Convert one channel straight from or into its strided area, without
+ * deinterleaving the buffer first */
+int i2s_channel_extract(void *dst, i2s_sample_t dst_format,
+                        const i2s_channel_area_t *area, size_t frames,
+                        unsigned int flags);
+int i2s_channel_insert(const i2s_channel_area_t *area, const void *src,
+                       i2s_sample_t src_format, size_t frames,
+                       unsigned int flags);
+
+/*
+ * Sample-rate conversion (libi2s_resample.c): polyphase windowed-sinc
+ * over interleaved float frames. Filter tables are shared by every
+ * resampler with the same quality and cutoff.
+ */
+typedef enum {
+    I2S_RESAMPLE_FAST = 0,      /* 16 taps, ~85% of the passband */
+    I2S_RESAMPLE_MEDIUM = 1,    /* 32 taps, ~91% */
+    I2S_RESAMPLE_BEST = 2       /* 64 taps, ~95% */
+} i2s_resample_quality_t;
+
+#define I2S_RESAMPLE_MIN_RATE 8000
+#define I2S_RESAMPLE_MAX_RATE 192000
+#define I2S_RESAMPLE_MAX_TAPS 64
+
+typedef struct i2s_resampler_s *i2s_resampler_t;
+
+i2s_resampler_t i2s_resampler_create(int in_rate, int out_rate, int channels,
+                                     i2s_resample_quality_t quality);
+void i2s_resampler_destroy(i2s_resampler_t rs);
+void i2s_resampler_reset(i2s_resampler_t rs);
+/* Scale the output rate by ratio (close to 1), for drift compensation */
+int i2s_resampler_set_ratio(i2s_resampler_t rs, double ratio);
+/* Input frames needed before out_frames more can be produced */
+size_t i2s_resampler_needed(i2s_resampler_t rs, size_t out_frames);
+/* *in_frames and *out_frames go in as the sizes and come back as the
+ * frames consumed and produced */
+int i2s_resample(i2s_resampler_t rs, const float *in, size_t *in_frames,
+                 float *out, size_t *out_frames);
+
+/*
+ * Clock-drift compensation (libi2s_drift.c): asynchronous resampling
+ * between an application paced by a reference clock and the device. The
+ * ratio follows the drift measured from the hardware timestamps, and a
+ * PI loop holds the ring fill at target_frames. The handle must be in
+ * blocking mode and is used only through the drift object meanwhile.
+ */
+typedef struct {
+    clockid_t reference;        /* e.g. CLOCK_MONOTONIC, CLOCK_TAI or a PTP
+                                   clock (FD_TO_CLOCKID of /dev/ptpN) */
+    uint32_t target_frames;     /* ring fill to hold, 0 = half the ring */
+    double kp;                  /* ppm per frame of fill error */
+    double ki;                  /* ppm per frame-second of fill error */
+    double max_ppm;             /* limit of the correction */
+    i2s_resample_quality_t quality;
+} i2s_drift_config_t;
+
+typedef struct {
+    double drift_ppm;           /* device clock against the reference */
+    double correction_ppm;      /* applied to the resampling ratio */
+    double fill_frames;         /* smoothed ring fill */
+    uint32_t target_frames;
+} i2s_drift_stats_t;
+
+typedef struct i2s_drift_s *i2s_drift_t;
+
+void i2s_drift_config_default(i2s_drift_config_t *config);
+i2s_drift_t i2s_drift_create(i2s_handle_t handle, i2s_stream_t stream,
+                             int source_rate, const i2s_drift_config_t *config);
+void i2s_drift_destroy(i2s_drift_t drift);
+/* Interleaved float frames at the source rate; return frames done */
+ssize_t i2s_drift_write(i2s_drift_t drift, const float *frames, size_t count);
+ssize_t i2s_drift_read(i2s_drift_t drift, float *frames, size_t count);
+int i2s_drift_get_stats(i2s_drift_t drift, i2s_drift_stats_t *stats);
+
+/*
+ * Test signals (libi2s_signal.c) for burn-in and factory tests, made
+ * without a sin() per sample and written in any sample format, e.g.
+ * straight into a mapped ring. Each channel has its own generator;
+ * channel -1 sets all of them to one shared generator.
+ */
+typedef enum {
+    I2S_SIGNAL_SILENCE = 0,
+    I2S_SIGNAL_SINE = 1,            /* freq, phase */
+    I2S_SIGNAL_MULTITONE = 2,       /* the sum of tones[0 .. ntones - 1] */
+    I2S_SIGNAL_SWEEP_LINEAR = 3,    /* freq to freq_end over duration, repeated */
+    I2S_SIGNAL_SWEEP_LOG = 4,
+    I2S_SIGNAL_WHITE_NOISE = 5,
+    I2S_SIGNAL_PINK_NOISE = 6
+} i2s_signal_type_t;
+
+#define I2S_SIGNAL_MAX_TONES 8
+
+typedef struct {
+    double freq;                /* Hz */
+    double amplitude;           /* relative to the signal's amplitude */
+    double phase;               /* cycles at the start */
+} i2s_tone_t;
+
+typedef struct {
+    i2s_signal_type_t type;
+    double amplitude;           /* peak, 1.0 = full scale */
+    double freq;                /* Hz; where a sweep starts */
+    double freq_end;            /* where a sweep ends */
+    double duration;            /* seconds per sweep */
+    double phase;               /* cycles at the start */
+    int ntones;
+    i2s_tone_t tones[I2S_SIGNAL_MAX_TONES];
+    uint32_t seed;              /* noise, 0 = different for each channel */
+} i2s_signal_config_t;
+
+typedef struct i2s_signal_s *i2s_signal_t;
+
+i2s_signal_t i2s_signal_create(int sample_rate, int channels);
+void i2s_signal_destroy(i2s_signal_t sig);
+int i2s_signal_set(i2s_signal_t sig, int channel,
+                   const i2s_signal_config_t *config);
+/* Channel c gets a sine at freq + c * step, to tell channels apart */
+int i2s_signal_set_ladder(i2s_signal_t sig, double freq, double step,
+                          double amplitude);
+/* Silence every channel but one, -1 to hear all again */
+int i2s_signal_solo(i2s_signal_t sig, int channel);
+void i2s_signal_reset(i2s_signal_t sig);
+/* Interleaved frames of every channel; flags as for i2s_convert() */
+int i2s_signal_generate(i2s_signal_t sig, void *buffer, i2s_sample_t format,
+                        size_t frames, unsigned int flags);
+/* Generate into the mapped playback ring of handle; returns frames */
+ssize_t i2s_signal_write(i2s_signal_t sig, i2s_handle_t handle, size_t frames,
+                         unsigned int flags);
+
+/*
+ * io_uring backend (libi2s_uring.c): queue reads/writes on many handles,
+ * then submit and reap them in batches from one thread. buf_index >= 0
+ * selects a buffer registered with i2s_uring_register_buffers().
+ */
+typedef struct i2s_uring_s *i2s_uring_t;
+
+typedef struct {
+    uint64_t user_data;
+    int result;             /* bytes transferred, or -errno */
+} i2s_uring_cqe_t;
+
+i2s_uring_t i2s_uring_create(unsigned int entries);
+void i2s_uring_destroy(i2s_uring_t ring);
+int i2s_uring_register_buffers(i2s_uring_t ring, const struct iovec *iov,
+                               unsigned int count);
+int i2s_uring_register_handles(i2s_uring_t ring, const i2s_handle_t *handles,
+                               unsigned int count);
+int i2s_uring_prep_read(i2s_uring_t ring, i2s_handle_t handle, void *buf,
+                        size_t len, int buf_index, uint64_t user_data);
+int i2s_uring_prep_write(i2s_uring_t ring, i2s_handle_t handle,
+                         const void *buf, size_t len, int buf_index,
+                         uint64_t user_data);
+int i2s_uring_complete(i2s_uring_t ring, i2s_uring_cqe_t *cqes,
+                       unsigned int max, unsigned int min_complete);
+
+/* Daemon commands */
+typedef enum {
+    I2S_DAEMON_GET_STATUS = 1,
+    I2S_DAEMON_SET_VOLUME = 2,      /* param: percent */
+    I2S_DAEMON_GET_STATS = 3,
+    I2S_DAEMON_SHUTDOWN = 4,
+    I2S_DAEMON_OPEN_STREAM = 5,     /* only through i2s_daemon_stream_open() */
+    I2S_DAEMON_CLOSE_STREAM = 6     /* param: stream id */
+} i2s_daemon_cmd_t;
+
+/* Typed values carried by daemon replies */
+typedef enum {
+    I2S_DAEMON_ATTR_PARAM = 1,
+    I2S_DAEMON_ATTR_UPTIME = 2,     /* seconds */
+    I2S_DAEMON_ATTR_CLIENTS = 3,
+    I2S_DAEMON_ATTR_VOLUME = 4,     /* percent */
+    I2S_DAEMON_ATTR_STREAM = 5,
+    I2S_DAEMON_ATTR_RATE = 6,
+    I2S_DAEMON_ATTR_CHANNELS = 7,
+    I2S_DAEMON_ATTR_FRAMES = 8,     /* frames written to the device */
+    I2S_DAEMON_ATTR_XRUNS = 9,
+    I2S_DAEMON_ATTR_UNDERRUNS = 10, /* client periods that came up short */
+    I2S_DAEMON_ATTR_LOAD = 11,      /* mixer load, permille */
+    I2S_DAEMON_ATTR_LATENCY_P50 = 12,   /* microseconds */
+    I2S_DAEMON_ATTR_LATENCY_P99 = 13,
+    I2S_DAEMON_ATTR_MAX = 32
+} i2s_daemon_attr_t;
+
+/* One command of a batch, and its reply */
+typedef struct {
+    int cmd;
+    int param;
+    int status;                 /* reply: 0 or -errno */
+    uint32_t present;           /* bit n set: values[n] came with the reply */
+    uint64_t values[I2S_DAEMON_ATTR_MAX];
+} i2s_daemon_request_t;
+
 /* Daemon communication functions */
 int i2s_daemon_connect(void);
 void i2s_daemon_disconnect(int sock);
+/* Returns the reply status (0 or -errno), or -1 if the exchange failed */
 int i2s_daemon_send_command(int sock, int cmd, int param);
+/* Send all requests at once and collect their replies in one round trip */
+int i2s_daemon_batch(int sock, i2s_daemon_request_t *requests, size_t count);
+
+/*
+ * Daemon statistics page in shared memory, written by i2sd's threads
+ * without locks. Each field is updated atomically on its own, so readers
+ * never disturb the mixer, but the fields are not one snapshot.
+ * Histogram bucket n counts values below 2^n us, the last one the rest.
+ */
+#define I2S_DAEMON_STATS_PATH "/i2sd-stats"
+#define I2S_DAEMON_STATS_VERSION 1
+#define I2S_STATS_BUCKETS 20
+
+typedef struct {
+    uint32_t version;
+    uint32_t rate;
+    uint32_t period_frames;
+    uint32_t reserved;
+    uint64_t start_time;            /* seconds since the epoch */
+    uint64_t frames;                /* frames written to the device */
+    uint64_t periods;               /* periods mixed */
+    uint64_t xruns;                 /* device underruns */
+    uint64_t client_underruns;      /* client periods with under a period queued */
+    uint64_t clients;               /* attached playback clients */
+    uint64_t load_permille;         /* mixing time per period time, smoothed */
+    uint64_t mix_ns_total;
+    uint64_t mix_us[I2S_STATS_BUCKETS];     /* mixing time per period */
+    uint64_t latency_us_total;
+    uint64_t latency_us[I2S_STATS_BUCKETS]; /* client ring to DAC, per period */
+} i2s_daemon_stats_t;
+
+const i2s_daemon_stats_t *i2s_daemon_stats_open(void);
+void i2s_daemon_stats_close(const i2s_daemon_stats_t *stats);
+/* Upper bound in us of the bucket holding that fraction of the samples;
+ * 0 when empty, UINT64_MAX when it is the last bucket */
+uint64_t i2s_daemon_stats_percentile(const uint64_t *buckets, double fraction);
+
+/*
+ * Playback through the i2sd mixer, so several processes can play at
+ * once. Audio is S16 interleaved in the format the daemon reports.
+ * i2s_daemon_stream_write() blocks until all of it is queued. A stream
+ * opened at another rate than the mixer's is resampled by the daemon.
+ */
+typedef struct i2s_daemon_stream_s *i2s_daemon_stream_t;
+
+i2s_daemon_stream_t i2s_daemon_stream_open(void);
+i2s_daemon_stream_t i2s_daemon_stream_open_rate(int sample_rate);
+int i2s_daemon_stream_get_config(i2s_daemon_stream_t stream,
+                                 i2s_config_t *config);
+ssize_t i2s_daemon_stream_write(i2s_daemon_stream_t stream,
+                                const void *buffer, size_t size);
+void i2s_daemon_stream_close(i2s_daemon_stream_t stream);
 
 #endif /* LIBI2S_H */
 
@@ -53,6 +460,7 @@ int i2s_daemon_send_command(int sock, int cmd, int param);
  * libi2s.c - I2S User Space Library Implementation
  */
 
+#define _GNU_SOURCE
 #include "libi2s.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -61,7 +469,13 @@ int i2s_daemon_send_command(int sock, int cmd, int param);
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
 
 /* IOCTL commands (must match kernel driver) */
@@ -73,30 +487,210 @@ int i2s_daemon_send_command(int sock, int cmd, int param);
 #define I2S_START _IO(I2S_IOC_MAGIC, 5)
 #define I2S_STOP _IO(I2S_IOC_MAGIC, 6)
 #define I2S_GET_STATUS _IOR(I2S_IOC_MAGIC, 7, int)
+#define I2S_GET_BUFFER_SIZE _IOR(I2S_IOC_MAGIC, 8, int)
+#define I2S_SET_AVAIL_MIN _IOW(I2S_IOC_MAGIC, 9, int)
+#define I2S_GET_HW_PTR _IOWR(I2S_IOC_MAGIC, 10, struct i2s_hw_ptr)
+#define I2S_SET_PARAMS _IOW(I2S_IOC_MAGIC, 11, struct i2s_params)
+#define I2S_GET_PARAMS _IOR(I2S_IOC_MAGIC, 12, struct i2s_params)
+#define I2S_SET_XRUN_POLICY _IOW(I2S_IOC_MAGIC, 13, int)
+#define I2S_RECOVER _IO(I2S_IOC_MAGIC, 14)
+#define I2S_SET_START_THRESHOLD _IOW(I2S_IOC_MAGIC, 15, int)
+#define I2S_SET_TDM _IOW(I2S_IOC_MAGIC, 16, struct i2s_tdm)
+#define I2S_GET_TDM _IOR(I2S_IOC_MAGIC, 17, struct i2s_tdm)
+
+struct i2s_params {
+    uint32_t rate;
+    uint32_t format;
+    uint32_t channels;
+    uint32_t period_frames;
+    uint32_t periods;
+    uint32_t slot_mask;
+};
+
+struct i2s_tdm {
+    uint32_t slots;
+    uint32_t slot_width;
+    uint32_t tx_mask;
+    uint32_t rx_mask;
+};
+
+struct i2s_hw_ptr {
+    uint32_t stream;
+    uint32_t fill_frames;
+    uint64_t hw_frames;
+    uint64_t tstamp_ns;
+    uint32_t xruns;
+    uint32_t reserved;
+};
+
+/* mmap offsets and shared pages (must match kernel driver) */
+#define I2S_MMAP_OFFSET_TX_DATA 0x00000000
+#define I2S_MMAP_OFFSET_RX_DATA 0x10000000
+#define I2S_MMAP_OFFSET_TX_STATUS 0x80000000
+#define I2S_MMAP_OFFSET_TX_CONTROL 0x81000000
+#define I2S_MMAP_OFFSET_RX_STATUS 0x82000000
+#define I2S_MMAP_OFFSET_RX_CONTROL 0x83000000
+
+#define I2S_STATE_STOPPED 0
+#define I2S_STATE_RUNNING 1
+#define I2S_STATE_XRUN 2
+
+struct i2s_mmap_status {
+    uint32_t state;
+    uint32_t hw_ptr;
+    uint32_t xruns;
+    uint32_t generation;        /* moves on every configuration change */
+};
+
+struct i2s_mmap_control {
+    uint32_t appl_ptr;
+    uint32_t avail_min;
+};
 
 #define DAEMON_SOCKET_PATH "/var/run/i2sd.sock"
 
+/* Daemon wire protocol (must match i2sd) */
+#define I2SD_MAGIC 0x5349
+#define I2SD_VERSION 1
+#define I2SD_FLAG_REPLY 0x01
+#define I2SD_MAX_PAYLOAD 512
+
+struct i2sd_hdr {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t flags;
+    uint16_t cmd;
+    uint16_t length;            /* attribute bytes after the header */
+    uint32_t id;                /* chosen by the client, echoed in the reply */
+    int32_t status;             /* replies: 0 or -errno */
+};
+
+struct i2sd_attr {
+    uint16_t type;
+    uint16_t length;            /* value bytes, always 8 for now */
+};
+
+#define I2SD_REQUEST_SIZE (sizeof(struct i2sd_hdr) + sizeof(struct i2sd_attr) + \
+                           sizeof(uint64_t))
+
+/* Requests in flight per round trip of i2s_daemon_batch() */
+#define I2SD_BATCH_CHUNK 32
+
+/* Client playback ring in shared memory (must match i2sd) */
+#define I2S_MIX_RING_MAGIC 0x69326d72
+
+struct i2s_mix_ring {
+    uint32_t magic;
+    uint32_t size;              /* data bytes, power of two */
+    uint32_t rate;
+    uint32_t channels;
+    uint32_t period_frames;
+    
+    /* Free-running byte counts, on their own cache lines */
+    uint32_t head __attribute__((aligned(64)));     /* written by the client */
+    uint32_t tail __attribute__((aligned(64)));     /* written by the mixer */
+    uint32_t wake __attribute__((aligned(64)));     /* client sleeps on wake_fd */
+    unsigned char data[] __attribute__((aligned(64)));
+};
+
+/* Mixer stream of this process; it lives as long as sock is connected */
+struct i2s_daemon_stream_s {
+    int sock;
+    int wake_fd;                /* eventfd from the daemon */
+    struct i2s_mix_ring *ring;
+    size_t map_len;
+};
+
+/* Mapped ring buffer of one stream */
+struct i2s_mmap_area {
+    char *data;
+    size_t size;
+    const struct i2s_mmap_status *status;
+    struct i2s_mmap_control *control;
+};
+
+/* Callback worker of a handle */
+struct i2s_async {
+    pthread_t thread;
+    int active;
+    int wake_fd;                /* eventfd, written to stop the worker */
+    i2s_callback_t callback;
+    void *userdata;
+    i2s_async_config_t config;
+    
+    /* Startup handshake: the worker reports whether the stream started */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int started;
+    int error;                  /* errno value the worker stopped with */
+};
+
 /* Internal handle structure */
 struct i2s_handle_s {
     int fd;
     char error_msg[256];
     i2s_config_t config;
+    i2s_params_t params;
+    
+    /* config and params are valid while the driver's generation stays */
+    int params_valid;
+    uint32_t generation;
+    
+    /* Status pages of the streams the handle owns, mapped at open */
+    struct i2s_mmap_area mmap[2];
+    int nonblock;
+    
+    /* Bytes the driver's write() starts a stopped stream at, mirrored so
+     * the mmap path can do the same; 0 = only i2s_start() */
+    uint32_t start_threshold;
+    int mode;                   /* O_RDONLY, O_WRONLY or O_RDWR */
+    struct i2s_async async;
 };
 
-/* Daemon message structures */
-typedef struct {
-    int cmd;
-    int param;
-    char data[256];
-} daemon_msg_t;
+/*
+ * Map the status page of a stream. Without it (an older driver) every
+ * state query falls back to an ioctl.
+ */
+static void i2s_map_status(i2s_handle_t handle, i2s_stream_t stream)
+{
+    void *p;
+    
+    p = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, handle->fd,
+             stream == I2S_STREAM_PLAYBACK ? I2S_MMAP_OFFSET_TX_STATUS :
+             I2S_MMAP_OFFSET_RX_STATUS);
+    if (p != MAP_FAILED)
+        handle->mmap[stream].status = p;
+}
 
-typedef struct {
-    int status;
-    char message[256];
-} daemon_response_t;
+/* The status page the driver's getters report on: playback, if owned */
+static const struct i2s_mmap_status *i2s_status_page(i2s_handle_t handle)
+{
+    if (handle->mode != O_RDONLY)
+        return handle->mmap[I2S_STREAM_PLAYBACK].status;
+    return handle->mmap[I2S_STREAM_CAPTURE].status;
+}
 
-/* Open I2S device */
-i2s_handle_t i2s_open(const char *device)
+/* Whether every stream the handle owns is in state, or -1 if unknown */
+static int i2s_streams_in_state(i2s_handle_t handle, uint32_t state)
+{
+    const struct i2s_mmap_status *status;
+    int i, all = 1;
+    
+    for (i = I2S_STREAM_PLAYBACK; i <= I2S_STREAM_CAPTURE; i++) {
+        if (handle->mode == (i == I2S_STREAM_PLAYBACK ? O_RDONLY : O_WRONLY))
+            continue;
+        status = handle->mmap[i].status;
+        if (!status)
+            return -1;
+        if (__atomic_load_n(&status->state, __ATOMIC_ACQUIRE) != state)
+            all = 0;
+    }
+    
+    return all;
+}
+
+/* Open I2S device with the given access mode */
+static i2s_handle_t i2s_open_flags(const char *device, int flags)
 {
     i2s_handle_t handle;
     
@@ -111,7 +705,7 @@ i2s_handle_t i2s_open(const char *device)
     
     memset(handle, 0, sizeof(struct i2s_handle_s));
     
-    handle->fd = open(device, O_RDWR);
+    handle->fd = open(device, flags);
     if (handle->fd < 0) {
         snprintf(handle->error_msg, sizeof(handle->error_msg),
                  "Failed to open device %s: %s", device, strerror(errno));
@@ -119,177 +713,1199 @@ i2s_handle_t i2s_open(const char *device)
         return NULL;
     }
     
+    handle->mode = flags & O_ACCMODE;
+    handle->async.config.priority = 70;
+    handle->async.config.cpu = -1;
+    
+    /* State queries read the status pages instead of asking the driver */
+    if (handle->mode != O_RDONLY)
+        i2s_map_status(handle, I2S_STREAM_PLAYBACK);
+    if (handle->mode != O_WRONLY)
+        i2s_map_status(handle, I2S_STREAM_CAPTURE);
+    
     /* Get current configuration */
-    i2s_get_config(handle, &handle->config);
+    i2s_get_params(handle, &handle->params);
     
     return handle;
 }
 
+/* Open I2S device for full-duplex playback and capture */
+i2s_handle_t i2s_open(const char *device)
+{
+    return i2s_open_flags(device, O_RDWR);
+}
+
+/*
+ * Open only one direction, so that a player and a recorder can use the
+ * device at the same time (the driver hands out each stream once)
+ */
+i2s_handle_t i2s_open_stream(const char *device, i2s_stream_t stream)
+{
+    return i2s_open_flags(device,
+                          stream == I2S_STREAM_CAPTURE ? O_RDONLY : O_WRONLY);
+}
+
+/* Unmap a stream's ring buffer */
+static void i2s_mmap_release(struct i2s_mmap_area *area)
+{
+    if (area->data)
+        munmap(area->data, area->size);
+    if (area->status)
+        munmap((void *)area->status, sysconf(_SC_PAGESIZE));
+    if (area->control)
+        munmap(area->control, sysconf(_SC_PAGESIZE));
+    memset(area, 0, sizeof(*area));
+}
+
+/*
+ * Drop a stream's data and control mappings but keep its status page. The
+ * driver refuses to resize a mapped ring, so this runs before every
+ * configuration change; the mmap path maps the new ring on its next use.
+ */
+static void i2s_mmap_drop(struct i2s_mmap_area *area)
+{
+    if (area->data)
+        munmap(area->data, area->size);
+    if (area->control)
+        munmap(area->control, sysconf(_SC_PAGESIZE));
+    area->data = NULL;
+    area->size = 0;
+    area->control = NULL;
+}
+
 /* Close I2S device */
 void i2s_close(i2s_handle_t handle)
 {
     if (!handle)
         return;
     
-    if (handle->fd >= 0) {
+    if (handle->async.active)
+        i2s_stream_stop_async(handle);
+    
+    /* While the status pages are mapped this skips streams never started */
+    if (handle->fd >= 0)
         i2s_stop(handle);
+    
+    i2s_mmap_release(&handle->mmap[I2S_STREAM_PLAYBACK]);
+    i2s_mmap_release(&handle->mmap[I2S_STREAM_CAPTURE]);
+    
+    if (handle->fd >= 0)
         close(handle->fd);
-    }
     
     free(handle);
 }
 
-/* Configure I2S device */
-int i2s_configure(i2s_handle_t handle, const i2s_config_t *config)
+/* Map between bit depths and hardware formats */
+static int i2s_format_from_bits(int bit_depth)
 {
-    if (!handle || !config) {
+    switch (bit_depth) {
+    case 16:
+        return I2S_FORMAT_S16_LE;
+    case 24:
+        return I2S_FORMAT_S24_LE;
+    case 32:
+        return I2S_FORMAT_S32_LE;
+    default:
         return -1;
     }
+}
+
+static int i2s_format_to_bits(i2s_format_t format)
+{
+    switch (format) {
+    case I2S_FORMAT_S16_LE:
+        return 16;
+    case I2S_FORMAT_S24_LE:
+        return 24;
+    default:
+        return 32;
+    }
+}
+
+/* Set the complete stream configuration in one call */
+int i2s_set_params(i2s_handle_t handle, const i2s_params_t *params)
+{
+    const struct i2s_mmap_status *status;
+    struct i2s_params kparams;
     
-    /* Set sample rate */
-    if (ioctl(handle->fd, I2S_SET_SAMPLE_RATE, &config->sample_rate) < 0) {
-        snprintf(handle->error_msg, sizeof(handle->error_msg),
-                 "Failed to set sample rate: %s", strerror(errno));
+    if (!handle || !params) {
         return -1;
     }
     
-    /* Set bit depth */
-    if (ioctl(handle->fd, I2S_SET_BIT_DEPTH, &config->bit_depth) < 0) {
+    kparams.rate = params->sample_rate;
+    kparams.format = params->format;
+    kparams.channels = params->channels;
+    kparams.period_frames = params->period_frames;
+    kparams.periods = params->periods;
+    kparams.slot_mask = params->slot_mask;
+    
+    i2s_mmap_drop(&handle->mmap[I2S_STREAM_PLAYBACK]);
+    i2s_mmap_drop(&handle->mmap[I2S_STREAM_CAPTURE]);
+    
+    if (ioctl(handle->fd, I2S_SET_PARAMS, &kparams) < 0) {
         snprintf(handle->error_msg, sizeof(handle->error_msg),
-                 "Failed to set bit depth: %s", strerror(errno));
+                 "Failed to set parameters: %s", strerror(errno));
         return -1;
     }
     
-    handle->config = *config;
+    /* Our own change moved the generation; the cache starts from it */
+    status = i2s_status_page(handle);
+    if (status) {
+        handle->generation = __atomic_load_n(&status->generation,
+                                             __ATOMIC_ACQUIRE);
+    }
+    handle->params_valid = status != NULL;
+    handle->params = *params;
+    handle->config.sample_rate = params->sample_rate;
+    handle->config.bit_depth = i2s_format_to_bits(params->format);
+    handle->config.channels = params->channels;
     return 0;
 }
 
-/* Get current configuration */
-int i2s_get_config(i2s_handle_t handle, i2s_config_t *config)
+/*
+ * Get the complete stream configuration in one call. It comes from the
+ * cache, without a syscall, until the driver reports a change.
+ */
+int i2s_get_params(i2s_handle_t handle, i2s_params_t *params)
 {
-    if (!handle || !config) {
+    const struct i2s_mmap_status *status;
+    struct i2s_params kparams;
+    uint32_t generation = 0;
+    
+    if (!handle || !params) {
         return -1;
     }
     
-    if (ioctl(handle->fd, I2S_GET_SAMPLE_RATE, &config->sample_rate) < 0) {
-        snprintf(handle->error_msg, sizeof(handle->error_msg),
-                 "Failed to get sample rate: %s", strerror(errno));
-        return -1;
+    /* Read before the ioctl, so a change racing with it is seen next time */
+    status = i2s_status_page(handle);
+    if (status) {
+        generation = __atomic_load_n(&status->generation, __ATOMIC_ACQUIRE);
+        if (handle->params_valid && generation == handle->generation) {
+            *params = handle->params;
+            return 0;
+        }
     }
     
-    if (ioctl(handle->fd, I2S_GET_BIT_DEPTH, &config->bit_depth) < 0) {
+    if (ioctl(handle->fd, I2S_GET_PARAMS, &kparams) < 0) {
         snprintf(handle->error_msg, sizeof(handle->error_msg),
-                 "Failed to get bit depth: %s", strerror(errno));
+                 "Failed to get parameters: %s", strerror(errno));
         return -1;
     }
     
-    config->channels = 2; /* Default stereo */
+    params->sample_rate = kparams.rate;
+    params->format = kparams.format;
+    params->channels = kparams.channels;
+    params->period_frames = kparams.period_frames;
+    params->periods = kparams.periods;
+    params->slot_mask = kparams.slot_mask;
+    
+    handle->params_valid = status != NULL;
+    handle->generation = generation;
+    handle->params = *params;
+    handle->config.sample_rate = params->sample_rate;
+    handle->config.bit_depth = i2s_format_to_bits(params->format);
+    handle->config.channels = params->channels;
     return 0;
 }
 
-/* Start I2S transmission */
-int i2s_start(i2s_handle_t handle)
+/*
+ * Configure I2S device. Rate, depth and channels go to the driver together
+ * in one ioctl, starting from the cached parameters.
+ */
+int i2s_configure(i2s_handle_t handle, const i2s_config_t *config)
 {
-    if (!handle) {
+    i2s_params_t params;
+    int format;
+    
+    if (!handle || !config) {
         return -1;
     }
     
-    if (ioctl(handle->fd, I2S_START) < 0) {
+    format = i2s_format_from_bits(config->bit_depth);
+    if (format < 0) {
         snprintf(handle->error_msg, sizeof(handle->error_msg),
-                 "Failed to start I2S: %s", strerror(errno));
+                 "Unsupported bit depth: %d", config->bit_depth);
         return -1;
     }
     
-    return 0;
+    params = handle->params;
+    params.sample_rate = config->sample_rate;
+    params.format = format;
+    params.channels = config->channels;
+    
+    /* Keep the period size in bytes as the frame size changes, so the
+     * driver ring keeps its power-of-two geometry */
+    if (params.channels != handle->params.channels ||
+        params.format != handle->params.format) {
+        size_t old_frame = (size_t)handle->params.channels *
+            (handle->params.format == I2S_FORMAT_S16_LE ? 2 : 4);
+        size_t new_frame = (size_t)params.channels *
+            (params.format == I2S_FORMAT_S16_LE ? 2 : 4);
+        
+        if (old_frame && new_frame) {
+            params.period_frames = (int)(handle->params.period_frames * old_frame / new_frame);
+        }
+    }
+    
+    return i2s_set_params(handle, &params);
 }
 
-/* Stop I2S transmission */
-int i2s_stop(i2s_handle_t handle)
+/* Get current configuration, from the cache while it is valid */
+int i2s_get_config(i2s_handle_t handle, i2s_config_t *config)
 {
-    if (!handle) {
+    i2s_params_t params;
+    
+    if (!handle || !config) {
         return -1;
     }
     
-    if (ioctl(handle->fd, I2S_STOP) < 0) {
-        snprintf(handle->error_msg, sizeof(handle->error_msg),
-                 "Failed to stop I2S: %s", strerror(errno));
+    if (i2s_get_params(handle, &params) < 0) {
         return -1;
     }
     
+    *config = handle->config;
     return 0;
 }
 
-/* Get I2S status */
-i2s_status_t i2s_get_status(i2s_handle_t handle)
+/*
+ * Set the bus frame layout. The driver moves the configuration generation
+ * of both streams, so the cached parameters pick up the new slot_mask.
+ */
+int i2s_set_tdm(i2s_handle_t handle, const i2s_tdm_t *tdm)
 {
-    int status;
+    struct i2s_tdm ktdm;
     
-    if (!handle) {
-        return I2S_STATUS_ERROR;
+    if (!handle || !tdm) {
+        return -1;
     }
     
-    if (ioctl(handle->fd, I2S_GET_STATUS, &status) < 0) {
+    ktdm.slots = tdm->slots;
+    ktdm.slot_width = tdm->slot_width;
+    ktdm.tx_mask = tdm->tx_mask;
+    ktdm.rx_mask = tdm->rx_mask;
+    
+    if (ioctl(handle->fd, I2S_SET_TDM, &ktdm) < 0) {
         snprintf(handle->error_msg, sizeof(handle->error_msg),
-                 "Failed to get status: %s", strerror(errno));
-        return I2S_STATUS_ERROR;
+                 "Failed to set TDM layout: %s", strerror(errno));
+        return -1;
     }
     
-    return status ? I2S_STATUS_RUNNING : I2S_STATUS_STOPPED;
+    return 0;
 }
 
-/* Read audio data from I2S */
-ssize_t i2s_read(i2s_handle_t handle, void *buffer, size_t size)
+int i2s_get_tdm(i2s_handle_t handle, i2s_tdm_t *tdm)
 {
-    ssize_t ret;
+    struct i2s_tdm ktdm;
     
-    if (!handle || !buffer) {
+    if (!handle || !tdm) {
         return -1;
     }
     
-    ret = read(handle->fd, buffer, size);
-    if (ret < 0) {
+    if (ioctl(handle->fd, I2S_GET_TDM, &ktdm) < 0) {
         snprintf(handle->error_msg, sizeof(handle->error_msg),
-                 "Read failed: %s", strerror(errno));
+                 "Failed to get TDM layout: %s", strerror(errno));
+        return -1;
     }
     
-    return ret;
+    tdm->slots = ktdm.slots;
+    tdm->slot_width = ktdm.slot_width;
+    tdm->tx_mask = ktdm.tx_mask;
+    tdm->rx_mask = ktdm.rx_mask;
+    return 0;
 }
 
-/* Write audio data to I2S */
-ssize_t i2s_write(i2s_handle_t handle, const void *buffer, size_t size)
+/*
+ * Frames carry the stream's channels in slot order: channel n is the
+ * n-th set bit of slot_mask, or slot n when the mask is 0.
+ */
+int i2s_channel_slots(const i2s_params_t *params, int *slots, int max)
 {
-    ssize_t ret;
+    int ch = 0, slot;
     
-    if (!handle || !buffer) {
+    if (!params || (!slots && max) || params->channels <= 0) {
+        errno = EINVAL;
         return -1;
     }
     
-    ret = write(handle->fd, buffer, size);
-    if (ret < 0) {
-        snprintf(handle->error_msg, sizeof(handle->error_msg),
-                 "Write failed: %s", strerror(errno));
+    for (slot = 0; ch < params->channels && slot < 32; slot++) {
+        if (params->slot_mask && !(params->slot_mask & (1u << slot)))
+            continue;
+        if (ch < max)
+            slots[ch] = slot;
+        ch++;
     }
     
-    return ret;
+    return ch;
 }
 
-/* Get last error message */
-const char *i2s_get_error(i2s_handle_t handle)
+int i2s_slot_channel(const i2s_params_t *params, int slot)
 {
-    if (!handle) {
-        return "Invalid handle";
+    uint32_t below;
+    
+    if (!params || slot < 0 || slot >= 32) {
+        return -1;
     }
     
-    return handle->error_msg;
+    if (!params->slot_mask) {
+        return slot < params->channels ? slot : -1;
+    }
+    if (!(params->slot_mask & (1u << slot))) {
+        return -1;
+    }
+    
+    below = params->slot_mask & ((1u << slot) - 1);
+    return __builtin_popcount(below);
 }
 
-/* Connect to daemon */
-int i2s_daemon_connect(void)
+/*
+ * The area points into buffer, so a whole capture period can be split
+ * into per-microphone channels without moving any samples.
+ */
+int i2s_channel_area(const i2s_params_t *params, void *buffer, int slot,
+                     i2s_channel_area_t *area)
 {
-    int sock;
-    struct sockaddr_un addr;
+    size_t sample_bytes;
+    int ch;
     
-    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (!params || !buffer || !area) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    ch = i2s_slot_channel(params, slot);
+    if (ch < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    
+    area->format = i2s_format_sample(params->format);
+    sample_bytes = i2s_sample_size(area->format);
+    area->addr = (char *)buffer + (size_t)ch * sample_bytes;
+    area->step = sample_bytes * params->channels;
+    return 0;
+}
+
+/* Start I2S transmission */
+int i2s_start(i2s_handle_t handle)
+{
+    if (!handle) {
+        return -1;
+    }
+    
+    if (i2s_streams_in_state(handle, I2S_STATE_RUNNING) == 1) {
+        return 0;
+    }
+    
+    if (ioctl(handle->fd, I2S_START) < 0) {
+        snprintf(handle->error_msg, sizeof(handle->error_msg),
+                 "Failed to start I2S: %s", strerror(errno));
+        return -1;
+    }
+    
+    return 0;
+}
+
+/* Stop I2S transmission */
+int i2s_stop(i2s_handle_t handle)
+{
+    if (!handle) {
+        return -1;
+    }
+    
+    if (i2s_streams_in_state(handle, I2S_STATE_STOPPED) == 1) {
+        return 0;
+    }
+    
+    if (ioctl(handle->fd, I2S_STOP) < 0) {
+        snprintf(handle->error_msg, sizeof(handle->error_msg),
+                 "Failed to stop I2S: %s", strerror(errno));
+        return -1;
+    }
+    
+    return 0;
+}
+
+/* Get I2S status, from the status page when it is mapped */
+i2s_status_t i2s_get_status(i2s_handle_t handle)
+{
+    const struct i2s_mmap_status *page;
+    int status;
+    
+    if (!handle) {
+        return I2S_STATUS_ERROR;
+    }
+    
+    page = i2s_status_page(handle);
+    if (page) {
+        status = (int)__atomic_load_n(&page->state, __ATOMIC_ACQUIRE);
+    } else if (ioctl(handle->fd, I2S_GET_STATUS, &status) < 0) {
+        snprintf(handle->error_msg, sizeof(handle->error_msg),
+                 "Failed to get status: %s", strerror(errno));
+        return I2S_STATUS_ERROR;
+    }
+    
+    if (status == I2S_STATUS_XRUN)
+        return I2S_STATUS_XRUN;
+    return status ? I2S_STATUS_RUNNING : I2S_STATUS_STOPPED;
+}
+
+/* Choose what the driver does when the application misses a period */
+int i2s_set_xrun_policy(i2s_handle_t handle, i2s_xrun_policy_t policy)
+{
+    int value = policy;
+    
+    if (!handle) {
+        return -1;
+    }
+    
+    if (ioctl(handle->fd, I2S_SET_XRUN_POLICY, &value) < 0) {
+        snprintf(handle->error_msg, sizeof(handle->error_msg),
+                 "Failed to set xrun policy: %s", strerror(errno));
+        return -1;
+    }
+    
+    return 0;
+}
+
+/*
+ * Resynchronize after I/O failed with EPIPE. Data queued before the xrun
+ * is dropped: playback continues one period ahead of the hardware,
+ * capture continues from an empty buffer.
+ */
+int i2s_recover(i2s_handle_t handle)
+{
+    if (!handle) {
+        return -1;
+    }
+    
+    if (ioctl(handle->fd, I2S_RECOVER) < 0) {
+        snprintf(handle->error_msg, sizeof(handle->error_msg),
+                 "Failed to recover: %s", strerror(errno));
+        return -1;
+    }
+    
+    return 0;
+}
+
+/* Get the timestamped hardware position of a stream */
+int i2s_get_position(i2s_handle_t handle, i2s_stream_t stream,
+                     i2s_position_t *pos)
+{
+    struct i2s_hw_ptr hw;
+    
+    if (!handle || !pos) {
+        return -1;
+    }
+    
+    memset(&hw, 0, sizeof(hw));
+    hw.stream = stream;
+    
+    if (ioctl(handle->fd, I2S_GET_HW_PTR, &hw) < 0) {
+        snprintf(handle->error_msg, sizeof(handle->error_msg),
+                 "Failed to get position: %s", strerror(errno));
+        return -1;
+    }
+    
+    pos->hw_frames = hw.hw_frames;
+    pos->fill_frames = hw.fill_frames;
+    pos->tstamp_ns = hw.tstamp_ns;
+    pos->xruns = hw.xruns;
+    return 0;
+}
+
+/* Read audio data from I2S */
+ssize_t i2s_read(i2s_handle_t handle, void *buffer, size_t size)
+{
+    ssize_t ret;
+    
+    if (!handle || !buffer) {
+        return -1;
+    }
+    
+    ret = read(handle->fd, buffer, size);
+    if (ret < 0) {
+        snprintf(handle->error_msg, sizeof(handle->error_msg),
+                 "Read failed: %s", strerror(errno));
+    }
+    
+    return ret;
+}
+
+/* Write audio data to I2S */
+ssize_t i2s_write(i2s_handle_t handle, const void *buffer, size_t size)
+{
+    ssize_t ret;
+    
+    if (!handle || !buffer) {
+        return -1;
+    }
+    
+    ret = write(handle->fd, buffer, size);
+    if (ret < 0) {
+        snprintf(handle->error_msg, sizeof(handle->error_msg),
+                 "Write failed: %s", strerror(errno));
+    }
+    
+    return ret;
+}
+
+/* Write several buffers back to back in one call */
+ssize_t i2s_writev(i2s_handle_t handle, const struct iovec *iov, int iovcnt)
+{
+    ssize_t ret;
+    
+    if (!handle || !iov) {
+        return -1;
+    }
+    
+    ret = writev(handle->fd, iov, iovcnt);
+    if (ret < 0) {
+        snprintf(handle->error_msg, sizeof(handle->error_msg),
+                 "Write failed: %s", strerror(errno));
+    }
+    
+    return ret;
+}
+
+/* Interleave frames [first, first + frames) of planar buffers into dst */
+static void i2s_interleave(void *dst, const void *const *channels,
+                           size_t first, size_t frames, int nch,
+                           size_t sample_bytes)
+{
+    size_t i;
+    int ch;
+    
+    if (sample_bytes == 2) {
+        uint16_t *out = dst;
+        
+        for (i = first; i < first + frames; i++)
+            for (ch = 0; ch < nch; ch++)
+                *out++ = ((const uint16_t *)channels[ch])[i];
+    } else {
+        uint32_t *out = dst;
+        
+        for (i = first; i < first + frames; i++)
+            for (ch = 0; ch < nch; ch++)
+                *out++ = ((const uint32_t *)channels[ch])[i];
+    }
+}
+
+/*
+ * Interleave straight into the mapped playback ring, so planar data is
+ * touched once on its way to the hardware and never staged in a
+ * temporary buffer. Blocks in poll() for space unless non-blocking.
+ */
+ssize_t i2s_write_noninterleaved(i2s_handle_t handle,
+                                 const void *const *channels, size_t frames)
+{
+    struct i2s_mmap_area *map;
+    struct pollfd pfd;
+    size_t sample_bytes, frame_bytes, done = 0, n, avail;
+    void *area;
+    int nch;
+    
+    if (!handle || !channels) {
+        return -1;
+    }
+    
+    nch = handle->params.channels;
+    sample_bytes = handle->params.format == I2S_FORMAT_S16_LE ? 2 : 4;
+    frame_bytes = sample_bytes * nch;
+    map = &handle->mmap[I2S_STREAM_PLAYBACK];
+    
+    while (done < frames) {
+        if (i2s_mmap_begin(handle, I2S_STREAM_PLAYBACK, &area, &avail) < 0) {
+            break;
+        }
+        
+        n = avail / frame_bytes;
+        if (n > frames - done)
+            n = frames - done;
+        
+        if (n) {
+            i2s_interleave(area, channels, done, n, nch, sample_bytes);
+            /* The frames are queued even if the autostart failed */
+            done += n;
+            if (i2s_mmap_commit(handle, I2S_STREAM_PLAYBACK, n * frame_bytes) < 0)
+                break;
+            continue;
+        }
+        
+        if (handle->nonblock) {
+            errno = EAGAIN;
+            break;
+        }
+        
+        pfd.fd = handle->fd;
+        pfd.events = POLLOUT;
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            snprintf(handle->error_msg, sizeof(handle->error_msg),
+                     "Poll failed: %s", strerror(errno));
+            break;
+        }
+        
+        /* Stopped, or xrun: the next i2s_mmap_begin() reports that */
+        if ((pfd.revents & POLLERR) &&
+            __atomic_load_n(&map->status->state, __ATOMIC_ACQUIRE) != I2S_STATE_XRUN) {
+            snprintf(handle->error_msg, sizeof(handle->error_msg),
+                     "Stream not running");
+            errno = EINVAL;
+            break;
+        }
+    }
+    
+    return done ? (ssize_t)done : -1;
+}
+
+/* Get the device file descriptor, e.g. for poll()/epoll */
+int i2s_get_fd(i2s_handle_t handle)
+{
+    if (!handle) {
+        return -1;
+    }
+    
+    return handle->fd;
+}
+
+/* Switch between blocking and non-blocking (EAGAIN) read/write */
+int i2s_set_nonblock(i2s_handle_t handle, int nonblock)
+{
+    int flags;
+    
+    if (!handle) {
+        return -1;
+    }
+    
+    flags = fcntl(handle->fd, F_GETFL);
+    if (flags < 0) {
+        snprintf(handle->error_msg, sizeof(handle->error_msg),
+                 "Failed to get flags: %s", strerror(errno));
+        return -1;
+    }
+    
+    flags = nonblock ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    if (fcntl(handle->fd, F_SETFL, flags) < 0) {
+        snprintf(handle->error_msg, sizeof(handle->error_msg),
+                 "Failed to set flags: %s", strerror(errno));
+        return -1;
+    }
+    
+    handle->nonblock = nonblock;
+    return 0;
+}
+
+/* Set the low-water mark for wakeups and poll readiness */
+int i2s_set_avail_min(i2s_handle_t handle, size_t bytes)
+{
+    int value = (int)bytes;
+    
+    if (!handle) {
+        return -1;
+    }
+    
+    if (ioctl(handle->fd, I2S_SET_AVAIL_MIN, &value) < 0) {
+        snprintf(handle->error_msg, sizeof(handle->error_msg),
+                 "Failed to set avail_min: %s", strerror(errno));
+        return -1;
+    }
+    
+    return 0;
+}
+
+/* Set the ring geometry and wakeup/start points in one go */
+int i2s_set_buffering(i2s_handle_t handle, int period_frames, int periods,
+                      int start_threshold, int avail_min)
+{
+    i2s_params_t params;
+    size_t frame_bytes;
+    int value;
+    
+    if (!handle || period_frames <= 0 || periods <= 0 ||
+        start_threshold < 0 || avail_min < 0) {
+        return -1;
+    }
+    
+    params = handle->params;
+    params.period_frames = period_frames;
+    params.periods = periods;
+    if (i2s_set_params(handle, &params) < 0) {
+        return -1;
+    }
+    
+    frame_bytes = (size_t)params.channels *
+        (params.format == I2S_FORMAT_S16_LE ? 2 : 4);
+    
+    value = (int)(start_threshold * frame_bytes);
+    if (ioctl(handle->fd, I2S_SET_START_THRESHOLD, &value) < 0) {
+        snprintf(handle->error_msg, sizeof(handle->error_msg),
+                 "Failed to set start threshold: %s", strerror(errno));
+        return -1;
+    }
+    handle->start_threshold = (uint32_t)value;
+    
+    return i2s_set_avail_min(handle,
+                             (size_t)(avail_min ? avail_min : period_frames) *
+                             frame_bytes);
+}
+
+/* Apply one of the buffering presets */
+int i2s_set_buffering_preset(i2s_handle_t handle, i2s_buffering_t preset)
+{
+    int period, periods, ret;
+    
+    switch (preset) {
+    case I2S_BUFFERING_LOW_LATENCY:
+        return i2s_set_buffering(handle, 64, 2, 64, 64);
+    case I2S_BUFFERING_THROUGHPUT:
+        /* The driver refuses a ring larger than its pool with ENOMEM */
+        period = 4096;
+        periods = 8;
+        while ((ret = i2s_set_buffering(handle, period, periods,
+                                        period * periods,
+                                        period * periods / 2)) < 0 &&
+               errno == ENOMEM && period * periods > 128) {
+            if (periods > 2)
+                periods /= 2;
+            else
+                period /= 2;
+        }
+        return ret;
+    default:
+        if (handle) {
+            snprintf(handle->error_msg, sizeof(handle->error_msg),
+                     "Unknown buffering preset: %d", (int)preset);
+        }
+        return -1;
+    }
+}
+
+/* Map a stream's ring buffer and its status/control pages */
+static int i2s_mmap_setup(i2s_handle_t handle, i2s_stream_t stream)
+{
+    struct i2s_mmap_area *area = &handle->mmap[stream];
+    long page_size = sysconf(_SC_PAGESIZE);
+    int playback = (stream == I2S_STREAM_PLAYBACK);
+    int size;
+    void *p;
+    
+    if (ioctl(handle->fd, I2S_GET_BUFFER_SIZE, &size) < 0) {
+        snprintf(handle->error_msg, sizeof(handle->error_msg),
+                 "Failed to get buffer size: %s", strerror(errno));
+        return -1;
+    }
+    
+    p = mmap(NULL, size, playback ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED,
+             handle->fd, playback ? I2S_MMAP_OFFSET_TX_DATA : I2S_MMAP_OFFSET_RX_DATA);
+    if (p == MAP_FAILED)
+        goto err;
+    area->data = p;
+    area->size = size;
+    
+    /* Normally mapped at open already */
+    if (!area->status) {
+        p = mmap(NULL, page_size, PROT_READ, MAP_SHARED, handle->fd,
+                 playback ? I2S_MMAP_OFFSET_TX_STATUS : I2S_MMAP_OFFSET_RX_STATUS);
+        if (p == MAP_FAILED)
+            goto err;
+        area->status = p;
+    }
+    
+    p = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_SHARED, handle->fd,
+             playback ? I2S_MMAP_OFFSET_TX_CONTROL : I2S_MMAP_OFFSET_RX_CONTROL);
+    if (p == MAP_FAILED)
+        goto err;
+    area->control = p;
+    
+    return 0;
+    
+err:
+    snprintf(handle->error_msg, sizeof(handle->error_msg),
+             "Failed to map buffer: %s", strerror(errno));
+    /* The status page stays for the state queries */
+    if (area->data)
+        munmap(area->data, area->size);
+    area->data = NULL;
+    area->size = 0;
+    return -1;
+}
+
+/*
+ * Start a stopped stream from the mmap path, the way the driver's
+ * read()/write() start an armed one. I2S_START covers every stream the
+ * handle owns, like i2s_start().
+ */
+static int i2s_mmap_autostart(i2s_handle_t handle)
+{
+    if (ioctl(handle->fd, I2S_START) < 0) {
+        snprintf(handle->error_msg, sizeof(handle->error_msg),
+                 "Failed to start I2S: %s", strerror(errno));
+        return -1;
+    }
+    
+    return 0;
+}
+
+/*
+ * Get the contiguous part of the ring that can be accessed in place:
+ * free space for playback, captured data for capture.
+ */
+int i2s_mmap_begin(i2s_handle_t handle, i2s_stream_t stream,
+                   void **area, size_t *size)
+{
+    struct i2s_mmap_area *map;
+    uint32_t hw_ptr, appl_ptr, used, avail, offset;
+    
+    if (!handle || !area || !size ||
+        (stream != I2S_STREAM_PLAYBACK && stream != I2S_STREAM_CAPTURE)) {
+        return -1;
+    }
+    
+    map = &handle->mmap[stream];
+    if (!map->data && i2s_mmap_setup(handle, stream) < 0) {
+        return -1;
+    }
+    
+    /* An armed capture stream starts on the first look, as read() does */
+    if (stream == I2S_STREAM_CAPTURE && handle->start_threshold &&
+        __atomic_load_n(&map->status->state, __ATOMIC_ACQUIRE) == I2S_STATE_STOPPED &&
+        i2s_mmap_autostart(handle) < 0) {
+        return -1;
+    }
+    
+    if (__atomic_load_n(&map->status->state, __ATOMIC_ACQUIRE) == I2S_STATE_XRUN) {
+        snprintf(handle->error_msg, sizeof(handle->error_msg),
+                 "Stream xrun, call i2s_recover()");
+        errno = EPIPE;
+        return -1;
+    }
+    
+    /* Only we move appl_ptr, the driver moves hw_ptr */
+    appl_ptr = map->control->appl_ptr;
+    hw_ptr = __atomic_load_n(&map->status->hw_ptr, __ATOMIC_ACQUIRE);
+    
+    if (stream == I2S_STREAM_PLAYBACK) {
+        used = appl_ptr - hw_ptr;
+        avail = map->size - used;
+    } else {
+        avail = hw_ptr - appl_ptr;
+    }
+    
+    offset = appl_ptr & (map->size - 1);
+    if (avail > map->size - offset)
+        avail = map->size - offset;
+    
+    *area = map->data + offset;
+    *size = avail;
+    return 0;
+}
+
+/* Hand size bytes obtained from i2s_mmap_begin() back to the driver */
+int i2s_mmap_commit(i2s_handle_t handle, i2s_stream_t stream, size_t size)
+{
+    struct i2s_mmap_area *map;
+    
+    if (!handle ||
+        (stream != I2S_STREAM_PLAYBACK && stream != I2S_STREAM_CAPTURE)) {
+        return -1;
+    }
+    
+    map = &handle->mmap[stream];
+    if (!map->data || size > map->size) {
+        snprintf(handle->error_msg, sizeof(handle->error_msg),
+                 "Invalid mmap commit");
+        return -1;
+    }
+    
+    /* Samples must be visible before the driver sees the new pointer */
+    __atomic_store_n(&map->control->appl_ptr,
+                     map->control->appl_ptr + (uint32_t)size, __ATOMIC_RELEASE);
+    
+    /* write() starts an armed playback stream once start_threshold is
+     * queued; the driver never sees appl_ptr move, so do it here. The
+     * threshold is capped to the ring like in the driver */
+    if (stream == I2S_STREAM_PLAYBACK && handle->start_threshold &&
+        __atomic_load_n(&map->status->state, __ATOMIC_ACQUIRE) == I2S_STATE_STOPPED &&
+        map->control->appl_ptr - __atomic_load_n(&map->status->hw_ptr, __ATOMIC_ACQUIRE) >=
+        (handle->start_threshold < map->size ? handle->start_threshold : map->size)) {
+        return i2s_mmap_autostart(handle);
+    }
+    
+    return 0;
+}
+
+/* Set the scheduling of workers started afterwards */
+int i2s_set_async_config(i2s_handle_t handle, const i2s_async_config_t *config)
+{
+    if (!handle || !config) {
+        return -1;
+    }
+    
+    handle->async.config = *config;
+    return 0;
+}
+
+/*
+ * Hand every whole period that is ready on a stream to the callback.
+ * Returns 0 to keep going, 1 if the callback asked to stop, or a negative
+ * errno value, taken where the mmap call failed so it cannot be stale.
+ */
+static int i2s_async_service(i2s_handle_t handle, i2s_stream_t stream)
+{
+    struct i2s_async *async = &handle->async;
+    size_t frame_bytes = (size_t)handle->params.channels *
+        (handle->params.format == I2S_FORMAT_S16_LE ? 2 : 4);
+    size_t period_bytes = frame_bytes * handle->params.period_frames;
+    size_t avail;
+    void *area;
+    
+    for (;;) {
+        if (i2s_mmap_begin(handle, stream, &area, &avail) < 0) {
+            return -errno;
+        }
+        
+        /* Whole periods only, so appl_ptr stays period aligned and a
+         * period never wraps */
+        if (avail < period_bytes) {
+            return 0;
+        }
+        
+        if (async->callback(stream, area, handle->params.period_frames,
+                            async->userdata)) {
+            return 1;
+        }
+        if (i2s_mmap_commit(handle, stream, period_bytes) < 0) {
+            return -errno;
+        }
+    }
+}
+
+/* Service both directions the handle owns */
+static int i2s_async_service_all(i2s_handle_t handle)
+{
+    int ret = 0;
+    
+    if (handle->mode != O_RDONLY)
+        ret = i2s_async_service(handle, I2S_STREAM_PLAYBACK);
+    if (!ret && handle->mode != O_WRONLY)
+        ret = i2s_async_service(handle, I2S_STREAM_CAPTURE);
+    return ret;
+}
+
+static void i2s_async_report(struct i2s_async *async, int error)
+{
+    pthread_mutex_lock(&async->lock);
+    async->started = 1;
+    async->error = error;
+    pthread_cond_signal(&async->cond);
+    pthread_mutex_unlock(&async->lock);
+}
+
+static void *i2s_async_worker(void *arg)
+{
+    i2s_handle_t handle = arg;
+    struct i2s_async *async = &handle->async;
+    struct pollfd pfd[2];
+    int ret;
+    
+    /* Prime the playback ring before the hardware starts pulling */
+    ret = i2s_async_service_all(handle);
+    if (!ret && i2s_start(handle) < 0)
+        ret = -errno;
+    if (ret < 0) {
+        i2s_async_report(async, -ret);
+        return NULL;
+    }
+    i2s_async_report(async, 0);
+    if (ret)
+        return NULL;
+    
+    pfd[0].fd = handle->fd;
+    pfd[0].events = (handle->mode != O_RDONLY ? POLLOUT : 0) |
+                    (handle->mode != O_WRONLY ? POLLIN : 0);
+    pfd[1].fd = async->wake_fd;
+    pfd[1].events = POLLIN;
+    
+    for (;;) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            async->error = errno;
+            break;
+        }
+        
+        if (pfd[1].revents)
+            break;
+        
+        ret = i2s_async_service_all(handle);
+        if (ret == -EPIPE) {
+            /* Missed a deadline: resync and carry on */
+            if (i2s_recover(handle) < 0) {
+                async->error = errno;
+                break;
+            }
+            continue;
+        }
+        if (ret) {
+            async->error = ret < 0 ? -ret : 0;
+            break;
+        }
+        
+        /* Stopped by someone else */
+        if ((pfd[0].revents & POLLERR) &&
+            i2s_get_status(handle) == I2S_STATUS_STOPPED) {
+            async->error = EINVAL;
+            break;
+        }
+    }
+    
+    return NULL;
+}
+
+/*
+ * Start the stream and a worker thread that calls callback once per
+ * period. The worker sleeps in poll() on the device, so one wakeup per
+ * period (avail_min) is set up here.
+ */
+int i2s_stream_start_async(i2s_handle_t handle, i2s_callback_t callback,
+                           void *userdata)
+{
+    struct i2s_async *async;
+    struct sched_param sp;
+    pthread_attr_t attr;
+    size_t period_bytes;
+    cpu_set_t cpus;
+    int ret;
+    
+    if (!handle || !callback) {
+        return -1;
+    }
+    
+    async = &handle->async;
+    if (async->active) {
+        snprintf(handle->error_msg, sizeof(handle->error_msg),
+                 "Async stream already running");
+        return -1;
+    }
+    
+    period_bytes = (size_t)handle->params.period_frames * handle->params.channels *
+        (handle->params.format == I2S_FORMAT_S16_LE ? 2 : 4);
+    if (!period_bytes || i2s_set_avail_min(handle, period_bytes) < 0) {
+        return -1;
+    }
+    
+    if (async->config.lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        snprintf(handle->error_msg, sizeof(handle->error_msg),
+                 "Failed to lock memory: %s", strerror(errno));
+        return -1;
+    }
+    
+    async->wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (async->wake_fd < 0) {
+        snprintf(handle->error_msg, sizeof(handle->error_msg),
+                 "Failed to create eventfd: %s", strerror(errno));
+        return -1;
+    }
+    
+    async->callback = callback;
+    async->userdata = userdata;
+    async->started = 0;
+    async->error = 0;
+    pthread_mutex_init(&async->lock, NULL);
+    pthread_cond_init(&async->cond, NULL);
+    
+    pthread_attr_init(&attr);
+    if (async->config.priority > 0) {
+        sp.sched_priority = async->config.priority;
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &sp);
+    }
+    if (async->config.cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(async->config.cpu, &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+    
+    ret = pthread_create(&async->thread, &attr, i2s_async_worker, handle);
+    pthread_attr_destroy(&attr);
+    if (ret) {
+        snprintf(handle->error_msg, sizeof(handle->error_msg),
+                 "Failed to create worker thread: %s", strerror(ret));
+        goto err;
+    }
+    
+    pthread_mutex_lock(&async->lock);
+    while (!async->started)
+        pthread_cond_wait(&async->cond, &async->lock);
+    ret = async->error;
+    pthread_mutex_unlock(&async->lock);
+    
+    if (ret) {
+        pthread_join(async->thread, NULL);
+        snprintf(handle->error_msg, sizeof(handle->error_msg),
+                 "Failed to start async stream: %s", strerror(ret));
+        goto err;
+    }
+    
+    async->active = 1;
+    return 0;
+    
+err:
+    pthread_cond_destroy(&async->cond);
+    pthread_mutex_destroy(&async->lock);
+    close(async->wake_fd);
+    return -1;
+}
+
+/* Stop the worker and the stream; fails if the worker had stopped on an error */
+int i2s_stream_stop_async(i2s_handle_t handle)
+{
+    struct i2s_async *async;
+    uint64_t one = 1;
+    
+    if (!handle || !handle->async.active) {
+        return -1;
+    }
+    
+    async = &handle->async;
+    while (write(async->wake_fd, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+    pthread_join(async->thread, NULL);
+    
+    pthread_cond_destroy(&async->cond);
+    pthread_mutex_destroy(&async->lock);
+    close(async->wake_fd);
+    async->active = 0;
+    
+    i2s_stop(handle);
+    
+    if (async->error) {
+        snprintf(handle->error_msg, sizeof(handle->error_msg),
+                 "Async stream failed: %s", strerror(async->error));
+        return -1;
+    }
+    return 0;
+}
+
+/* Get last error message */
+const char *i2s_get_error(i2s_handle_t handle)
+{
+    if (!handle) {
+        return "Invalid handle";
+    }
+    
+    return handle->error_msg;
+}
+
+/* Connect to daemon */
+int i2s_daemon_connect(void)
+{
+    int sock;
+    struct sockaddr_un addr;
+    
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
     if (sock < 0) {
         return -1;
     }
@@ -314,27 +1930,465 @@ void i2s_daemon_disconnect(int sock)
     }
 }
 
+/* Write all of buf to the daemon */
+static int i2s_daemon_write_all(int sock, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+    
+    while (len) {
+        n = send(sock, p, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    
+    return 0;
+}
+
+/* Read exactly len bytes from the daemon */
+static int i2s_daemon_read_all(int sock, void *buf, size_t len)
+{
+    char *p = buf;
+    ssize_t n;
+    
+    while (len) {
+        n = read(sock, p, len);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n == 0)
+                errno = EPIPE;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    
+    return 0;
+}
+
+/* Encode one request: header plus its argument */
+static size_t i2s_daemon_put_request(unsigned char *buf, uint32_t id, int cmd,
+                                     int param)
+{
+    struct i2sd_hdr hdr;
+    struct i2sd_attr attr;
+    int64_t value = param;
+    
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = I2SD_MAGIC;
+    hdr.version = I2SD_VERSION;
+    hdr.cmd = (uint16_t)cmd;
+    hdr.length = sizeof(attr) + sizeof(value);
+    hdr.id = id;
+    
+    attr.type = I2S_DAEMON_ATTR_PARAM;
+    attr.length = sizeof(value);
+    
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + sizeof(hdr), &attr, sizeof(attr));
+    memcpy(buf + sizeof(hdr) + sizeof(attr), &value, sizeof(value));
+    return I2SD_REQUEST_SIZE;
+}
+
+/*
+ * Read the reply to request id into req. With fds, also take the fds
+ * passed along with it, or -1 when there were none.
+ */
+static int i2s_daemon_read_reply(int sock, uint32_t id,
+                                 i2s_daemon_request_t *req, int fds[2])
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    unsigned char payload[I2SD_MAX_PAYLOAD];
+    const unsigned char *p, *end;
+    struct i2sd_hdr hdr;
+    struct i2sd_attr attr;
+    struct iovec iov;
+    struct msghdr mh;
+    struct cmsghdr *cmsg;
+    
+    if (fds) {
+        /* The fds arrive with the first byte of the reply */
+        fds[0] = fds[1] = -1;
+        iov.iov_base = &hdr;
+        iov.iov_len = sizeof(hdr);
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = control.buf;
+        mh.msg_controllen = sizeof(control.buf);
+        
+        if (recvmsg(sock, &mh, MSG_CMSG_CLOEXEC | MSG_WAITALL) != sizeof(hdr)) {
+            return -1;
+        }
+        
+        cmsg = CMSG_FIRSTHDR(&mh);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(2 * sizeof(int)))
+            memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+    } else if (i2s_daemon_read_all(sock, &hdr, sizeof(hdr)) < 0) {
+        return -1;
+    }
+    
+    if (hdr.magic != I2SD_MAGIC || !(hdr.flags & I2SD_FLAG_REPLY) ||
+        hdr.id != id || hdr.length > sizeof(payload) ||
+        i2s_daemon_read_all(sock, payload, hdr.length) < 0) {
+        if (fds && fds[0] >= 0) {
+            close(fds[0]);
+            close(fds[1]);
+        }
+        errno = EPROTO;
+        return -1;
+    }
+    
+    req->status = hdr.status;
+    req->present = 0;
+    
+    /* Skip what this library does not know, for newer daemons */
+    p = payload;
+    end = payload + hdr.length;
+    while (end - p >= (ptrdiff_t)sizeof(attr)) {
+        memcpy(&attr, p, sizeof(attr));
+        p += sizeof(attr);
+        if (attr.length > end - p)
+            break;
+        if (attr.type < I2S_DAEMON_ATTR_MAX && attr.length == sizeof(uint64_t)) {
+            memcpy(&req->values[attr.type], p, sizeof(uint64_t));
+            req->present |= 1u << attr.type;
+        }
+        p += (attr.length + 3) & ~3u;
+    }
+    
+    return 0;
+}
+
 /* Send command to daemon */
 int i2s_daemon_send_command(int sock, int cmd, int param)
 {
-    daemon_msg_t msg;
-    daemon_response_t resp;
+    i2s_daemon_request_t req;
     
-    if (sock < 0) {
+    memset(&req, 0, sizeof(req));
+    req.cmd = cmd;
+    req.param = param;
+    
+    if (i2s_daemon_batch(sock, &req, 1) < 0) {
+        return -1;
+    }
+    
+    return req.status;
+}
+
+/*
+ * Pipeline many commands: each chunk of requests goes out in one write
+ * and its replies are read back in order.
+ */
+int i2s_daemon_batch(int sock, i2s_daemon_request_t *requests, size_t count)
+{
+    unsigned char buf[I2SD_BATCH_CHUNK * I2SD_REQUEST_SIZE];
+    size_t done, n, i, len;
+    
+    if (sock < 0 || (count && !requests)) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    for (done = 0; done < count; done += n) {
+        n = count - done;
+        if (n > I2SD_BATCH_CHUNK)
+            n = I2SD_BATCH_CHUNK;
+        
+        len = 0;
+        for (i = 0; i < n; i++) {
+            /* Stream fds need i2s_daemon_stream_open() to receive them */
+            if (requests[done + i].cmd == I2S_DAEMON_OPEN_STREAM) {
+                errno = EINVAL;
+                return -1;
+            }
+            len += i2s_daemon_put_request(buf + len, (uint32_t)(done + i),
+                                          requests[done + i].cmd,
+                                          requests[done + i].param);
+        }
+        
+        if (i2s_daemon_write_all(sock, buf, len) < 0) {
+            return -1;
+        }
+        
+        for (i = 0; i < n; i++) {
+            if (i2s_daemon_read_reply(sock, (uint32_t)(done + i),
+                                      &requests[done + i], NULL) < 0)
+                return -1;
+        }
+    }
+    
+    return 0;
+}
+
+/* Open a mixer stream at the mixer's own rate */
+i2s_daemon_stream_t i2s_daemon_stream_open(void)
+{
+    return i2s_daemon_stream_open_rate(0);
+}
+
+/*
+ * Get a playback ring from the daemon's mixer; sample_rate 0 plays at the
+ * mixer's rate. The connection stays open for the life of the stream;
+ * the ring arrives as a memfd over it.
+ */
+i2s_daemon_stream_t i2s_daemon_stream_open_rate(int sample_rate)
+{
+    unsigned char buf[I2SD_REQUEST_SIZE];
+    i2s_daemon_request_t reply;
+    i2s_daemon_stream_t stream;
+    struct stat st;
+    int fds[2];
+    void *map;
+    
+    stream = malloc(sizeof(*stream));
+    if (!stream) {
+        return NULL;
+    }
+    
+    stream->sock = i2s_daemon_connect();
+    if (stream->sock < 0) {
+        free(stream);
+        return NULL;
+    }
+    
+    i2s_daemon_put_request(buf, 0, I2S_DAEMON_OPEN_STREAM, sample_rate);
+    if (i2s_daemon_write_all(stream->sock, buf, sizeof(buf)) < 0 ||
+        i2s_daemon_read_reply(stream->sock, 0, &reply, fds) < 0)
+        goto err_sock;
+    
+    if (reply.status < 0 || fds[0] < 0) {
+        if (fds[0] >= 0) {
+            close(fds[0]);
+            close(fds[1]);
+        }
+        errno = reply.status < 0 ? -reply.status : EPROTO;
+        goto err_sock;
+    }
+    
+    stream->wake_fd = fds[1];
+    
+    if (fstat(fds[0], &st) < 0 ||
+        (size_t)st.st_size < sizeof(struct i2s_mix_ring)) {
+        close(fds[0]);
+        goto err_wake;
+    }
+    
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+               fds[0], 0);
+    close(fds[0]);
+    if (map == MAP_FAILED)
+        goto err_wake;
+    
+    stream->ring = map;
+    stream->map_len = (size_t)st.st_size;
+    
+    if (__atomic_load_n(&stream->ring->magic, __ATOMIC_ACQUIRE) !=
+        I2S_MIX_RING_MAGIC ||
+        sizeof(struct i2s_mix_ring) + stream->ring->size > stream->map_len) {
+        i2s_daemon_stream_close(stream);
+        errno = EPROTO;
+        return NULL;
+    }
+    
+    return stream;
+    
+err_wake:
+    close(stream->wake_fd);
+err_sock:
+    close(stream->sock);
+    free(stream);
+    return NULL;
+}
+
+/* Format the mixer expects */
+int i2s_daemon_stream_get_config(i2s_daemon_stream_t stream,
+                                 i2s_config_t *config)
+{
+    if (!stream || !config) {
         return -1;
     }
     
-    memset(&msg, 0, sizeof(msg));
-    msg.cmd = cmd;
-    msg.param = param;
+    config->sample_rate = (int)stream->ring->rate;
+    config->bit_depth = 16;
+    config->channels = (int)stream->ring->channels;
+    return 0;
+}
+
+/*
+ * Sleep until the mixer frees space. wake tells the mixer to signal the
+ * eventfd; setting it before rechecking tail means a period consumed in
+ * between is never missed. A hangup on the socket means the daemon died.
+ */
+static int i2s_daemon_stream_wait(i2s_daemon_stream_t stream, uint32_t head,
+                                  size_t frame_bytes)
+{
+    struct i2s_mix_ring *ring = stream->ring;
+    struct pollfd pfd[2];
+    uint64_t count;
+    uint32_t tail;
+    
+    __atomic_store_n(&ring->wake, 1, __ATOMIC_SEQ_CST);
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+    if (ring->size - (head - tail) >= frame_bytes) {
+        return 0;
+    }
+    
+    pfd[0].fd = stream->wake_fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = stream->sock;
+    pfd[1].events = POLLIN;
+    
+    if (poll(pfd, 2, -1) < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
     
-    if (write(sock, &msg, sizeof(msg)) != sizeof(msg)) {
+    if (pfd[1].revents & (POLLHUP | POLLERR)) {
+        errno = EPIPE;
         return -1;
     }
     
-    if (read(sock, &resp, sizeof(resp)) != sizeof(resp)) {
+    if (pfd[0].revents & POLLIN) {
+        if (read(stream->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+            return -1;
+    }
+    
+    return 0;
+}
+
+/* Queue audio for the mixer, sleeping on the wake eventfd while full */
+ssize_t i2s_daemon_stream_write(i2s_daemon_stream_t stream,
+                                const void *buffer, size_t size)
+{
+    struct i2s_mix_ring *ring;
+    const char *p = buffer;
+    uint32_t head, tail, space, off, chunk;
+    size_t frame_bytes, done = 0;
+    
+    if (!stream || !buffer) {
         return -1;
     }
     
-    return resp.status;
+    ring = stream->ring;
+    frame_bytes = ring->channels * sizeof(int16_t);
+    size -= size % frame_bytes;
+    
+    while (done < size) {
+        head = ring->head;
+        tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        space = ring->size - (head - tail);
+        space -= space % frame_bytes;
+        if (!space) {
+            if (i2s_daemon_stream_wait(stream, head, frame_bytes) < 0)
+                return done ? (ssize_t)done : -1;
+            continue;
+        }
+        
+        if (space > size - done)
+            space = (uint32_t)(size - done);
+        
+        off = head & (ring->size - 1);
+        chunk = ring->size - off;
+        if (chunk > space)
+            chunk = space;
+        memcpy(ring->data + off, p + done, chunk);
+        memcpy(ring->data, p + done + chunk, space - chunk);
+        
+        /* Publish the data before the new head */
+        __atomic_store_n(&ring->head, head + space, __ATOMIC_RELEASE);
+        done += space;
+    }
+    
+    return (ssize_t)done;
+}
+
+/* Give the ring back by hanging up; whatever is still queued is dropped */
+void i2s_daemon_stream_close(i2s_daemon_stream_t stream)
+{
+    if (!stream) {
+        return;
+    }
+    
+    munmap(stream->ring, stream->map_len);
+    close(stream->wake_fd);
+    close(stream->sock);
+    free(stream);
+}
+
+/* Map the daemon's statistics page read-only */
+const i2s_daemon_stats_t *i2s_daemon_stats_open(void)
+{
+    i2s_daemon_stats_t *stats;
+    int fd;
+    
+    fd = shm_open(I2S_DAEMON_STATS_PATH, O_RDONLY, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    
+    stats = mmap(NULL, sizeof(*stats), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (stats == MAP_FAILED) {
+        return NULL;
+    }
+    
+    if (__atomic_load_n(&stats->version, __ATOMIC_ACQUIRE) !=
+        I2S_DAEMON_STATS_VERSION) {
+        munmap(stats, sizeof(*stats));
+        errno = EPROTO;
+        return NULL;
+    }
+    
+    return stats;
+}
+
+void i2s_daemon_stats_close(const i2s_daemon_stats_t *stats)
+{
+    if (stats) {
+        munmap((void *)stats, sizeof(*stats));
+    }
+}
+
+uint64_t i2s_daemon_stats_percentile(const uint64_t *buckets, double fraction)
+{
+    uint64_t counts[I2S_STATS_BUCKETS];
+    uint64_t total = 0, rank, seen = 0;
+    int i;
+    
+    if (!buckets) {
+        return 0;
+    }
+    
+    /* Copy first, the writer keeps counting while we look */
+    for (i = 0; i < I2S_STATS_BUCKETS; i++) {
+        counts[i] = __atomic_load_n(&buckets[i], __ATOMIC_RELAXED);
+        total += counts[i];
+    }
+    
+    if (!total) {
+        return 0;
+    }
+    
+    rank = (uint64_t)(fraction * (double)total);
+    if (rank >= total)
+        rank = total - 1;
+    
+    for (i = 0; i < I2S_STATS_BUCKETS - 1; i++) {
+        seen += counts[i];
+        if (seen > rank)
+            return (uint64_t)1 << i;
+    }
+    
+    return UINT64_MAX;
 }
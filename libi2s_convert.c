@@ -0,0 +1,712 @@
+/*
+ * libi2s_convert.c - Sample format conversion for libi2s
+ *
+ * Converts between float32 and the integer sample formats block by block.
+ * The float paths use NEON, SSE2 or AVX2 kernels, picked once from the
+ * CPU features at run time; everything else is plain C.
+ */
+
+#include "libi2s.h"
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define I2S_CONVERT_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__)
+#define I2S_CONVERT_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* Samples per pass through the on-stack intermediate buffers */
+#define I2S_CONVERT_BLOCK 256
+
+/* Largest float below 2^31; 2^31 itself does not fit an int32_t */
+#define I2S_S32_MAX_FLOAT 2147483520.0f
+
+/* The kernels that have vector versions */
+struct i2s_convert_ops {
+    const char *name;
+    void (*f32_to_i32)(const float *in, const float *noise, int32_t *out,
+                       size_t n, float scale, float hi, int saturate);
+    void (*i32_to_f32)(const int32_t *in, float *out, size_t n, float scale);
+    void (*i32_to_s16)(const int32_t *in, int16_t *out, size_t n);
+    void (*s16_to_i32)(const int16_t *in, int32_t *out, size_t n);
+};
+
+/* Scalar kernels, also used for the tails of the vector ones */
+static void f32_to_i32_scalar(const float *in, const float *noise,
+                              int32_t *out, size_t n, float scale, float hi,
+                              int saturate)
+{
+    size_t i;
+    
+    /* Converting an out-of-range float is undefined in C, so this path
+     * clamps whether or not saturation was asked for */
+    (void)saturate;
+    
+    for (i = 0; i < n; i++) {
+        float x = in[i] * scale;
+        
+        if (noise)
+            x += noise[i];
+        if (!(x >= -scale))
+            x = -scale;
+        else if (x > hi)
+            x = hi;
+        out[i] = (int32_t)lrintf(x);
+    }
+}
+
+static void i32_to_f32_scalar(const int32_t *in, float *out, size_t n,
+                              float scale)
+{
+    size_t i;
+    
+    for (i = 0; i < n; i++)
+        out[i] = (float)in[i] * scale;
+}
+
+static void i32_to_s16_scalar(const int32_t *in, int16_t *out, size_t n)
+{
+    size_t i;
+    
+    for (i = 0; i < n; i++) {
+        int32_t v = in[i];
+        
+        out[i] = v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : v;
+    }
+}
+
+static void s16_to_i32_scalar(const int16_t *in, int32_t *out, size_t n)
+{
+    size_t i;
+    
+    for (i = 0; i < n; i++)
+        out[i] = in[i];
+}
+
+static const struct i2s_convert_ops i2s_convert_scalar = {
+    .name = "scalar",
+    .f32_to_i32 = f32_to_i32_scalar,
+    .i32_to_f32 = i32_to_f32_scalar,
+    .i32_to_s16 = i32_to_s16_scalar,
+    .s16_to_i32 = s16_to_i32_scalar,
+};
+
+#ifdef I2S_CONVERT_X86
+/* SSE2: baseline on x86-64, checked at run time on 32-bit x86 */
+__attribute__((target("sse2")))
+static void f32_to_i32_sse2(const float *in, const float *noise, int32_t *out,
+                            size_t n, float scale, float hi, int saturate)
+{
+    __m128 vscale = _mm_set1_ps(scale);
+    __m128 vlo = _mm_set1_ps(-scale);
+    __m128 vhi = _mm_set1_ps(hi);
+    size_t i = 0;
+    
+    for (; i + 4 <= n; i += 4) {
+        __m128 x = _mm_mul_ps(_mm_loadu_ps(in + i), vscale);
+        
+        if (noise)
+            x = _mm_add_ps(x, _mm_loadu_ps(noise + i));
+        if (saturate)
+            x = _mm_max_ps(x, vlo);
+        /* 1.0 is valid input but one code past the top: always clamp */
+        x = _mm_min_ps(x, vhi);
+        _mm_storeu_si128((__m128i *)(out + i), _mm_cvtps_epi32(x));
+    }
+    
+    f32_to_i32_scalar(in + i, noise ? noise + i : NULL, out + i, n - i,
+                      scale, hi, saturate);
+}
+
+__attribute__((target("sse2")))
+static void i32_to_f32_sse2(const int32_t *in, float *out, size_t n,
+                            float scale)
+{
+    __m128 vscale = _mm_set1_ps(scale);
+    size_t i = 0;
+    
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+        
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(v), vscale));
+    }
+    
+    i32_to_f32_scalar(in + i, out + i, n - i, scale);
+}
+
+__attribute__((target("sse2")))
+static void i32_to_s16_sse2(const int32_t *in, int16_t *out, size_t n)
+{
+    size_t i = 0;
+    
+    for (; i + 8 <= n; i += 8) {
+        __m128i lo = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i hi = _mm_loadu_si128((const __m128i *)(in + i + 4));
+        
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(lo, hi));
+    }
+    
+    i32_to_s16_scalar(in + i, out + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void s16_to_i32_sse2(const int16_t *in, int32_t *out, size_t n)
+{
+    size_t i = 0;
+    
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+        
+        /* Each sample lands in the top half of a lane, then is shifted
+         * back down with its sign */
+        _mm_storeu_si128((__m128i *)(out + i),
+                         _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+        _mm_storeu_si128((__m128i *)(out + i + 4),
+                         _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16));
+    }
+    
+    s16_to_i32_scalar(in + i, out + i, n - i);
+}
+
+static const struct i2s_convert_ops i2s_convert_sse2 = {
+    .name = "sse2",
+    .f32_to_i32 = f32_to_i32_sse2,
+    .i32_to_f32 = i32_to_f32_sse2,
+    .i32_to_s16 = i32_to_s16_sse2,
+    .s16_to_i32 = s16_to_i32_sse2,
+};
+
+__attribute__((target("avx2")))
+static void f32_to_i32_avx2(const float *in, const float *noise, int32_t *out,
+                            size_t n, float scale, float hi, int saturate)
+{
+    __m256 vscale = _mm256_set1_ps(scale);
+    __m256 vlo = _mm256_set1_ps(-scale);
+    __m256 vhi = _mm256_set1_ps(hi);
+    size_t i = 0;
+    
+    for (; i + 8 <= n; i += 8) {
+        __m256 x = _mm256_mul_ps(_mm256_loadu_ps(in + i), vscale);
+        
+        if (noise)
+            x = _mm256_add_ps(x, _mm256_loadu_ps(noise + i));
+        if (saturate)
+            x = _mm256_max_ps(x, vlo);
+        /* 1.0 is valid input but one code past the top: always clamp */
+        x = _mm256_min_ps(x, vhi);
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_cvtps_epi32(x));
+    }
+    
+    f32_to_i32_scalar(in + i, noise ? noise + i : NULL, out + i, n - i,
+                      scale, hi, saturate);
+}
+
+__attribute__((target("avx2")))
+static void i32_to_f32_avx2(const int32_t *in, float *out, size_t n,
+                            float scale)
+{
+    __m256 vscale = _mm256_set1_ps(scale);
+    size_t i = 0;
+    
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+        
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), vscale));
+    }
+    
+    i32_to_f32_scalar(in + i, out + i, n - i, scale);
+}
+
+__attribute__((target("avx2")))
+static void i32_to_s16_avx2(const int32_t *in, int16_t *out, size_t n)
+{
+    size_t i = 0;
+    
+    for (; i + 16 <= n; i += 16) {
+        __m256i lo = _mm256_loadu_si256((const __m256i *)(in + i));
+        __m256i hi = _mm256_loadu_si256((const __m256i *)(in + i + 8));
+        
+        /* packs works per 128-bit lane; put the quadwords back in order */
+        __m256i v = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xd8);
+        
+        _mm256_storeu_si256((__m256i *)(out + i), v);
+    }
+    
+    i32_to_s16_scalar(in + i, out + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void s16_to_i32_avx2(const int16_t *in, int32_t *out, size_t n)
+{
+    size_t i = 0;
+    
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+        
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_cvtepi16_epi32(v));
+    }
+    
+    s16_to_i32_scalar(in + i, out + i, n - i);
+}
+
+static const struct i2s_convert_ops i2s_convert_avx2 = {
+    .name = "avx2",
+    .f32_to_i32 = f32_to_i32_avx2,
+    .i32_to_f32 = i32_to_f32_avx2,
+    .i32_to_s16 = i32_to_s16_avx2,
+    .s16_to_i32 = s16_to_i32_avx2,
+};
+#endif /* I2S_CONVERT_X86 */
+
+#ifdef I2S_CONVERT_NEON
+/* NEON is part of AArch64; its float conversions also saturate */
+static void f32_to_i32_neon(const float *in, const float *noise, int32_t *out,
+                            size_t n, float scale, float hi, int saturate)
+{
+    float32x4_t vlo = vdupq_n_f32(-scale);
+    float32x4_t vhi = vdupq_n_f32(hi);
+    size_t i = 0;
+    
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t x = vmulq_n_f32(vld1q_f32(in + i), scale);
+        
+        if (noise)
+            x = vaddq_f32(x, vld1q_f32(noise + i));
+        if (saturate)
+            x = vmaxq_f32(x, vlo);
+        /* 1.0 is valid input but one code past the top: always clamp */
+        x = vminq_f32(x, vhi);
+        vst1q_s32(out + i, vcvtnq_s32_f32(x));
+    }
+    
+    f32_to_i32_scalar(in + i, noise ? noise + i : NULL, out + i, n - i,
+                      scale, hi, saturate);
+}
+
+static void i32_to_f32_neon(const int32_t *in, float *out, size_t n,
+                            float scale)
+{
+    size_t i = 0;
+    
+    for (; i + 4 <= n; i += 4)
+        vst1q_f32(out + i, vmulq_n_f32(vcvtq_f32_s32(vld1q_s32(in + i)), scale));
+    
+    i32_to_f32_scalar(in + i, out + i, n - i, scale);
+}
+
+static void i32_to_s16_neon(const int32_t *in, int16_t *out, size_t n)
+{
+    size_t i = 0;
+    
+    for (; i + 8 <= n; i += 8)
+        vst1q_s16(out + i, vcombine_s16(vqmovn_s32(vld1q_s32(in + i)),
+                                        vqmovn_s32(vld1q_s32(in + i + 4))));
+    
+    i32_to_s16_scalar(in + i, out + i, n - i);
+}
+
+static void s16_to_i32_neon(const int16_t *in, int32_t *out, size_t n)
+{
+    size_t i = 0;
+    
+    for (; i + 8 <= n; i += 8) {
+        int16x8_t v = vld1q_s16(in + i);
+        
+        vst1q_s32(out + i, vmovl_s16(vget_low_s16(v)));
+        vst1q_s32(out + i + 4, vmovl_high_s16(v));
+    }
+    
+    s16_to_i32_scalar(in + i, out + i, n - i);
+}
+
+static const struct i2s_convert_ops i2s_convert_neon = {
+    .name = "neon",
+    .f32_to_i32 = f32_to_i32_neon,
+    .i32_to_f32 = i32_to_f32_neon,
+    .i32_to_s16 = i32_to_s16_neon,
+    .s16_to_i32 = s16_to_i32_neon,
+};
+#endif /* I2S_CONVERT_NEON */
+
+/* Pick the widest kernels the CPU runs, once per process */
+static const struct i2s_convert_ops *i2s_convert_ops_get(void)
+{
+    static const struct i2s_convert_ops *selected;
+    const struct i2s_convert_ops *ops;
+    
+    ops = __atomic_load_n(&selected, __ATOMIC_ACQUIRE);
+    if (ops)
+        return ops;
+    
+    ops = &i2s_convert_scalar;
+#if defined(I2S_CONVERT_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        ops = &i2s_convert_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        ops = &i2s_convert_sse2;
+#elif defined(I2S_CONVERT_NEON)
+    ops = &i2s_convert_neon;
+#endif
+    
+    /* Racing callers pick the same table, so a plain store is enough */
+    __atomic_store_n(&selected, ops, __ATOMIC_RELEASE);
+    return ops;
+}
+
+/* Name of the kernel set in use, for diagnostics and benchmarks */
+const char *i2s_convert_backend(void)
+{
+    return i2s_convert_ops_get()->name;
+}
+
+/* Bytes per sample */
+size_t i2s_sample_size(i2s_sample_t format)
+{
+    switch (format) {
+    case I2S_SAMPLE_S16:
+        return 2;
+    case I2S_SAMPLE_S24_3LE:
+        return 3;
+    case I2S_SAMPLE_FLOAT32:
+    case I2S_SAMPLE_S24_LE:
+    case I2S_SAMPLE_S32:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+/* Sample type of a hardware format */
+i2s_sample_t i2s_format_sample(i2s_format_t format)
+{
+    switch (format) {
+    case I2S_FORMAT_S16_LE:
+        return I2S_SAMPLE_S16;
+    case I2S_FORMAT_S24_LE:
+        return I2S_SAMPLE_S24_LE;
+    default:
+        return I2S_SAMPLE_S32;
+    }
+}
+
+static int i2s_sample_bits(i2s_sample_t format)
+{
+    switch (format) {
+    case I2S_SAMPLE_S16:
+        return 16;
+    case I2S_SAMPLE_S24_3LE:
+    case I2S_SAMPLE_S24_LE:
+        return 24;
+    default:
+        return 32;
+    }
+}
+
+/* Per-thread generator for the dither noise; quality needs are modest */
+static __thread uint32_t i2s_dither_state = 0x9e3779b9u;
+
+static uint32_t i2s_dither_next(void)
+{
+    uint32_t x = i2s_dither_state;
+    
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    i2s_dither_state = x;
+    return x;
+}
+
+/* Triangular noise of +-1 LSB, in LSB units */
+static void i2s_dither_fill(float *noise, size_t n)
+{
+    const float unit = 1.0f / 16777216.0f;
+    size_t i;
+    
+    for (i = 0; i < n; i++)
+        noise[i] = (float)(i2s_dither_next() >> 8) * unit -
+                   (float)(i2s_dither_next() >> 8) * unit;
+}
+
+/* Unpack integer samples to sign-extended int32 values */
+static void i2s_decode(const struct i2s_convert_ops *ops, const void *src,
+                       i2s_sample_t format, int32_t *out, size_t n)
+{
+    const uint8_t *p = src;
+    size_t i;
+    
+    switch (format) {
+    case I2S_SAMPLE_S16:
+        ops->s16_to_i32(src, out, n);
+        break;
+    case I2S_SAMPLE_S24_3LE:
+        for (i = 0; i < n; i++, p += 3)
+            out[i] = (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 |
+                               (uint32_t)p[2] << 24) >> 8;
+        break;
+    case I2S_SAMPLE_S24_LE:
+        /* Ignore whatever the container's top byte holds */
+        for (i = 0; i < n; i++)
+            out[i] = (int32_t)((uint32_t)((const int32_t *)src)[i] << 8) >> 8;
+        break;
+    default:
+        memcpy(out, src, n * sizeof(*out));
+        break;
+    }
+}
+
+/* Pack int32 values, already in the format's range, as samples */
+static void i2s_encode(const struct i2s_convert_ops *ops, const int32_t *in,
+                       void *dst, i2s_sample_t format, size_t n)
+{
+    uint8_t *p = dst;
+    size_t i;
+    
+    switch (format) {
+    case I2S_SAMPLE_S16:
+        ops->i32_to_s16(in, dst, n);
+        break;
+    case I2S_SAMPLE_S24_3LE:
+        for (i = 0; i < n; i++, p += 3) {
+            p[0] = (uint8_t)in[i];
+            p[1] = (uint8_t)(in[i] >> 8);
+            p[2] = (uint8_t)(in[i] >> 16);
+        }
+        break;
+    default:
+        memcpy(dst, in, n * sizeof(*in));
+        break;
+    }
+}
+
+/*
+ * Integer to integer: widening shifts up, narrowing shifts down, with
+ * rounding and triangular dither first if asked for.
+ */
+static void i2s_requantize(int32_t *v, size_t n, int src_bits, int dst_bits,
+                           unsigned int flags)
+{
+    int shift = src_bits - dst_bits;
+    int64_t lo = -((int64_t)1 << (src_bits - 1));
+    int64_t hi = ((int64_t)1 << (src_bits - 1)) - 1;
+    uint32_t lsb_mask;
+    size_t i;
+    
+    if (shift < 0) {
+        for (i = 0; i < n; i++)
+            v[i] = (int32_t)((uint32_t)v[i] << -shift);
+        return;
+    }
+    
+    if (!shift)
+        return;
+    
+    if (!(flags & I2S_CONVERT_DITHER)) {
+        for (i = 0; i < n; i++)
+            v[i] >>= shift;
+        return;
+    }
+    
+    lsb_mask = ((uint32_t)1 << shift) - 1;
+    for (i = 0; i < n; i++) {
+        int64_t x = (int64_t)v[i] + ((int64_t)1 << (shift - 1)) +
+                    (int64_t)(i2s_dither_next() & lsb_mask) -
+                    (int64_t)(i2s_dither_next() & lsb_mask);
+        
+        x = x < lo ? lo : x > hi ? hi : x;
+        v[i] = (int32_t)(x >> shift);
+    }
+}
+
+/*
+ * Convert samples between formats. Converting from float is always
+ * rounded to nearest; I2S_CONVERT_DITHER adds triangular noise first and
+ * implies saturation, since the noise can push a full-scale sample over.
+ */
+int i2s_convert(void *dst, i2s_sample_t dst_format,
+                const void *src, i2s_sample_t src_format,
+                size_t samples, unsigned int flags)
+{
+    const struct i2s_convert_ops *ops = i2s_convert_ops_get();
+    size_t src_size = i2s_sample_size(src_format);
+    size_t dst_size = i2s_sample_size(dst_format);
+    int dst_bits = i2s_sample_bits(dst_format);
+    int src_bits = i2s_sample_bits(src_format);
+    int saturate = !!(flags & (I2S_CONVERT_SATURATE | I2S_CONVERT_DITHER));
+    int32_t tmp[I2S_CONVERT_BLOCK];
+    float noise[I2S_CONVERT_BLOCK];
+    size_t done, n;
+    
+    if (!dst || !src || !src_size || !dst_size) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    if (src_format == dst_format) {
+        memmove(dst, src, samples * src_size);
+        return 0;
+    }
+    
+    for (done = 0; done < samples; done += n) {
+        const char *s = (const char *)src + done * src_size;
+        char *d = (char *)dst + done * dst_size;
+        
+        n = samples - done;
+        if (n > I2S_CONVERT_BLOCK)
+            n = I2S_CONVERT_BLOCK;
+        
+        if (src_format == I2S_SAMPLE_FLOAT32) {
+            float scale = (float)((int64_t)1 << (dst_bits - 1));
+            float hi = dst_bits == 32 ? I2S_S32_MAX_FLOAT : scale - 1.0f;
+            /* 32-bit containers take the result directly */
+            int direct = (dst_size == 4);
+            
+            if (flags & I2S_CONVERT_DITHER)
+                i2s_dither_fill(noise, n);
+            ops->f32_to_i32((const float *)s,
+                            (flags & I2S_CONVERT_DITHER) ? noise : NULL,
+                            direct ? (int32_t *)d : tmp, n, scale, hi, saturate);
+            if (!direct)
+                i2s_encode(ops, tmp, d, dst_format, n);
+        } else if (dst_format == I2S_SAMPLE_FLOAT32) {
+            const int32_t *in = tmp;
+            
+            if (src_format == I2S_SAMPLE_S32)
+                in = (const int32_t *)s;
+            else
+                i2s_decode(ops, s, src_format, tmp, n);
+            ops->i32_to_f32(in, (float *)d, n,
+                            1.0f / (float)((int64_t)1 << (src_bits - 1)));
+        } else {
+            i2s_decode(ops, s, src_format, tmp, n);
+            i2s_requantize(tmp, n, src_bits, dst_bits, flags);
+            i2s_encode(ops, tmp, d, dst_format, n);
+        }
+    }
+    
+    return 0;
+}
+
+/* Copy n samples of size bytes between a strided area and a packed block */
+static void i2s_gather(uint8_t *dst, const uint8_t *src, size_t step,
+                       size_t size, size_t n)
+{
+    size_t i;
+    
+    switch (size) {
+    case 2:
+        for (i = 0; i < n; i++, src += step)
+            memcpy(dst + i * 2, src, 2);
+        break;
+    case 4:
+        for (i = 0; i < n; i++, src += step)
+            memcpy(dst + i * 4, src, 4);
+        break;
+    default:
+        for (i = 0; i < n; i++, src += step)
+            memcpy(dst + i * size, src, size);
+        break;
+    }
+}
+
+static void i2s_scatter(uint8_t *dst, const uint8_t *src, size_t step,
+                        size_t size, size_t n)
+{
+    size_t i;
+    
+    switch (size) {
+    case 2:
+        for (i = 0; i < n; i++, dst += step)
+            memcpy(dst, src + i * 2, 2);
+        break;
+    case 4:
+        for (i = 0; i < n; i++, dst += step)
+            memcpy(dst, src + i * 4, 4);
+        break;
+    default:
+        for (i = 0; i < n; i++, dst += step)
+            memcpy(dst, src + i * size, size);
+        break;
+    }
+}
+
+/*
+ * Convert one channel of an interleaved buffer. Its samples are gathered
+ * a block at a time into a buffer on the stack, so only the channel's own
+ * samples are touched and the block conversion kernels still apply.
+ */
+int i2s_channel_extract(void *dst, i2s_sample_t dst_format,
+                        const i2s_channel_area_t *area, size_t frames,
+                        unsigned int flags)
+{
+    uint8_t tmp[I2S_CONVERT_BLOCK * sizeof(int32_t)];
+    size_t size, dst_size, done, n;
+    
+    if (!dst || !area || !area->addr) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    size = i2s_sample_size(area->format);
+    dst_size = i2s_sample_size(dst_format);
+    if (!size || !dst_size || area->step < size) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    for (done = 0; done < frames; done += n) {
+        n = frames - done;
+        if (n > I2S_CONVERT_BLOCK)
+            n = I2S_CONVERT_BLOCK;
+        
+        i2s_gather(tmp, (const uint8_t *)area->addr + done * area->step,
+                   area->step, size, n);
+        if (i2s_convert((char *)dst + done * dst_size, dst_format,
+                        tmp, area->format, n, flags) < 0)
+            return -1;
+    }
+    
+    return 0;
+}
+
+/* The other way round: convert into the channel, leaving the others be */
+int i2s_channel_insert(const i2s_channel_area_t *area, const void *src,
+                       i2s_sample_t src_format, size_t frames,
+                       unsigned int flags)
+{
+    uint8_t tmp[I2S_CONVERT_BLOCK * sizeof(int32_t)];
+    size_t size, src_size, done, n;
+    
+    if (!area || !area->addr || !src) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    size = i2s_sample_size(area->format);
+    src_size = i2s_sample_size(src_format);
+    if (!size || !src_size || area->step < size) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    for (done = 0; done < frames; done += n) {
+        n = frames - done;
+        if (n > I2S_CONVERT_BLOCK)
+            n = I2S_CONVERT_BLOCK;
+        
+        if (i2s_convert(tmp, area->format,
+                        (const char *)src + done * src_size, src_format,
+                        n, flags) < 0)
+            return -1;
+        i2s_scatter((uint8_t *)area->addr + done * area->step, tmp,
+                    area->step, size, n);
+    }
+    
+    return 0;
+}
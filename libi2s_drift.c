@@ -0,0 +1,379 @@
+/*
+ * libi2s_drift.c - Clock-drift compensation for libi2s
+ *
+ * Asynchronous resampling between an application paced by a reference
+ * clock (PTP, or the system clock) and the device's own sample clock.
+ * The hardware position timestamps give the device rate in reference
+ * time, which feeds the resampling ratio forward; a PI loop on the
+ * driver ring fill removes whatever error is left, so the fill stays at
+ * its target instead of creeping towards an xrun.
+ */
+
+#include "libi2s.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+/* Device frames converted per pass */
+#define I2S_DRIFT_BLOCK 256
+
+/* How often the loop runs, and how long a baseline the drift needs */
+#define I2S_DRIFT_INTERVAL_NS 100000000ULL
+#define I2S_DRIFT_MIN_SPAN_NS 2000000000ULL
+#define I2S_DRIFT_WINDOW_NS 60000000000ULL
+
+/* Smoothing of the fill, per update */
+#define I2S_DRIFT_FILL_ALPHA 0.2
+
+/* Hardware frames counted at a point in reference time */
+struct i2s_drift_anchor {
+    uint64_t frames;
+    int64_t ref_ns;
+};
+
+struct i2s_drift_s {
+    i2s_handle_t handle;
+    i2s_stream_t stream;
+    i2s_drift_config_t config;
+    i2s_resampler_t resampler;
+    int device_rate;
+    int channels;
+    i2s_sample_t device_format;
+    size_t frame_bytes;
+    
+    /* One pass worth of frames, as float and in the device format */
+    size_t block_frames;
+    float *fbuf;
+    void *dbuf;
+    
+    /* The drift is measured from base; mid replaces it once it is old */
+    struct i2s_drift_anchor base;
+    struct i2s_drift_anchor mid;
+    int anchored;
+    uint32_t xruns;
+    uint64_t last_tstamp_ns;
+    int64_t last_ref_ns;
+    uint64_t next_check_ns;
+    
+    double drift_ppm;
+    double correction_ppm;
+    double fill_frames;
+    double integral;
+};
+
+static int64_t i2s_drift_clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    
+    if (clock_gettime(clock, &ts) < 0)
+        return -1;
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Translate a CLOCK_MONOTONIC_RAW timestamp into the reference clock,
+ * reading the reference between two raw readings to bound the offset.
+ */
+static int64_t i2s_drift_reference_ns(i2s_drift_t drift, uint64_t tstamp_ns)
+{
+    int64_t raw1, ref, raw2;
+    
+    raw1 = i2s_drift_clock_ns(CLOCK_MONOTONIC_RAW);
+    ref = i2s_drift_clock_ns(drift->config.reference);
+    raw2 = i2s_drift_clock_ns(CLOCK_MONOTONIC_RAW);
+    
+    return ref - (raw1 + (raw2 - raw1) / 2 - (int64_t)tstamp_ns);
+}
+
+/* Defaults: the system clock as reference, half the ring as target */
+void i2s_drift_config_default(i2s_drift_config_t *config)
+{
+    if (!config)
+        return;
+    
+    memset(config, 0, sizeof(*config));
+    config->reference = CLOCK_MONOTONIC;
+    config->target_frames = 0;
+    config->kp = 1.0;
+    config->ki = 0.05;
+    config->max_ppm = 1000.0;
+    config->quality = I2S_RESAMPLE_MEDIUM;
+}
+
+/*
+ * Resample between source_rate and the device on one stream of handle,
+ * which must be configured and in blocking mode. config NULL takes the
+ * defaults.
+ */
+i2s_drift_t i2s_drift_create(i2s_handle_t handle, i2s_stream_t stream,
+                             int source_rate, const i2s_drift_config_t *config)
+{
+    i2s_params_t params;
+    i2s_drift_t drift;
+    size_t per_frame;
+    int in_rate, out_rate;
+    
+    if (!handle ||
+        (stream != I2S_STREAM_PLAYBACK && stream != I2S_STREAM_CAPTURE) ||
+        i2s_get_params(handle, &params) < 0 || params.channels <= 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    
+    drift = calloc(1, sizeof(*drift));
+    if (!drift) {
+        return NULL;
+    }
+    
+    if (config)
+        drift->config = *config;
+    else
+        i2s_drift_config_default(&drift->config);
+    if (!drift->config.target_frames)
+        drift->config.target_frames =
+            (uint32_t)(params.period_frames * params.periods / 2);
+    
+    if (i2s_drift_clock_ns(drift->config.reference) < 0 ||
+        drift->config.max_ppm <= 0.0) {
+        free(drift);
+        errno = EINVAL;
+        return NULL;
+    }
+    
+    drift->handle = handle;
+    drift->stream = stream;
+    drift->device_rate = params.sample_rate;
+    drift->channels = params.channels;
+    drift->device_format = i2s_format_sample(params.format);
+    drift->frame_bytes = (size_t)params.channels *
+        i2s_sample_size(drift->device_format);
+    drift->fill_frames = drift->config.target_frames;
+    
+    /* Playback resamples into the device, capture out of it */
+    in_rate = stream == I2S_STREAM_PLAYBACK ? source_rate : params.sample_rate;
+    out_rate = stream == I2S_STREAM_PLAYBACK ? params.sample_rate : source_rate;
+    drift->resampler = i2s_resampler_create(in_rate, out_rate, params.channels,
+                                            drift->config.quality);
+    if (!drift->resampler) {
+        free(drift);
+        return NULL;
+    }
+    
+    /* Capture reads the device frames behind a block of output at once */
+    drift->block_frames = I2S_DRIFT_BLOCK;
+    if (stream == I2S_STREAM_CAPTURE)
+        drift->block_frames = I2S_DRIFT_BLOCK * (in_rate / out_rate + 1) +
+                              I2S_RESAMPLE_MAX_TAPS;
+    
+    per_frame = (size_t)params.channels * sizeof(float);
+    drift->fbuf = malloc(drift->block_frames * per_frame);
+    drift->dbuf = malloc(drift->block_frames * drift->frame_bytes);
+    if (!drift->fbuf || !drift->dbuf) {
+        i2s_drift_destroy(drift);
+        errno = ENOMEM;
+        return NULL;
+    }
+    
+    return drift;
+}
+
+void i2s_drift_destroy(i2s_drift_t drift)
+{
+    if (!drift)
+        return;
+    
+    i2s_resampler_destroy(drift->resampler);
+    free(drift->fbuf);
+    free(drift->dbuf);
+    free(drift);
+}
+
+/* Start measuring again, after an xrun or a restart of the stream */
+static void i2s_drift_anchor(i2s_drift_t drift, const struct i2s_drift_anchor *now,
+                             const i2s_position_t *pos)
+{
+    drift->base = *now;
+    drift->mid = *now;
+    drift->anchored = 1;
+    drift->xruns = pos->xruns;
+    drift->last_ref_ns = now->ref_ns;
+}
+
+/*
+ * One step of the loop, at most every I2S_DRIFT_INTERVAL_NS: update the
+ * measured drift and the fill, then retune the resampler. The error is
+ * signed so that a device running fast always asks for a higher ratio
+ * (more frames out of playback, more consumed by capture).
+ */
+static void i2s_drift_update(i2s_drift_t drift)
+{
+    const i2s_drift_config_t *cfg = &drift->config;
+    struct i2s_drift_anchor now;
+    i2s_position_t pos;
+    uint64_t check_ns = (uint64_t)i2s_drift_clock_ns(CLOCK_MONOTONIC);
+    double dt, err, limit, ppm;
+    int64_t span;
+    
+    if (check_ns < drift->next_check_ns)
+        return;
+    drift->next_check_ns = check_ns + I2S_DRIFT_INTERVAL_NS;
+    
+    /* Nothing new until the next period interrupt */
+    if (i2s_get_position(drift->handle, drift->stream, &pos) < 0 ||
+        pos.tstamp_ns == drift->last_tstamp_ns)
+        return;
+    drift->last_tstamp_ns = pos.tstamp_ns;
+    
+    now.frames = pos.hw_frames;
+    now.ref_ns = i2s_drift_reference_ns(drift, pos.tstamp_ns);
+    
+    if (!drift->anchored || pos.xruns != drift->xruns ||
+        now.frames < drift->base.frames || now.ref_ns <= drift->last_ref_ns) {
+        i2s_drift_anchor(drift, &now, &pos);
+        return;
+    }
+    
+    dt = (double)(now.ref_ns - drift->last_ref_ns) / 1e9;
+    drift->last_ref_ns = now.ref_ns;
+    
+    /* Device rate over the baseline, in reference time */
+    span = now.ref_ns - drift->base.ref_ns;
+    if (span >= (int64_t)I2S_DRIFT_MIN_SPAN_NS) {
+        drift->drift_ppm = ((double)(now.frames - drift->base.frames) * 1e9 /
+                            (double)span / drift->device_rate - 1.0) * 1e6;
+    }
+    if (span >= (int64_t)I2S_DRIFT_WINDOW_NS) {
+        drift->base = drift->mid;
+        drift->mid = now;
+    }
+    
+    drift->fill_frames += I2S_DRIFT_FILL_ALPHA *
+        ((double)pos.fill_frames - drift->fill_frames);
+    err = drift->fill_frames - cfg->target_frames;
+    if (drift->stream == I2S_STREAM_PLAYBACK)
+        err = -err;
+    
+    /* The integral alone may never exceed the limit (anti-windup) */
+    drift->integral += err * dt;
+    if (cfg->ki > 0.0) {
+        limit = cfg->max_ppm / cfg->ki;
+        if (drift->integral > limit)
+            drift->integral = limit;
+        else if (drift->integral < -limit)
+            drift->integral = -limit;
+    }
+    
+    ppm = drift->drift_ppm + cfg->kp * err + cfg->ki * drift->integral;
+    if (ppm > cfg->max_ppm)
+        ppm = cfg->max_ppm;
+    else if (ppm < -cfg->max_ppm)
+        ppm = -cfg->max_ppm;
+    drift->correction_ppm = ppm;
+    
+    i2s_resampler_set_ratio(drift->resampler,
+                            drift->stream == I2S_STREAM_PLAYBACK ?
+                            1.0 + ppm * 1e-6 : 1.0 / (1.0 + ppm * 1e-6));
+}
+
+/* Blocking transfer of a whole buffer */
+static int i2s_drift_io(i2s_drift_t drift, void *buf, size_t len)
+{
+    char *p = buf;
+    ssize_t n;
+    
+    while (len) {
+        if (drift->stream == I2S_STREAM_PLAYBACK)
+            n = i2s_write(drift->handle, p, len);
+        else
+            n = i2s_read(drift->handle, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    
+    return 0;
+}
+
+/* Play count frames of interleaved float at the source rate */
+ssize_t i2s_drift_write(i2s_drift_t drift, const float *frames, size_t count)
+{
+    size_t done = 0, in, out;
+    
+    if (!drift || !frames || drift->stream != I2S_STREAM_PLAYBACK) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    while (done < count) {
+        in = count - done;
+        out = drift->block_frames;
+        i2s_resample(drift->resampler, frames + done * drift->channels, &in,
+                     drift->fbuf, &out);
+        
+        i2s_convert(drift->dbuf, drift->device_format, drift->fbuf,
+                    I2S_SAMPLE_FLOAT32, out * drift->channels,
+                    I2S_CONVERT_SATURATE);
+        if (i2s_drift_io(drift, drift->dbuf, out * drift->frame_bytes) < 0)
+            break;
+        
+        done += in;
+        i2s_drift_update(drift);
+    }
+    
+    return done ? (ssize_t)done : -1;
+}
+
+/* Capture count frames of interleaved float at the source rate */
+ssize_t i2s_drift_read(i2s_drift_t drift, float *frames, size_t count)
+{
+    size_t done = 0, in, out;
+    
+    if (!drift || !frames || drift->stream != I2S_STREAM_CAPTURE) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    while (done < count) {
+        out = count - done;
+        if (out > I2S_DRIFT_BLOCK)
+            out = I2S_DRIFT_BLOCK;
+        
+        in = i2s_resampler_needed(drift->resampler, out);
+        if (in > drift->block_frames)
+            in = drift->block_frames;
+        
+        if (in) {
+            if (i2s_drift_io(drift, drift->dbuf, in * drift->frame_bytes) < 0)
+                break;
+            i2s_convert(drift->fbuf, I2S_SAMPLE_FLOAT32, drift->dbuf,
+                        drift->device_format, in * drift->channels, 0);
+        }
+        i2s_resample(drift->resampler, drift->fbuf, &in,
+                     frames + done * drift->channels, &out);
+        
+        done += out;
+        i2s_drift_update(drift);
+    }
+    
+    return done ? (ssize_t)done : -1;
+}
+
+/* Where the loop stands: measured drift and the correction applied */
+int i2s_drift_get_stats(i2s_drift_t drift, i2s_drift_stats_t *stats)
+{
+    if (!drift || !stats) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    stats->drift_ppm = drift->drift_ppm;
+    stats->correction_ppm = drift->correction_ppm;
+    stats->fill_frames = drift->fill_frames;
+    stats->target_frames = drift->config.target_frames;
+    return 0;
+}
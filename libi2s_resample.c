@@ -0,0 +1,520 @@
+/*
+ * libi2s_resample.c - Sample-rate conversion for libi2s
+ *
+ * Polyphase windowed-sinc resampler over interleaved float frames. The
+ * output position advances in 32.32 fixed point, and the coefficients
+ * for it are interpolated between the two nearest of a fixed number of
+ * filter phases, so any pair of rates works with one table. Tables are
+ * computed once per quality and cutoff and shared by every resampler
+ * that needs them. The inner products use the same NEON, SSE2 or AVX2
+ * selection as libi2s_convert.c.
+ */
+
+#include "libi2s.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define I2S_RESAMPLE_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__)
+#define I2S_RESAMPLE_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* Input frames taken per pass, on top of the filter history */
+#define I2S_RESAMPLE_CHUNK 512
+
+/* Filter shape of each quality level */
+struct i2s_resample_shape {
+    unsigned int taps;          /* per phase, a multiple of 8 */
+    unsigned int phases;
+    double beta;                /* Kaiser window */
+    double rolloff;             /* passband edge, relative to Nyquist */
+};
+
+static const struct i2s_resample_shape i2s_resample_shapes[] = {
+    [I2S_RESAMPLE_FAST] = { 16, 32, 6.0, 0.85 },
+    [I2S_RESAMPLE_MEDIUM] = { 32, 128, 8.0, 0.91 },
+    [I2S_RESAMPLE_BEST] = { 64, 256, 10.0, 0.95 },
+};
+
+/* Coefficients of one filter, (phases + 1) rows of taps each */
+struct i2s_resample_table {
+    struct i2s_resample_table *next;
+    unsigned int refs;
+    i2s_resample_quality_t quality;
+    uint32_t cutoff_ppm;
+    unsigned int taps;
+    unsigned int phases;
+    float coef[];
+};
+
+struct i2s_resampler_s {
+    struct i2s_resample_table *table;
+    const struct i2s_resample_ops *ops;
+    int channels;
+    uint64_t step;              /* input frames per output frame, 32.32 */
+    uint64_t nominal_step;      /* step at the rates it was created for */
+    uint64_t pos;               /* first tap of the next output, 32.32 */
+    size_t fill;                /* frames in each plane of buf */
+    size_t capacity;
+    float *buf;                 /* one plane of capacity frames per channel */
+    float *row;                 /* coefficients of the current output */
+};
+
+/* Tables in use, looked up by quality and cutoff */
+static struct i2s_resample_table *i2s_resample_tables;
+static pthread_mutex_t i2s_resample_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The kernels that have vector versions; n is a multiple of 8 */
+struct i2s_resample_ops {
+    float (*dot)(const float *x, const float *h, size_t n);
+    void (*lerp)(float *out, const float *a, const float *b, float t,
+                 size_t n);
+};
+
+static float dot_scalar(const float *x, const float *h, size_t n)
+{
+    float sum = 0.0f;
+    size_t i;
+    
+    for (i = 0; i < n; i++)
+        sum += x[i] * h[i];
+    return sum;
+}
+
+static void lerp_scalar(float *out, const float *a, const float *b, float t,
+                        size_t n)
+{
+    size_t i;
+    
+    for (i = 0; i < n; i++)
+        out[i] = a[i] + t * (b[i] - a[i]);
+}
+
+static const struct i2s_resample_ops i2s_resample_scalar = {
+    .dot = dot_scalar,
+    .lerp = lerp_scalar,
+};
+
+#ifdef I2S_RESAMPLE_X86
+__attribute__((target("sse2")))
+static float dot_sse2(const float *x, const float *h, size_t n)
+{
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    float lanes[4];
+    size_t i;
+    
+    /* Two accumulators hide the latency of the adds */
+    for (i = 0; i < n; i += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(x + i),
+                                           _mm_loadu_ps(h + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(x + i + 4),
+                                           _mm_loadu_ps(h + i + 4)));
+    }
+    
+    _mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+__attribute__((target("sse2")))
+static void lerp_sse2(float *out, const float *a, const float *b, float t,
+                      size_t n)
+{
+    __m128 vt = _mm_set1_ps(t);
+    size_t i;
+    
+    for (i = 0; i < n; i += 4) {
+        __m128 va = _mm_loadu_ps(a + i);
+        
+        _mm_storeu_ps(out + i, _mm_add_ps(va, _mm_mul_ps(vt,
+                      _mm_sub_ps(_mm_loadu_ps(b + i), va))));
+    }
+}
+
+static const struct i2s_resample_ops i2s_resample_sse2 = {
+    .dot = dot_sse2,
+    .lerp = lerp_sse2,
+};
+
+__attribute__((target("avx2")))
+static float dot_avx2(const float *x, const float *h, size_t n)
+{
+    __m256 acc = _mm256_setzero_ps();
+    __m128 sum;
+    float lanes[4];
+    size_t i;
+    
+    for (i = 0; i < n; i += 8)
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(x + i),
+                                               _mm256_loadu_ps(h + i)));
+    
+    sum = _mm_add_ps(_mm256_castps256_ps128(acc),
+                     _mm256_extractf128_ps(acc, 1));
+    _mm_storeu_ps(lanes, sum);
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+__attribute__((target("avx2")))
+static void lerp_avx2(float *out, const float *a, const float *b, float t,
+                      size_t n)
+{
+    __m256 vt = _mm256_set1_ps(t);
+    size_t i;
+    
+    for (i = 0; i < n; i += 8) {
+        __m256 va = _mm256_loadu_ps(a + i);
+        
+        _mm256_storeu_ps(out + i, _mm256_add_ps(va, _mm256_mul_ps(vt,
+                         _mm256_sub_ps(_mm256_loadu_ps(b + i), va))));
+    }
+}
+
+static const struct i2s_resample_ops i2s_resample_avx2 = {
+    .dot = dot_avx2,
+    .lerp = lerp_avx2,
+};
+#endif /* I2S_RESAMPLE_X86 */
+
+#ifdef I2S_RESAMPLE_NEON
+static float dot_neon(const float *x, const float *h, size_t n)
+{
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    size_t i;
+    
+    for (i = 0; i < n; i += 8) {
+        acc0 = vmlaq_f32(acc0, vld1q_f32(x + i), vld1q_f32(h + i));
+        acc1 = vmlaq_f32(acc1, vld1q_f32(x + i + 4), vld1q_f32(h + i + 4));
+    }
+    
+    return vaddvq_f32(vaddq_f32(acc0, acc1));
+}
+
+static void lerp_neon(float *out, const float *a, const float *b, float t,
+                      size_t n)
+{
+    size_t i;
+    
+    for (i = 0; i < n; i += 4) {
+        float32x4_t va = vld1q_f32(a + i);
+        
+        vst1q_f32(out + i, vmlaq_n_f32(va, vsubq_f32(vld1q_f32(b + i), va), t));
+    }
+}
+
+static const struct i2s_resample_ops i2s_resample_neon = {
+    .dot = dot_neon,
+    .lerp = lerp_neon,
+};
+#endif /* I2S_RESAMPLE_NEON */
+
+/* Pick the widest kernels the CPU runs, once per process */
+static const struct i2s_resample_ops *i2s_resample_ops_get(void)
+{
+    static const struct i2s_resample_ops *selected;
+    const struct i2s_resample_ops *ops;
+    
+    ops = __atomic_load_n(&selected, __ATOMIC_ACQUIRE);
+    if (ops)
+        return ops;
+    
+    ops = &i2s_resample_scalar;
+#if defined(I2S_RESAMPLE_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        ops = &i2s_resample_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        ops = &i2s_resample_sse2;
+#elif defined(I2S_RESAMPLE_NEON)
+    ops = &i2s_resample_neon;
+#endif
+    
+    __atomic_store_n(&selected, ops, __ATOMIC_RELEASE);
+    return ops;
+}
+
+/* Modified Bessel function of the first kind, order 0 */
+static double i2s_bessel_i0(double x)
+{
+    double sum = 1.0, term = 1.0;
+    int k;
+    
+    for (k = 1; k < 50 && term > sum * 1e-12; k++) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+/*
+ * Row p holds the taps for an output p / phases of the way from one
+ * input frame to the next, each row normalized to unity gain at DC.
+ */
+static void i2s_resample_table_fill(struct i2s_resample_table *table,
+                                    const struct i2s_resample_shape *shape,
+                                    double cutoff)
+{
+    double half = table->taps / 2.0;
+    double norm = i2s_bessel_i0(shape->beta);
+    unsigned int p, k;
+    
+    for (p = 0; p <= table->phases; p++) {
+        float *row = table->coef + (size_t)p * table->taps;
+        double sum = 0.0;
+        
+        for (k = 0; k < table->taps; k++) {
+            double t = (double)p / table->phases + half - 1.0 - k;
+            double w = t / half;
+            double x = M_PI * cutoff * t;
+            double h = fabs(x) < 1e-9 ? cutoff : cutoff * sin(x) / x;
+            
+            w = w * w < 1.0 ? i2s_bessel_i0(shape->beta * sqrt(1.0 - w * w)) /
+                norm : 0.0;
+            row[k] = (float)(h * w);
+            sum += h * w;
+        }
+        for (k = 0; k < table->taps; k++)
+            row[k] = (float)(row[k] / sum);
+    }
+}
+
+/* Find or compute the table for a quality and cutoff */
+static struct i2s_resample_table *i2s_resample_table_get(
+    i2s_resample_quality_t quality, double cutoff)
+{
+    const struct i2s_resample_shape *shape = &i2s_resample_shapes[quality];
+    uint32_t cutoff_ppm = (uint32_t)lround(cutoff * 1e6);
+    struct i2s_resample_table *table;
+    
+    pthread_mutex_lock(&i2s_resample_lock);
+    for (table = i2s_resample_tables; table; table = table->next) {
+        if (table->quality == quality && table->cutoff_ppm == cutoff_ppm) {
+            table->refs++;
+            pthread_mutex_unlock(&i2s_resample_lock);
+            return table;
+        }
+    }
+    
+    table = malloc(sizeof(*table) +
+                   (size_t)(shape->phases + 1) * shape->taps * sizeof(float));
+    if (table) {
+        table->refs = 1;
+        table->quality = quality;
+        table->cutoff_ppm = cutoff_ppm;
+        table->taps = shape->taps;
+        table->phases = shape->phases;
+        i2s_resample_table_fill(table, shape, cutoff_ppm / 1e6);
+        table->next = i2s_resample_tables;
+        i2s_resample_tables = table;
+    }
+    pthread_mutex_unlock(&i2s_resample_lock);
+    
+    return table;
+}
+
+static void i2s_resample_table_put(struct i2s_resample_table *table)
+{
+    struct i2s_resample_table **link;
+    
+    pthread_mutex_lock(&i2s_resample_lock);
+    if (--table->refs == 0) {
+        for (link = &i2s_resample_tables; *link != table; link = &(*link)->next)
+            ;
+        *link = table->next;
+        free(table);
+    }
+    pthread_mutex_unlock(&i2s_resample_lock);
+}
+
+/* Create a resampler from in_rate to out_rate for interleaved frames */
+i2s_resampler_t i2s_resampler_create(int in_rate, int out_rate, int channels,
+                                     i2s_resample_quality_t quality)
+{
+    i2s_resampler_t rs;
+    double cutoff;
+    
+    if (in_rate < I2S_RESAMPLE_MIN_RATE || in_rate > I2S_RESAMPLE_MAX_RATE ||
+        out_rate < I2S_RESAMPLE_MIN_RATE || out_rate > I2S_RESAMPLE_MAX_RATE ||
+        channels <= 0 || quality < I2S_RESAMPLE_FAST ||
+        quality > I2S_RESAMPLE_BEST) {
+        errno = EINVAL;
+        return NULL;
+    }
+    
+    rs = calloc(1, sizeof(*rs));
+    if (!rs) {
+        return NULL;
+    }
+    
+    /* Downsampling has to remove what the lower rate cannot carry */
+    cutoff = i2s_resample_shapes[quality].rolloff;
+    if (out_rate < in_rate)
+        cutoff = cutoff * out_rate / in_rate;
+    
+    rs->table = i2s_resample_table_get(quality, cutoff);
+    if (!rs->table) {
+        free(rs);
+        return NULL;
+    }
+    
+    rs->ops = i2s_resample_ops_get();
+    rs->channels = channels;
+    rs->step = ((uint64_t)in_rate << 32) / (uint64_t)out_rate;
+    rs->nominal_step = rs->step;
+    rs->capacity = rs->table->taps + I2S_RESAMPLE_CHUNK;
+    rs->buf = malloc((rs->capacity * channels + rs->table->taps) * sizeof(float));
+    if (!rs->buf) {
+        i2s_resample_table_put(rs->table);
+        free(rs);
+        return NULL;
+    }
+    rs->row = rs->buf + rs->capacity * channels;
+    
+    i2s_resampler_reset(rs);
+    return rs;
+}
+
+void i2s_resampler_destroy(i2s_resampler_t rs)
+{
+    if (!rs)
+        return;
+    
+    i2s_resample_table_put(rs->table);
+    free(rs->buf);
+    free(rs);
+}
+
+/*
+ * Drop the history. The filter is primed so that the first output frame
+ * lines up with the first input frame, without a delay to skip.
+ */
+void i2s_resampler_reset(i2s_resampler_t rs)
+{
+    if (!rs)
+        return;
+    
+    rs->fill = rs->table->taps / 2 - 1;
+    memset(rs->buf, 0, rs->capacity * rs->channels * sizeof(float));
+    rs->pos = 0;
+}
+
+/*
+ * Produce ratio times the nominal output rate, for drift compensation.
+ * The filter is kept, so this is only meant for ratios close to 1.
+ */
+int i2s_resampler_set_ratio(i2s_resampler_t rs, double ratio)
+{
+    if (!rs || !(ratio > 0.5 && ratio < 2.0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    rs->step = (uint64_t)llround((double)rs->nominal_step / ratio);
+    return 0;
+}
+
+/* Input frames still needed before out_frames more can be produced */
+size_t i2s_resampler_needed(i2s_resampler_t rs, size_t out_frames)
+{
+    uint64_t last;
+    size_t need;
+    
+    if (!rs || !out_frames)
+        return 0;
+    
+    last = rs->pos + (uint64_t)(out_frames - 1) * rs->step;
+    need = (size_t)(last >> 32) + rs->table->taps;
+    return need > rs->fill ? need - rs->fill : 0;
+}
+
+/* Move the unread frames to the front and append input after them */
+static size_t i2s_resample_refill(i2s_resampler_t rs, const float *in,
+                                  size_t frames)
+{
+    size_t drop = (size_t)(rs->pos >> 32);
+    size_t i;
+    int ch;
+    
+    if (drop > rs->fill)
+        drop = rs->fill;
+    if (drop) {
+        for (ch = 0; ch < rs->channels; ch++) {
+            float *plane = rs->buf + ch * rs->capacity;
+            
+            memmove(plane, plane + drop, (rs->fill - drop) * sizeof(float));
+        }
+        rs->fill -= drop;
+        rs->pos -= (uint64_t)drop << 32;
+    }
+    
+    if (frames > rs->capacity - rs->fill)
+        frames = rs->capacity - rs->fill;
+    
+    for (ch = 0; ch < rs->channels; ch++) {
+        float *plane = rs->buf + ch * rs->capacity + rs->fill;
+        
+        for (i = 0; i < frames; i++)
+            plane[i] = in[i * rs->channels + ch];
+    }
+    rs->fill += frames;
+    return frames;
+}
+
+/*
+ * Convert up to *in_frames frames from in into at most *out_frames
+ * frames at out; both are updated to the frames consumed and produced.
+ * Input is only left over when the output is full.
+ */
+int i2s_resample(i2s_resampler_t rs, const float *in, size_t *in_frames,
+                 float *out, size_t *out_frames)
+{
+    const struct i2s_resample_table *table;
+    size_t consumed = 0, produced = 0, n;
+    uint64_t phase;
+    int ch;
+    
+    if (!rs || !in_frames || !out_frames || (*in_frames && !in) ||
+        (*out_frames && !out)) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    table = rs->table;
+    while (produced < *out_frames) {
+        n = (size_t)(rs->pos >> 32);
+        if (n + table->taps > rs->fill) {
+            if (consumed == *in_frames)
+                break;
+            consumed += i2s_resample_refill(rs, in + consumed * rs->channels,
+                                            *in_frames - consumed);
+            continue;
+        }
+        
+        /* Interpolate between the two phases around the position */
+        phase = (uint64_t)(uint32_t)rs->pos * table->phases;
+        rs->ops->lerp(rs->row, table->coef + (size_t)(phase >> 32) * table->taps,
+                      table->coef + (size_t)((phase >> 32) + 1) * table->taps,
+                      (float)(uint32_t)phase * (1.0f / 4294967296.0f),
+                      table->taps);
+        
+        for (ch = 0; ch < rs->channels; ch++)
+            out[produced * rs->channels + ch] =
+                rs->ops->dot(rs->buf + ch * rs->capacity + n, rs->row,
+                             table->taps);
+        
+        produced++;
+        rs->pos += rs->step;
+    }
+    
+    *in_frames = consumed;
+    *out_frames = produced;
+    return 0;
+}
@@ -0,0 +1,709 @@
+/*
+ * libi2s_signal.c - Test-signal generation for libi2s
+ *
+ * Sines are kept as a phase accumulator in double precision, which seeds
+ * eight phasors at the start of every block; inside the block the phasors
+ * turn by a complex multiply, so there is no sin() per sample and the
+ * rotation runs eight samples at a time with the same NEON, SSE2 or AVX2
+ * selection as libi2s_convert.c. Sweeps use the same idea one sample at
+ * a time (a chirp rotates the rotator too). Every channel is generated
+ * as a float block and the blocks are converted into the destination
+ * with i2s_convert(), so a mapped ring can be filled in any format.
+ * Channels set together share one generator and are computed once.
+ */
+
+#include "libi2s.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define I2S_SIGNAL_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__)
+#define I2S_SIGNAL_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* Frames per pass, a multiple of I2S_SIGNAL_LANES. The phasors are
+ * reseeded every block, which keeps the rotation error near -110 dB. */
+#define I2S_SIGNAL_BLOCK 256
+#define I2S_SIGNAL_LANES 8
+
+/* Frames a log sweep is followed by one linear chirp, ~-80 dB */
+#define I2S_SIGNAL_LOG_CHUNK 32
+
+#define I2S_SIGNAL_TWO_PI 6.283185307179586
+
+/* State of one generator */
+struct i2s_signal_gen {
+    i2s_signal_config_t config;
+    double phase[I2S_SIGNAL_MAX_TONES];     /* cycles, 0 .. 1 */
+    double inc[I2S_SIGNAL_MAX_TONES];       /* cycles per frame */
+    
+    /* Sweeps: the increment at the next frame, its change per frame on
+     * a linear sweep or ratio per frame on a log one */
+    double sweep_inc;
+    double sweep_step;
+    double sweep_frames;
+    double sweep_done;
+    
+    /* Noise */
+    uint32_t rng;
+    float pink[7];
+};
+
+struct i2s_signal_s {
+    const struct i2s_signal_ops *ops;
+    int sample_rate;
+    int channels;
+    int solo;                   /* the only channel heard, -1 = all */
+    int *source;                /* generator each channel plays */
+    struct i2s_signal_gen *gen; /* one per channel, used if source is itself */
+    float *plane;               /* I2S_SIGNAL_BLOCK floats per generator */
+    float *frames;              /* one interleaved block */
+};
+
+/* The kernels that have vector versions; n is a multiple of 8 */
+struct i2s_signal_ops {
+    /* Add n samples of the phasors (re, im) to out, each turned by
+     * (c, s) per step of I2S_SIGNAL_LANES samples */
+    void (*tone)(float *out, const float *re, const float *im,
+                 float c, float s, size_t n);
+};
+
+static void tone_scalar(float *out, const float *re, const float *im,
+                        float c, float s, size_t n)
+{
+    float x[I2S_SIGNAL_LANES], y[I2S_SIGNAL_LANES], t;
+    size_t i, k;
+    
+    memcpy(x, re, sizeof(x));
+    memcpy(y, im, sizeof(y));
+    
+    for (i = 0; i < n; i += I2S_SIGNAL_LANES) {
+        for (k = 0; k < I2S_SIGNAL_LANES; k++) {
+            out[i + k] += y[k];
+            t = x[k] * c - y[k] * s;
+            y[k] = x[k] * s + y[k] * c;
+            x[k] = t;
+        }
+    }
+}
+
+static const struct i2s_signal_ops i2s_signal_scalar = {
+    .tone = tone_scalar,
+};
+
+#ifdef I2S_SIGNAL_X86
+__attribute__((target("sse2")))
+static void tone_sse2(float *out, const float *re, const float *im,
+                      float c, float s, size_t n)
+{
+    __m128 x0 = _mm_loadu_ps(re), x1 = _mm_loadu_ps(re + 4);
+    __m128 y0 = _mm_loadu_ps(im), y1 = _mm_loadu_ps(im + 4);
+    __m128 vc = _mm_set1_ps(c), vs = _mm_set1_ps(s);
+    __m128 t0, t1;
+    size_t i;
+    
+    for (i = 0; i < n; i += 8) {
+        _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), y0));
+        _mm_storeu_ps(out + i + 4, _mm_add_ps(_mm_loadu_ps(out + i + 4), y1));
+        
+        t0 = _mm_sub_ps(_mm_mul_ps(x0, vc), _mm_mul_ps(y0, vs));
+        t1 = _mm_sub_ps(_mm_mul_ps(x1, vc), _mm_mul_ps(y1, vs));
+        y0 = _mm_add_ps(_mm_mul_ps(x0, vs), _mm_mul_ps(y0, vc));
+        y1 = _mm_add_ps(_mm_mul_ps(x1, vs), _mm_mul_ps(y1, vc));
+        x0 = t0;
+        x1 = t1;
+    }
+}
+
+static const struct i2s_signal_ops i2s_signal_sse2 = {
+    .tone = tone_sse2,
+};
+
+__attribute__((target("avx2")))
+static void tone_avx2(float *out, const float *re, const float *im,
+                      float c, float s, size_t n)
+{
+    __m256 x = _mm256_loadu_ps(re), y = _mm256_loadu_ps(im);
+    __m256 vc = _mm256_set1_ps(c), vs = _mm256_set1_ps(s);
+    __m256 t;
+    size_t i;
+    
+    for (i = 0; i < n; i += 8) {
+        _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(out + i), y));
+        
+        t = _mm256_sub_ps(_mm256_mul_ps(x, vc), _mm256_mul_ps(y, vs));
+        y = _mm256_add_ps(_mm256_mul_ps(x, vs), _mm256_mul_ps(y, vc));
+        x = t;
+    }
+}
+
+static const struct i2s_signal_ops i2s_signal_avx2 = {
+    .tone = tone_avx2,
+};
+#endif /* I2S_SIGNAL_X86 */
+
+#ifdef I2S_SIGNAL_NEON
+static void tone_neon(float *out, const float *re, const float *im,
+                      float c, float s, size_t n)
+{
+    float32x4_t x0 = vld1q_f32(re), x1 = vld1q_f32(re + 4);
+    float32x4_t y0 = vld1q_f32(im), y1 = vld1q_f32(im + 4);
+    float32x4_t t0, t1;
+    size_t i;
+    
+    for (i = 0; i < n; i += 8) {
+        vst1q_f32(out + i, vaddq_f32(vld1q_f32(out + i), y0));
+        vst1q_f32(out + i + 4, vaddq_f32(vld1q_f32(out + i + 4), y1));
+        
+        t0 = vmlsq_n_f32(vmulq_n_f32(x0, c), y0, s);
+        t1 = vmlsq_n_f32(vmulq_n_f32(x1, c), y1, s);
+        y0 = vmlaq_n_f32(vmulq_n_f32(y0, c), x0, s);
+        y1 = vmlaq_n_f32(vmulq_n_f32(y1, c), x1, s);
+        x0 = t0;
+        x1 = t1;
+    }
+}
+
+static const struct i2s_signal_ops i2s_signal_neon = {
+    .tone = tone_neon,
+};
+#endif /* I2S_SIGNAL_NEON */
+
+/* Pick the widest kernels the CPU runs, once per process */
+static const struct i2s_signal_ops *i2s_signal_ops_get(void)
+{
+    static const struct i2s_signal_ops *selected;
+    const struct i2s_signal_ops *ops;
+    
+    ops = __atomic_load_n(&selected, __ATOMIC_ACQUIRE);
+    if (ops)
+        return ops;
+    
+    ops = &i2s_signal_scalar;
+#if defined(I2S_SIGNAL_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        ops = &i2s_signal_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        ops = &i2s_signal_sse2;
+#elif defined(I2S_SIGNAL_NEON)
+    ops = &i2s_signal_neon;
+#endif
+    
+    __atomic_store_n(&selected, ops, __ATOMIC_RELEASE);
+    return ops;
+}
+
+/*
+ * Add n frames of a tone at phase and inc (cycles) to out: the phasors
+ * of the first I2S_SIGNAL_LANES frames, and their turn per step, come
+ * from one sin/cos pair each for the phase and the increment.
+ */
+static void i2s_signal_tone(const struct i2s_signal_ops *ops, float *out,
+                            double phase, double inc, double amplitude,
+                            size_t n)
+{
+    float re[I2S_SIGNAL_LANES], im[I2S_SIGNAL_LANES];
+    double zr, zi, wr, wi, t;
+    int k;
+    
+    zr = amplitude * cos(I2S_SIGNAL_TWO_PI * phase);
+    zi = amplitude * sin(I2S_SIGNAL_TWO_PI * phase);
+    wr = cos(I2S_SIGNAL_TWO_PI * inc);
+    wi = sin(I2S_SIGNAL_TWO_PI * inc);
+    
+    for (k = 0; k < I2S_SIGNAL_LANES; k++) {
+        re[k] = (float)zr;
+        im[k] = (float)zi;
+        t = zr * wr - zi * wi;
+        zi = zr * wi + zi * wr;
+        zr = t;
+    }
+    
+    /* The turn per step is w^8, three squarings of w */
+    for (k = 0; k < 3; k++) {
+        t = wr * wr - wi * wi;
+        wi = 2.0 * wr * wi;
+        wr = t;
+    }
+    
+    ops->tone(out, re, im, (float)wr, (float)wi,
+              (n + I2S_SIGNAL_LANES - 1) & ~(size_t)(I2S_SIGNAL_LANES - 1));
+}
+
+/*
+ * n frames of a sweep from the increment at the current frame: a chirp,
+ * whose rotator turns by a fixed amount each frame. A log sweep is
+ * followed in pieces by the linear chirp that covers the same phase, so
+ * the phase is exact at the end of every piece.
+ */
+static void i2s_signal_sweep(struct i2s_signal_gen *g, float *out, size_t n)
+{
+    const i2s_signal_config_t *cfg = &g->config;
+    int log_sweep = cfg->type == I2S_SIGNAL_SWEEP_LOG;
+    double inc = g->sweep_inc, next, dinc, zr, zi, wr, wi, rr, ri, t;
+    size_t i;
+    
+    if (!log_sweep) {
+        next = inc + g->sweep_step * (double)n;
+        dinc = g->sweep_step;
+    } else {
+        /* The geometric series of the increments gives the phase */
+        next = inc * pow(g->sweep_step, (double)n);
+        dinc = 0.0;
+        if (n > 1 && g->sweep_step != 1.0)
+            dinc = 2.0 * ((next - inc) / (g->sweep_step - 1.0) - inc * (double)n) /
+                ((double)n * (double)(n - 1));
+    }
+    
+    zr = cos(I2S_SIGNAL_TWO_PI * g->phase[0]);
+    zi = sin(I2S_SIGNAL_TWO_PI * g->phase[0]);
+    wr = cos(I2S_SIGNAL_TWO_PI * inc);
+    wi = sin(I2S_SIGNAL_TWO_PI * inc);
+    rr = cos(I2S_SIGNAL_TWO_PI * dinc);
+    ri = sin(I2S_SIGNAL_TWO_PI * dinc);
+    
+    for (i = 0; i < n; i++) {
+        out[i] = (float)(cfg->amplitude * zi);
+        t = zr * wr - zi * wi;
+        zi = zr * wi + zi * wr;
+        zr = t;
+        t = wr * rr - wi * ri;
+        wi = wr * ri + wi * rr;
+        wr = t;
+    }
+    
+    /* The phase the recursion reached, kept exact in double */
+    g->phase[0] += inc * (double)n + dinc * (double)n * (double)(n - 1) / 2.0;
+    g->phase[0] -= floor(g->phase[0]);
+    g->sweep_inc = next;
+}
+
+/* Uniform in -1 .. 1 (xorshift32) */
+static float i2s_signal_white(uint32_t *state)
+{
+    uint32_t x = *state;
+    
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return (float)(int32_t)x * (1.0f / 2147483648.0f);
+}
+
+/* Restart a sweep at its first frequency */
+static void i2s_signal_sweep_start(struct i2s_signal_gen *g, int sample_rate)
+{
+    const i2s_signal_config_t *cfg = &g->config;
+    
+    g->sweep_inc = cfg->freq / sample_rate;
+    g->sweep_done = 0.0;
+    if (cfg->type == I2S_SIGNAL_SWEEP_LOG)
+        g->sweep_step = pow(cfg->freq_end / cfg->freq, 1.0 / g->sweep_frames);
+    else
+        g->sweep_step = (cfg->freq_end - cfg->freq) / sample_rate /
+            g->sweep_frames;
+}
+
+/* Back to the start of the configured signal */
+static void i2s_signal_gen_reset(struct i2s_signal_gen *g, int sample_rate,
+                                 int channel)
+{
+    const i2s_signal_config_t *cfg = &g->config;
+    int t;
+    
+    memset(g->phase, 0, sizeof(g->phase));
+    memset(g->inc, 0, sizeof(g->inc));
+    memset(g->pink, 0, sizeof(g->pink));
+    
+    if (cfg->type == I2S_SIGNAL_SINE) {
+        g->phase[0] = cfg->phase - floor(cfg->phase);
+        g->inc[0] = cfg->freq / sample_rate;
+    } else if (cfg->type == I2S_SIGNAL_MULTITONE) {
+        for (t = 0; t < cfg->ntones; t++) {
+            g->phase[t] = cfg->tones[t].phase - floor(cfg->tones[t].phase);
+            g->inc[t] = cfg->tones[t].freq / sample_rate;
+        }
+    } else if (cfg->type == I2S_SIGNAL_SWEEP_LINEAR ||
+               cfg->type == I2S_SIGNAL_SWEEP_LOG) {
+        g->phase[0] = cfg->phase - floor(cfg->phase);
+        g->sweep_frames = cfg->duration * sample_rate;
+        i2s_signal_sweep_start(g, sample_rate);
+    }
+    
+    /* Each channel gets its own noise unless a seed is given */
+    g->rng = cfg->seed ? cfg->seed : 0x9E3779B9u * (uint32_t)(channel + 1);
+}
+
+/*
+ * n frames of a generator into out. A generator nobody hears only moves
+ * its phases on, so it picks up where it would have been.
+ */
+static void i2s_signal_gen_run(i2s_signal_t sig, struct i2s_signal_gen *g,
+                               float *out, size_t n, int heard)
+{
+    const i2s_signal_config_t *cfg = &g->config;
+    float white, *b = g->pink;
+    size_t i, m;
+    int t;
+    
+    switch (cfg->type) {
+    case I2S_SIGNAL_SINE:
+    case I2S_SIGNAL_MULTITONE:
+        if (heard) {
+            memset(out, 0, I2S_SIGNAL_BLOCK * sizeof(float));
+            for (t = 0; t < (cfg->type == I2S_SIGNAL_SINE ? 1 : cfg->ntones); t++)
+                i2s_signal_tone(sig->ops, out, g->phase[t], g->inc[t],
+                                cfg->amplitude * (cfg->type == I2S_SIGNAL_SINE ?
+                                                  1.0 : cfg->tones[t].amplitude),
+                                n);
+        }
+        for (t = 0; t < I2S_SIGNAL_MAX_TONES; t++) {
+            g->phase[t] += g->inc[t] * (double)n;
+            g->phase[t] -= floor(g->phase[t]);
+        }
+        break;
+    case I2S_SIGNAL_SWEEP_LINEAR:
+    case I2S_SIGNAL_SWEEP_LOG:
+        /* The phase carries on when a sweep restarts */
+        for (i = 0; i < n; i += m) {
+            m = n - i;
+            if (cfg->type == I2S_SIGNAL_SWEEP_LOG && m > I2S_SIGNAL_LOG_CHUNK)
+                m = I2S_SIGNAL_LOG_CHUNK;
+            if (m > g->sweep_frames - g->sweep_done)
+                m = (size_t)ceil(g->sweep_frames - g->sweep_done);
+            i2s_signal_sweep(g, out + i, m);
+            g->sweep_done += (double)m;
+            if (g->sweep_done >= g->sweep_frames)
+                i2s_signal_sweep_start(g, sig->sample_rate);
+        }
+        break;
+    case I2S_SIGNAL_WHITE_NOISE:
+        for (i = 0; i < n; i++)
+            out[i] = (float)cfg->amplitude * i2s_signal_white(&g->rng);
+        break;
+    case I2S_SIGNAL_PINK_NOISE:
+        /* Paul Kellet's filter, within 0.05 dB of -3 dB/octave */
+        for (i = 0; i < n; i++) {
+            white = i2s_signal_white(&g->rng);
+            b[0] = 0.99886f * b[0] + white * 0.0555179f;
+            b[1] = 0.99332f * b[1] + white * 0.0750759f;
+            b[2] = 0.96900f * b[2] + white * 0.1538520f;
+            b[3] = 0.86650f * b[3] + white * 0.3104856f;
+            b[4] = 0.55000f * b[4] + white * 0.5329522f;
+            b[5] = -0.7616f * b[5] - white * 0.0168980f;
+            out[i] = (float)cfg->amplitude * 0.11f *
+                (b[0] + b[1] + b[2] + b[3] + b[4] + b[5] + b[6] +
+                 white * 0.5362f);
+            b[6] = white * 0.115926f;
+        }
+        break;
+    default:
+        memset(out, 0, n * sizeof(float));
+        break;
+    }
+}
+
+static int i2s_signal_config_valid(i2s_signal_t sig,
+                                   const i2s_signal_config_t *cfg)
+{
+    double nyquist = sig->sample_rate / 2.0;
+    int t;
+    
+    if (cfg->amplitude < 0.0)
+        return 0;
+    
+    switch (cfg->type) {
+    case I2S_SIGNAL_SILENCE:
+    case I2S_SIGNAL_WHITE_NOISE:
+    case I2S_SIGNAL_PINK_NOISE:
+        return 1;
+    case I2S_SIGNAL_SINE:
+        return cfg->freq >= 0.0 && cfg->freq < nyquist;
+    case I2S_SIGNAL_MULTITONE:
+        if (cfg->ntones < 1 || cfg->ntones > I2S_SIGNAL_MAX_TONES)
+            return 0;
+        for (t = 0; t < cfg->ntones; t++)
+            if (cfg->tones[t].freq < 0.0 || cfg->tones[t].freq >= nyquist)
+                return 0;
+        return 1;
+    case I2S_SIGNAL_SWEEP_LINEAR:
+    case I2S_SIGNAL_SWEEP_LOG:
+        return cfg->freq > 0.0 && cfg->freq < nyquist &&
+               cfg->freq_end > 0.0 && cfg->freq_end < nyquist &&
+               cfg->duration * sig->sample_rate >= 1.0;
+    default:
+        return 0;
+    }
+}
+
+/* A generator per channel, all silent */
+i2s_signal_t i2s_signal_create(int sample_rate, int channels)
+{
+    i2s_signal_t sig;
+    int ch;
+    
+    if (sample_rate <= 0 || channels <= 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    
+    sig = calloc(1, sizeof(*sig));
+    if (!sig) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    
+    sig->ops = i2s_signal_ops_get();
+    sig->sample_rate = sample_rate;
+    sig->channels = channels;
+    sig->solo = -1;
+    sig->source = calloc((size_t)channels, sizeof(*sig->source));
+    sig->gen = calloc((size_t)channels, sizeof(*sig->gen));
+    sig->plane = malloc((size_t)channels * I2S_SIGNAL_BLOCK * sizeof(float));
+    sig->frames = malloc((size_t)channels * I2S_SIGNAL_BLOCK * sizeof(float));
+    if (!sig->source || !sig->gen || !sig->plane || !sig->frames) {
+        i2s_signal_destroy(sig);
+        errno = ENOMEM;
+        return NULL;
+    }
+    
+    for (ch = 0; ch < channels; ch++)
+        sig->source[ch] = ch;
+    return sig;
+}
+
+void i2s_signal_destroy(i2s_signal_t sig)
+{
+    if (!sig)
+        return;
+    
+    free(sig->source);
+    free(sig->gen);
+    free(sig->plane);
+    free(sig->frames);
+    free(sig);
+}
+
+/*
+ * Set the signal of a channel, or with channel -1 of every channel
+ * through one shared generator. Starts the signal from the beginning.
+ */
+int i2s_signal_set(i2s_signal_t sig, int channel,
+                   const i2s_signal_config_t *config)
+{
+    int ch;
+    
+    if (!sig || !config || channel < -1 || channel >= sig->channels ||
+        !i2s_signal_config_valid(sig, config)) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    if (channel < 0) {
+        for (ch = 0; ch < sig->channels; ch++)
+            sig->source[ch] = 0;
+        channel = 0;
+    } else {
+        /* Channels that shared this generator keep what they had */
+        for (ch = 0; ch < sig->channels; ch++) {
+            if (ch != channel && sig->source[ch] == channel) {
+                sig->gen[ch] = sig->gen[channel];
+                sig->source[ch] = ch;
+            }
+        }
+        sig->source[channel] = channel;
+    }
+    
+    sig->gen[channel].config = *config;
+    i2s_signal_gen_reset(&sig->gen[channel], sig->sample_rate, channel);
+    return 0;
+}
+
+/* Set channel c to a sine at freq + c * step, to tell channels apart */
+int i2s_signal_set_ladder(i2s_signal_t sig, double freq, double step,
+                          double amplitude)
+{
+    i2s_signal_config_t config;
+    int ch;
+    
+    if (!sig) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    memset(&config, 0, sizeof(config));
+    config.type = I2S_SIGNAL_SINE;
+    config.amplitude = amplitude;
+    
+    for (ch = 0; ch < sig->channels; ch++) {
+        config.freq = freq + ch * step;
+        if (i2s_signal_set(sig, ch, &config) < 0)
+            return -1;
+    }
+    
+    return 0;
+}
+
+/* Silence every channel but one, -1 to hear all again */
+int i2s_signal_solo(i2s_signal_t sig, int channel)
+{
+    if (!sig || channel < -1 || channel >= sig->channels) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    sig->solo = channel;
+    return 0;
+}
+
+/* Start every signal from the beginning */
+void i2s_signal_reset(i2s_signal_t sig)
+{
+    int ch;
+    
+    if (!sig)
+        return;
+    
+    for (ch = 0; ch < sig->channels; ch++)
+        if (sig->source[ch] == ch)
+            i2s_signal_gen_reset(&sig->gen[ch], sig->sample_rate, ch);
+}
+
+/* Generate interleaved frames of every channel in format */
+int i2s_signal_generate(i2s_signal_t sig, void *buffer, i2s_sample_t format,
+                        size_t frames, unsigned int flags)
+{
+    size_t frame_bytes, done, n, i;
+    int ch, src, heard, nch;
+    const float *plane;
+    float *out;
+    
+    if (!sig || (!buffer && frames)) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    nch = sig->channels;
+    frame_bytes = i2s_sample_size(format) * nch;
+    if (!frame_bytes) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    for (done = 0; done < frames; done += n) {
+        n = frames - done;
+        if (n > I2S_SIGNAL_BLOCK)
+            n = I2S_SIGNAL_BLOCK;
+        
+        for (ch = 0; ch < nch; ch++) {
+            if (sig->source[ch] != ch)
+                continue;
+            
+            heard = 0;
+            for (i = 0; i < (size_t)nch && !heard; i++)
+                heard = sig->source[i] == ch &&
+                        (sig->solo < 0 || sig->solo == (int)i);
+            i2s_signal_gen_run(sig, &sig->gen[ch],
+                               sig->plane + (size_t)ch * I2S_SIGNAL_BLOCK,
+                               n, heard);
+        }
+        
+        for (ch = 0; ch < nch; ch++) {
+            src = sig->source[ch];
+            plane = sig->plane + (size_t)src * I2S_SIGNAL_BLOCK;
+            out = sig->frames + ch;
+            
+            if (sig->solo >= 0 && sig->solo != ch) {
+                for (i = 0; i < n; i++, out += nch)
+                    *out = 0.0f;
+            } else {
+                for (i = 0; i < n; i++, out += nch)
+                    *out = plane[i];
+            }
+        }
+        
+        if (i2s_convert((char *)buffer + done * frame_bytes, format,
+                        sig->frames, I2S_SAMPLE_FLOAT32, n * nch,
+                        flags | I2S_CONVERT_SATURATE) < 0)
+            return -1;
+    }
+    
+    return 0;
+}
+
+/*
+ * Generate frames straight into the mapped playback ring of handle, in
+ * its sample format. Blocks in poll() for space unless the handle is
+ * non-blocking; returns frames written.
+ */
+ssize_t i2s_signal_write(i2s_signal_t sig, i2s_handle_t handle, size_t frames,
+                         unsigned int flags)
+{
+    i2s_params_t params;
+    i2s_sample_t format;
+    struct pollfd pfd;
+    size_t frame_bytes, done = 0, n, avail;
+    void *area;
+    int nonblock;
+    
+    if (!sig || !handle || i2s_get_params(handle, &params) < 0 ||
+        params.channels != sig->channels) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    format = i2s_format_sample(params.format);
+    frame_bytes = i2s_sample_size(format) * params.channels;
+    pfd.fd = i2s_get_fd(handle);
+    nonblock = fcntl(pfd.fd, F_GETFL) & O_NONBLOCK;
+    
+    while (done < frames) {
+        if (i2s_mmap_begin(handle, I2S_STREAM_PLAYBACK, &area, &avail) < 0) {
+            break;
+        }
+        
+        n = avail / frame_bytes;
+        if (n > frames - done)
+            n = frames - done;
+        
+        if (n) {
+            if (i2s_signal_generate(sig, area, format, n, flags) < 0)
+                break;
+            /* The frames are queued even if the autostart failed */
+            done += n;
+            if (i2s_mmap_commit(handle, I2S_STREAM_PLAYBACK, n * frame_bytes) < 0)
+                break;
+            continue;
+        }
+        
+        if (nonblock) {
+            errno = EAGAIN;
+            break;
+        }
+        
+        pfd.events = POLLOUT;
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        
+        /* Stopped, or xrun: the next i2s_mmap_begin() reports that */
+        if ((pfd.revents & POLLERR) && i2s_get_status(handle) != I2S_STATUS_XRUN) {
+            errno = EINVAL;
+            break;
+        }
+    }
+    
+    return done ? (ssize_t)done : -1;
+}
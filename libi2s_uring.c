@@ -0,0 +1,314 @@
+/*
+ * libi2s_uring.c - io_uring submission backend for libi2s
+ *
+ * Queues reads and writes on any number of I2S handles and submits them,
+ * and reaps their completions, with one io_uring_enter() per batch.
+ * Talks to the kernel directly, so there is no liburing dependency.
+ */
+
+#include "libi2s.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* Handles that can be registered with one ring */
+#define I2S_URING_MAX_FILES 64
+
+struct i2s_uring_s {
+    int fd;
+    
+    /* Submission queue; only sq_head is written by the kernel */
+    void *sq_ptr;
+    size_t sq_len;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_array;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned int sq_local_tail;     /* prepared, maybe not yet published */
+    unsigned int pending;           /* published, not yet consumed */
+    
+    /* Completion queue; only cq_tail is written by the kernel */
+    void *cq_ptr;
+    size_t cq_len;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+    
+    /* Registered handles: fds[i] is fixed file i */
+    int fds[I2S_URING_MAX_FILES];
+    unsigned int nfds;
+};
+
+static int i2s_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int i2s_uring_enter(int fd, unsigned int to_submit,
+                           unsigned int min_complete, unsigned int flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+static int i2s_uring_register(int fd, unsigned int opcode, const void *arg,
+                              unsigned int nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Create a ring with room for at least entries queued requests */
+i2s_uring_t i2s_uring_create(unsigned int entries)
+{
+    struct io_uring_params p;
+    i2s_uring_t ring;
+    char *sq, *cq;
+    
+    ring = calloc(1, sizeof(*ring));
+    if (!ring) {
+        return NULL;
+    }
+    
+    memset(&p, 0, sizeof(p));
+    ring->fd = i2s_uring_setup(entries, &p);
+    if (ring->fd < 0) {
+        free(ring);
+        return NULL;
+    }
+    
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_len > ring->sq_len)
+            ring->sq_len = ring->cq_len;
+        ring->cq_len = ring->sq_len;
+    }
+    
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+        goto err_sq;
+    
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED)
+            goto err_cq;
+    }
+    
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto err_sqes;
+    
+    sq = ring->sq_ptr;
+    ring->sq_head = (unsigned int *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    ring->sq_array = (unsigned int *)(sq + p.sq_off.array);
+    ring->sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    
+    cq = ring->cq_ptr;
+    ring->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    ring->cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    
+    return ring;
+    
+err_sqes:
+    if (ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_len);
+err_cq:
+    munmap(ring->sq_ptr, ring->sq_len);
+err_sq:
+    close(ring->fd);
+    free(ring);
+    return NULL;
+}
+
+void i2s_uring_destroy(i2s_uring_t ring)
+{
+    if (!ring)
+        return;
+    
+    munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_len);
+    munmap(ring->sq_ptr, ring->sq_len);
+    close(ring->fd);
+    free(ring);
+}
+
+/*
+ * Pin buffers for the *_FIXED operations: the kernel maps them once here
+ * instead of on every request. Pass buf_index >= 0 to the prep calls to
+ * use them.
+ */
+int i2s_uring_register_buffers(i2s_uring_t ring, const struct iovec *iov,
+                               unsigned int count)
+{
+    if (!ring || !iov) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    return i2s_uring_register(ring->fd, IORING_REGISTER_BUFFERS, iov, count);
+}
+
+/* Register device handles, so requests skip the per-call file lookup */
+int i2s_uring_register_handles(i2s_uring_t ring, const i2s_handle_t *handles,
+                               unsigned int count)
+{
+    unsigned int i;
+    
+    if (!ring || !handles || !count || count > I2S_URING_MAX_FILES ||
+        ring->nfds) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    for (i = 0; i < count; i++) {
+        ring->fds[i] = i2s_get_fd(handles[i]);
+        if (ring->fds[i] < 0) {
+            errno = EBADF;
+            return -1;
+        }
+    }
+    
+    if (i2s_uring_register(ring->fd, IORING_REGISTER_FILES, ring->fds, count) < 0) {
+        return -1;
+    }
+    
+    ring->nfds = count;
+    return 0;
+}
+
+/* Queue one read or write; nothing reaches the kernel until completion time */
+static int i2s_uring_prep(i2s_uring_t ring, int opcode, i2s_handle_t handle,
+                          void *buf, size_t len, int buf_index,
+                          uint64_t user_data)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int head, idx, i;
+    int fd;
+    
+    if (!ring || !buf || len > UINT32_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    fd = i2s_get_fd(handle);
+    if (fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries) {
+        /* Reap some completions first */
+        errno = EBUSY;
+        return -1;
+    }
+    
+    idx = ring->sq_local_tail & ring->sq_mask;
+    sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (uint8_t)opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)len;
+    sqe->user_data = user_data;
+    if (buf_index >= 0)
+        sqe->buf_index = (uint16_t)buf_index;
+    
+    for (i = 0; i < ring->nfds; i++) {
+        if (ring->fds[i] == fd) {
+            sqe->fd = (int)i;
+            sqe->flags |= IOSQE_FIXED_FILE;
+            break;
+        }
+    }
+    
+    ring->sq_array[idx] = idx;
+    ring->sq_local_tail++;
+    return 0;
+}
+
+int i2s_uring_prep_read(i2s_uring_t ring, i2s_handle_t handle, void *buf,
+                        size_t len, int buf_index, uint64_t user_data)
+{
+    return i2s_uring_prep(ring, buf_index >= 0 ? IORING_OP_READ_FIXED :
+                          IORING_OP_READ, handle, buf, len, buf_index,
+                          user_data);
+}
+
+int i2s_uring_prep_write(i2s_uring_t ring, i2s_handle_t handle,
+                         const void *buf, size_t len, int buf_index,
+                         uint64_t user_data)
+{
+    return i2s_uring_prep(ring, buf_index >= 0 ? IORING_OP_WRITE_FIXED :
+                          IORING_OP_WRITE, handle, (void *)buf, len,
+                          buf_index, user_data);
+}
+
+/*
+ * Submit everything queued, wait for at least min_complete completions
+ * and reap up to max of them, with a single io_uring_enter(). Returns the
+ * number of completions stored in cqes.
+ */
+int i2s_uring_complete(i2s_uring_t ring, i2s_uring_cqe_t *cqes,
+                       unsigned int max, unsigned int min_complete)
+{
+    unsigned int head, tail, n = 0;
+    int ret;
+    
+    if (!ring || (max && !cqes)) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    /* Publish the prepared entries before the kernel looks at the tail */
+    ring->pending += ring->sq_local_tail - *ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    
+    /* Skip the syscall when there is nothing to submit and enough done */
+    if (ring->pending || tail - head < min_complete) {
+        ret = i2s_uring_enter(ring->fd, ring->pending, min_complete,
+                              min_complete ? IORING_ENTER_GETEVENTS : 0);
+        if (ret < 0) {
+            return -1;
+        }
+        ring->pending -= (unsigned int)ret;
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    }
+    
+    while (head != tail && n < max) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+        
+        cqes[n].user_data = cqe->user_data;
+        cqes[n].result = cqe->res;
+        n++;
+        head++;
+    }
+    
+    /* Hand the slots back once they are read */
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return (int)n;
+}